@@ -0,0 +1,591 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "fingerprinting.h"
+#include "fingerprintio.h"
+#include "lsh.h"
+#include "search.h"
+#include "toolutils.h"
+#include "wav.h"
+
+// This program measures how well and how fast samples are identified, on a
+// synthetic corpus that is the same on every machine, so that it can be used
+// to check that an optimization of the fingerprinting or search code does not
+// degrade the results:
+//
+//   $ make accuracy
+//   $ ./accuracy /tmp/corpus
+//
+// It first generates the corpus in the given directory as 44100Hz 16-bit stereo
+// wave files: some tracks made of tones, some of chords and some of rhythms made
+// of noise bursts. The indexed tracks are fingerprinted into a database, also
+// saved in the directory, while a few other tracks are kept aside.
+//
+// Then it takes random excerpts of the tracks, changes their gain, adds noise
+// and tries to identify them. The excerpts of the indexed tracks must be found
+// in the right track (recall), and the excerpts of the other tracks must not be
+// found at all (false positive rate). The fingerprinting and search latencies of
+// the excerpts are reported as percentiles.
+//
+// With -min-recall and -max-fpr, the program exits with 1 when the results are
+// worse than the given values, so that it can be used as a gate in scripts.
+
+#define SAMPLE_RATE 44100
+
+// The maximum error on the position of an excerpt to consider it correct
+#define MAX_OFFSET_ERROR_IN_SECONDS 1.0
+
+#define MAX_RESULTS 5
+
+
+struct options {
+    const char* dir;
+    unsigned int n_tracks;
+    unsigned int n_unknown_tracks;
+    float track_seconds;
+    unsigned int n_queries;
+    float query_seconds;
+    float min_snr_db;
+    float max_snr_db;
+    uint64_t seed;
+    int json;
+    float min_recall;
+    float max_fpr;
+};
+
+
+struct query_stats {
+    unsigned int n_queries;
+    unsigned int n_found;
+    unsigned int n_right_offset;
+    unsigned int n_wrong_entry;
+    unsigned int n_false_positives;
+
+    // The latencies of all the queries in milliseconds
+    double* fingerprint_ms;
+    double* search_ms;
+};
+
+
+// Each track has its own tuning and timbre, so that two tracks
+// that happen to play the same notes still sound different
+static float tuning;
+static float harmonics[2];
+
+
+/**
+ * Returns the frequency of the given note, as a number of
+ * semitones from the A of the tuning of the current track.
+ */
+static float get_frequency(int semitones) {
+    return tuning * powf(2.0, semitones / 12.0);
+}
+
+
+/**
+ * Adds a note with a few harmonics and an attack/decay envelope.
+ */
+static void add_note(float* samples, unsigned int n_samples, unsigned int start, unsigned int length,
+                     float frequency, float amplitude) {
+    unsigned int attack = SAMPLE_RATE / 100;
+    for (unsigned int i = 0 ; i < length && start + i < n_samples ; i++) {
+        float envelope = i < attack ? i / (float)attack : expf(-3.0 * (i - attack) / (float)length);
+        float t = i / (float)SAMPLE_RATE;
+        float value = sinf(2 * M_PI * frequency * t) + harmonics[0] * sinf(4 * M_PI * frequency * t)
+                        + harmonics[1] * sinf(6 * M_PI * frequency * t);
+        samples[start + i] += amplitude * envelope * value;
+    }
+}
+
+
+/**
+ * A melody of single notes of random pitches and durations.
+ */
+static void add_tones(float* samples, unsigned int n_samples, float amplitude) {
+    unsigned int position = 0;
+    while (position < n_samples) {
+        unsigned int length = (unsigned int)(SAMPLE_RATE * (0.15 + 0.6 * random_float()));
+        add_note(samples, n_samples, position, length, get_frequency(-24 + next_random() % 36), amplitude);
+        position += length;
+    }
+}
+
+
+/**
+ * Chords of 3 or 4 notes over a bass note.
+ */
+static void add_chords(float* samples, unsigned int n_samples, float amplitude) {
+    static const int intervals[2][4] = { { 0, 4, 7, 11 }, { 0, 3, 7, 10 } };
+    unsigned int position = 0;
+    while (position < n_samples) {
+        unsigned int length = (unsigned int)(SAMPLE_RATE * (0.3 + 0.6 * random_float()));
+        int root = -12 + next_random() % 12;
+        const int* chord = intervals[next_random() % 2];
+        unsigned int n_notes = 3 + next_random() % 2;
+        for (unsigned int k = 0 ; k < n_notes ; k++) {
+            add_note(samples, n_samples, position, length, get_frequency(root + chord[k]), amplitude / n_notes);
+        }
+        add_note(samples, n_samples, position, length, get_frequency(root - 24), amplitude / 2);
+        position += length;
+    }
+}
+
+
+/**
+ * A drum pattern repeated at a random tempo: filtered noise bursts
+ * of random colors, and kicks made of a falling sine sweep.
+ */
+static void add_rhythm(float* samples, unsigned int n_samples, float amplitude) {
+    unsigned int step = (unsigned int)(SAMPLE_RATE * 60.0 / (90 + next_random() % 80) / 4);
+    unsigned int pattern = (unsigned int)next_random();
+    float colors[32];
+    for (unsigned int k = 0 ; k < 32 ; k++) {
+        colors[k] = 0.05 + 0.9 * random_float();
+    }
+
+    for (unsigned int s = 0 ; s * step < n_samples ; s++) {
+        unsigned int start = s * step;
+        unsigned int k = s % 32;
+        if (k % 8 == 0) {
+            // Kick
+            float phase = 0;
+            for (unsigned int i = 0 ; i < step && start + i < n_samples ; i++) {
+                phase += 2 * M_PI * (50 + 100 * expf(-40.0 * i / SAMPLE_RATE)) / SAMPLE_RATE;
+                samples[start + i] += amplitude * expf(-12.0 * i / SAMPLE_RATE) * sinf(phase);
+            }
+        }
+        if (pattern & (1u << k)) {
+            // A noise burst, low pass filtered by a factor that gives its color
+            float filtered = 0;
+            for (unsigned int i = 0 ; i < step && start + i < n_samples ; i++) {
+                filtered += colors[k] * ((2 * random_float() - 1) - filtered);
+                samples[start + i] += 0.6 * amplitude * expf(-25.0 * i / SAMPLE_RATE) * filtered;
+            }
+        }
+    }
+}
+
+
+/**
+ * Generates the mono samples of track #n, which only depend on the seed and n.
+ */
+static float* generate_track(uint64_t seed, unsigned int n, unsigned int n_samples) {
+    float* samples = (float*)calloc(n_samples, sizeof(float));
+    if (samples == NULL) {
+        return NULL;
+    }
+    set_random_state(seed * 0x9E3779B97F4A7C15ULL + n + 1);
+    for (int k = 0 ; k < 8 ; k++) {
+        next_random();
+    }
+    // Up to a half tone away from 440Hz
+    tuning = 440.0 * powf(2.0, (random_float() - 0.5) / 12.0);
+    harmonics[0] = random_float();
+    harmonics[1] = random_float() * harmonics[0];
+    switch (n % 3) {
+        case 0:
+            add_tones(samples, n_samples, 0.3);
+            add_rhythm(samples, n_samples, 0.1);
+            break;
+        case 1:
+            add_chords(samples, n_samples, 0.25);
+            add_tones(samples, n_samples, 0.1);
+            add_rhythm(samples, n_samples, 0.15);
+            break;
+        default:
+            add_rhythm(samples, n_samples, 0.5);
+            break;
+    }
+    return samples;
+}
+
+
+static void write_uint16(FILE* f, uint16_t value) {
+    fputc(value & 0xFF, f);
+    fputc(value >> 8, f);
+}
+
+
+static void write_uint32(FILE* f, uint32_t value) {
+    write_uint16(f, value & 0xFFFF);
+    write_uint16(f, value >> 16);
+}
+
+
+static int16_t to_pcm(float value) {
+    if (value > 1.0) {
+        value = 1.0;
+    } else if (value < -1.0) {
+        value = -1.0;
+    }
+    return (int16_t)(value * 32767.0);
+}
+
+
+/**
+ * Saves the given mono samples as a 44100Hz 16-bit stereo wave file.
+ */
+static int save_wav(const char* filename, float* samples, unsigned int n_samples) {
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+        return CANNOT_WRITE_FILE;
+    }
+    uint32_t data_size = n_samples * 4;
+    fwrite("RIFF", 1, 4, f);
+    write_uint32(f, 36 + data_size);
+    fwrite("WAVEfmt ", 1, 8, f);
+    write_uint32(f, 16);
+    write_uint16(f, 1);
+    write_uint16(f, 2);
+    write_uint32(f, SAMPLE_RATE);
+    write_uint32(f, SAMPLE_RATE * 4);
+    write_uint16(f, 4);
+    write_uint16(f, 16);
+    fwrite("data", 1, 4, f);
+    write_uint32(f, data_size);
+    for (unsigned int i = 0 ; i < n_samples ; i++) {
+        uint16_t value = (uint16_t)to_pcm(samples[i]);
+        write_uint16(f, value);
+        write_uint16(f, value);
+    }
+    int res = ferror(f) ? CANNOT_WRITE_FILE : SUCCESS;
+    if (fclose(f) != 0) {
+        res = CANNOT_WRITE_FILE;
+    }
+    return res;
+}
+
+
+/**
+ * Generates the indexed tracks, fingerprints them into a database
+ * saved as <dir>/db, and generates the tracks that are not indexed.
+ */
+static int build_corpus(struct options* o, struct index* *database) {
+    mkdir(o->dir, 0755);
+    (*database) = (struct index*)malloc(sizeof(struct index));
+    if ((*database) == NULL) {
+        return MEMORY_ERROR;
+    }
+    (*database)->n_entries = 0;
+    (*database)->n_buckets = 0;
+    (*database)->bytes_per_bucket = 0;
+    (*database)->entries = (struct index_entry**)malloc(o->n_tracks * sizeof(struct index_entry*));
+    if ((*database)->entries == NULL) {
+        return MEMORY_ERROR;
+    }
+
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s/db", o->dir);
+    FILE* db = fopen(filename, "w");
+    if (db == NULL) {
+        return CANNOT_WRITE_FILE;
+    }
+
+    unsigned int n_samples = (unsigned int)(o->track_seconds * SAMPLE_RATE);
+    for (unsigned int n = 0 ; n < o->n_tracks + o->n_unknown_tracks ; n++) {
+        float* samples = generate_track(o->seed, n, n_samples);
+        if (samples == NULL) {
+            fclose(db);
+            return MEMORY_ERROR;
+        }
+        snprintf(filename, sizeof(filename), "%s/track%03u.wav", o->dir, n);
+        int res = save_wav(filename, samples, n_samples);
+        free(samples);
+        if (res != SUCCESS) {
+            fclose(db);
+            return res;
+        }
+        if (n >= o->n_tracks) {
+            continue;
+        }
+
+        struct index_entry* entry = (struct index_entry*)calloc(1, sizeof(struct index_entry));
+        if (entry == NULL) {
+            fclose(db);
+            return MEMORY_ERROR;
+        }
+        res = generate_fingerprint(filename, &(entry->signatures), NULL, NULL, NULL, NULL);
+        if (res != SUCCESS) {
+            free(entry);
+            fclose(db);
+            return res;
+        }
+        entry->filename = strdup(filename);
+        entry->artist = strdup("");
+        entry->track_title = strdup("");
+        entry->album_title = strdup("");
+        (*database)->entries[((*database)->n_entries)++] = entry;
+        if (entry->filename == NULL || entry->artist == NULL || entry->track_title == NULL || entry->album_title == NULL) {
+            fclose(db);
+            return MEMORY_ERROR;
+        }
+        save(db, entry->signatures, entry->filename, NULL, NULL, NULL);
+    }
+    return fclose(db) == 0 ? SUCCESS : CANNOT_WRITE_FILE;
+}
+
+
+/**
+ * Turns the given excerpt of a track into 16-bit stereo PCM data like the
+ * serve mode receives it, after applying the given gain and adding white
+ * noise with the given signal to noise ratio.
+ */
+static uint8_t* make_query_pcm(float* samples, unsigned int n_samples, float gain, float snr_db) {
+    uint8_t* pcm = (uint8_t*)malloc(n_samples * 4);
+    if (pcm == NULL) {
+        return NULL;
+    }
+    float power = 0;
+    for (unsigned int i = 0 ; i < n_samples ; i++) {
+        power += samples[i] * samples[i];
+    }
+    power /= n_samples;
+    // Uniform noise in [-a;a] has a power of a²/3
+    float noise_amplitude = sqrtf(3.0 * power / powf(10.0, snr_db / 10.0));
+    for (unsigned int i = 0 ; i < n_samples ; i++) {
+        float value = gain * (samples[i] + noise_amplitude * (2 * random_float() - 1));
+        uint16_t pcm_value = (uint16_t)to_pcm(value);
+        for (int c = 0 ; c < 2 ; c++) {
+            pcm[4 * i + 2 * c] = pcm_value & 0xFF;
+            pcm[4 * i + 2 * c + 1] = pcm_value >> 8;
+        }
+    }
+    return pcm;
+}
+
+
+/**
+ * Runs the given number of queries on excerpts of tracks taken among
+ * [first_track;first_track+n_tracks[. If indexed is 0, these tracks
+ * are not in the database, so any match is a false positive.
+ */
+static int run_queries(struct options* o, struct index* database, struct lsh* lsh,
+                       unsigned int first_track, unsigned int n_tracks, int indexed, struct query_stats* stats) {
+    unsigned int track_samples = (unsigned int)(o->track_seconds * SAMPLE_RATE);
+    unsigned int query_samples = (unsigned int)(o->query_seconds * SAMPLE_RATE);
+    stats->fingerprint_ms = (double*)malloc(o->n_queries * sizeof(double));
+    stats->search_ms = (double*)malloc(o->n_queries * sizeof(double));
+    if (stats->fingerprint_ms == NULL || stats->search_ms == NULL) {
+        return MEMORY_ERROR;
+    }
+
+    for (unsigned int q = 0 ; q < o->n_queries ; q++) {
+        // Each query only depends on the seed and its number
+        set_random_state((o->seed + 1) * 0xBF58476D1CE4E5B9ULL + 2 * q + indexed);
+        for (int k = 0 ; k < 8 ; k++) {
+            next_random();
+        }
+        unsigned int track = first_track + next_random() % n_tracks;
+        unsigned int start = next_random() % (track_samples - query_samples);
+        float gain = 0.3 + 1.7 * random_float();
+        float snr_db = o->min_snr_db + (o->max_snr_db - o->min_snr_db) * random_float();
+        uint64_t query_state = next_random();
+
+        float* samples = generate_track(o->seed, track, track_samples);
+        if (samples == NULL) {
+            return MEMORY_ERROR;
+        }
+        set_random_state(query_state);
+        uint8_t* pcm = make_query_pcm(samples + start, query_samples, gain, snr_db);
+        free(samples);
+        if (pcm == NULL) {
+            return MEMORY_ERROR;
+        }
+
+        double before = time_in_milliseconds();
+        float* converted;
+        int n = convert_samples(pcm, query_samples * 4, &converted, NULL);
+        free(pcm);
+        if (n < 0) {
+            return n;
+        }
+        struct signatures* fingerprint;
+        int res = generate_fingerprint_from_samples(converted, n, &fingerprint, NULL);
+        free(converted);
+        if (res != SUCCESS) {
+            return res;
+        }
+        double after_fingerprint = time_in_milliseconds();
+        struct search_result results[MAX_RESULTS];
+        int n_results = search_top_matches(fingerprint, database, lsh, results, MAX_RESULTS, 0);
+        double after_search = time_in_milliseconds();
+        free_signatures(fingerprint);
+        if (n_results < 0) {
+            return n_results;
+        }
+
+        stats->fingerprint_ms[q] = after_fingerprint - before;
+        stats->search_ms[q] = after_search - after_fingerprint;
+        (stats->n_queries)++;
+        if (n_results == 0 || !results[0].is_match) {
+            continue;
+        }
+        if (!indexed) {
+            (stats->n_false_positives)++;
+        } else if ((unsigned int)results[0].entry_index != track) {
+            (stats->n_wrong_entry)++;
+        } else {
+            (stats->n_found)++;
+            if (fabsf(results[0].offset_in_seconds - start / (float)SAMPLE_RATE) <= MAX_OFFSET_ERROR_IN_SECONDS) {
+                (stats->n_right_offset)++;
+            }
+        }
+    }
+    return SUCCESS;
+}
+
+
+static void print_usage(const char* name) {
+    fprintf(stderr, "Usage: %s [options] <dir>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Generates a synthetic corpus in <dir>, indexes it, and measures how well\n");
+    fprintf(stderr, "and how fast noisy excerpts are identified.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -tracks <n>          number of indexed tracks (default: 20)\n");
+    fprintf(stderr, "  -unknown <n>         number of tracks that are not indexed (default: 5)\n");
+    fprintf(stderr, "  -duration <s>        duration of the tracks in seconds (default: 30)\n");
+    fprintf(stderr, "  -queries <n>         number of excerpts of indexed and of unknown tracks (default: 100)\n");
+    fprintf(stderr, "  -length <s>          duration of the excerpts in seconds (default: 5)\n");
+    fprintf(stderr, "  -snr <min> <max>     range of signal to noise ratios in dB (default: 5 30)\n");
+    fprintf(stderr, "  -seed <n>            seed of the corpus and of the queries (default: 1)\n");
+    fprintf(stderr, "  -json                print the results as JSON\n");
+    fprintf(stderr, "  -min-recall <r>      exit with 1 if the recall is lower than r\n");
+    fprintf(stderr, "  -max-fpr <r>         exit with 1 if the false positive rate is higher than r\n");
+}
+
+
+int main(int argc, char* argv[]) {
+    struct options o;
+    o.n_tracks = 20;
+    o.n_unknown_tracks = 5;
+    o.track_seconds = 30;
+    o.n_queries = 100;
+    o.query_seconds = 5;
+    o.min_snr_db = 5;
+    o.max_snr_db = 30;
+    o.seed = 1;
+    o.json = 0;
+    o.min_recall = 0;
+    o.max_fpr = 1;
+
+    int i = 1;
+    for ( ; i < argc && argv[i][0] == '-' ; i++) {
+        if (!strcmp(argv[i], "-json")) {
+            o.json = 1;
+        } else if (!strcmp(argv[i], "-tracks") && i + 1 < argc) {
+            o.n_tracks = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-unknown") && i + 1 < argc) {
+            o.n_unknown_tracks = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-duration") && i + 1 < argc) {
+            o.track_seconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-queries") && i + 1 < argc) {
+            o.n_queries = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-length") && i + 1 < argc) {
+            o.query_seconds = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-snr") && i + 2 < argc) {
+            o.min_snr_db = atof(argv[++i]);
+            o.max_snr_db = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-seed") && i + 1 < argc) {
+            o.seed = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-min-recall") && i + 1 < argc) {
+            o.min_recall = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-max-fpr") && i + 1 < argc) {
+            o.max_fpr = atof(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - i != 1 || o.n_tracks == 0 || o.n_queries == 0 || o.query_seconds < 3
+        || o.track_seconds <= o.query_seconds || o.min_snr_db > o.max_snr_db) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    o.dir = argv[i];
+
+    fprintf(stderr, "Generating and indexing %u tracks in %s...\n", o.n_tracks, o.dir);
+    struct index* database;
+    int res = build_corpus(&o, &database);
+    if (res != SUCCESS) {
+        fprintf(stderr, res == MEMORY_ERROR ? "Memory allocation error\n" : "Cannot generate the corpus in '%s'\n", o.dir);
+        return 1;
+    }
+    struct lsh* lsh = create_hash_tables(database);
+    if (lsh == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+
+    fprintf(stderr, "Running %u queries...\n", 2 * o.n_queries);
+    struct query_stats known;
+    struct query_stats unknown;
+    memset(&known, 0, sizeof(known));
+    memset(&unknown, 0, sizeof(unknown));
+    res = run_queries(&o, database, lsh, 0, o.n_tracks, 1, &known);
+    if (res == SUCCESS && o.n_unknown_tracks > 0) {
+        res = run_queries(&o, database, lsh, o.n_tracks, o.n_unknown_tracks, 0, &unknown);
+    }
+    if (res != SUCCESS) {
+        fprintf(stderr, res == MEMORY_ERROR ? "Memory allocation error\n" : "Cannot fingerprint a query\n");
+        return 1;
+    }
+
+    // The latencies of both kinds of queries are reported together
+    unsigned int n = known.n_queries + unknown.n_queries;
+    double* fingerprint_ms = (double*)malloc(n * sizeof(double));
+    double* search_ms = (double*)malloc(n * sizeof(double));
+    if (fingerprint_ms == NULL || search_ms == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+    memcpy(fingerprint_ms, known.fingerprint_ms, known.n_queries * sizeof(double));
+    memcpy(fingerprint_ms + known.n_queries, unknown.fingerprint_ms, unknown.n_queries * sizeof(double));
+    memcpy(search_ms, known.search_ms, known.n_queries * sizeof(double));
+    memcpy(search_ms + known.n_queries, unknown.search_ms, unknown.n_queries * sizeof(double));
+
+    float recall = known.n_found / (float)known.n_queries;
+    float offset_accuracy = known.n_found > 0 ? known.n_right_offset / (float)known.n_found : 0;
+    float wrong_rate = known.n_wrong_entry / (float)known.n_queries;
+    float fpr = unknown.n_queries > 0 ? unknown.n_false_positives / (float)unknown.n_queries : 0;
+    double fingerprint_p[3] = { get_percentile(fingerprint_ms, n, 50), get_percentile(fingerprint_ms, n, 95),
+                                get_percentile(fingerprint_ms, n, 99) };
+    double search_p[3] = { get_percentile(search_ms, n, 50), get_percentile(search_ms, n, 95),
+                           get_percentile(search_ms, n, 99) };
+
+    if (o.json) {
+        printf("{\"tracks\":%u,\"unknown_tracks\":%u,\"queries\":%u,\"unknown_queries\":%u,\"seed\":%llu,"
+               "\"recall\":%.4f,\"offset_accuracy\":%.4f,\"wrong_entry_rate\":%.4f,\"false_positive_rate\":%.4f,"
+               "\"fingerprint_ms\":{\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f},"
+               "\"search_ms\":{\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f}}\n",
+               o.n_tracks, o.n_unknown_tracks, known.n_queries, unknown.n_queries, (unsigned long long)o.seed,
+               recall, offset_accuracy, wrong_rate, fpr, fingerprint_p[0], fingerprint_p[1], fingerprint_p[2],
+               search_p[0], search_p[1], search_p[2]);
+    } else {
+        printf("Recall:              %5.1f%% (%u/%u excerpts found in the right track)\n",
+               100 * recall, known.n_found, known.n_queries);
+        printf("Offset accuracy:     %5.1f%% (found within %.1f s of the actual position)\n",
+               100 * offset_accuracy, MAX_OFFSET_ERROR_IN_SECONDS);
+        printf("Wrong track:         %5.1f%% (%u/%u)\n", 100 * wrong_rate, known.n_wrong_entry, known.n_queries);
+        printf("False positive rate: %5.1f%% (%u/%u excerpts of unknown tracks matched)\n",
+               100 * fpr, unknown.n_false_positives, unknown.n_queries);
+        printf("Fingerprint latency: p50 %.1f ms, p95 %.1f ms, p99 %.1f ms\n", fingerprint_p[0], fingerprint_p[1], fingerprint_p[2]);
+        printf("Search latency:      p50 %.1f ms, p95 %.1f ms, p99 %.1f ms\n", search_p[0], search_p[1], search_p[2]);
+    }
+
+    free(fingerprint_ms);
+    free(search_ms);
+    free(known.fingerprint_ms);
+    free(known.search_ms);
+    free(unknown.fingerprint_ms);
+    free(unknown.search_ms);
+    free_hash_tables(lsh);
+    free_index(database);
+
+    if (recall < o.min_recall || fpr > o.max_fpr) {
+        fprintf(stderr, "The results are below the requested minimum\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include "arena.h"
+
+// All the allocations are aligned on cache lines, so that buffers
+// used by different threads never share a cache line
+#define ARENA_ALIGNMENT 64
+
+
+static size_t align(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~((size_t)ARENA_ALIGNMENT - 1);
+}
+
+
+struct arena* new_arena() {
+    return (struct arena*)calloc(1, sizeof(struct arena));
+}
+
+
+void* arena_alloc(struct arena* arena, size_t size) {
+    if (arena == NULL) {
+        return malloc(size > 0 ? size : 1);
+    }
+    size = align(size > 0 ? size : 1);
+    void* ptr;
+    if (arena->used + size <= arena->capacity) {
+        ptr = arena->memory + arena->used;
+        arena->used += size;
+    } else {
+        // The block header takes a whole alignment unit,
+        // so that the memory after it is still aligned
+        struct arena_block* block = (struct arena_block*)aligned_alloc(ARENA_ALIGNMENT, ARENA_ALIGNMENT + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = arena->extra_blocks;
+        arena->extra_blocks = block;
+        arena->extra_size += size;
+        ptr = (char*)block + ARENA_ALIGNMENT;
+    }
+    if (arena->used + arena->extra_size > arena->peak) {
+        arena->peak = arena->used + arena->extra_size;
+    }
+    return ptr;
+}
+
+
+void arena_free(struct arena* arena, void* ptr) {
+    if (arena == NULL) {
+        free(ptr);
+    }
+}
+
+
+void reset_arena(struct arena* arena) {
+    while (arena->extra_blocks != NULL) {
+        struct arena_block* next = arena->extra_blocks->next;
+        free(arena->extra_blocks);
+        arena->extra_blocks = next;
+    }
+    arena->extra_size = 0;
+    arena->used = 0;
+
+    if (arena->peak > arena->capacity) {
+        // If the allocation fails, we keep the old block
+        // and the extra allocations will go on
+        char* memory = (char*)aligned_alloc(ARENA_ALIGNMENT, arena->peak);
+        if (memory != NULL) {
+            free(arena->memory);
+            arena->memory = memory;
+            arena->capacity = arena->peak;
+        }
+    }
+}
+
+
+void free_arena(struct arena* arena) {
+    while (arena->extra_blocks != NULL) {
+        struct arena_block* next = arena->extra_blocks->next;
+        free(arena->extra_blocks);
+        arena->extra_blocks = next;
+    }
+    free(arena->memory);
+    free(arena);
+}
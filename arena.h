@@ -0,0 +1,81 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+#include "errors.h"
+
+/**
+ * When fingerprinting many files one after the other, allocating and
+ * freeing the big buffers needed for each file (samples, frame bins,
+ * scratch memory of the threads) costs time and fragments the heap.
+ * An arena is a block of memory from which these buffers are taken by
+ * just moving a pointer forward, and that is recycled as a whole once
+ * the file has been processed.
+ *
+ * If an allocation does not fit in the block, it gets its own block,
+ * and the next reset replaces the main block by one big enough for all
+ * the memory that was needed. This way, the arena grows to the size
+ * needed by the biggest file seen so far, and then stops allocating
+ * anything.
+ *
+ * An arena is not thread-safe, so each worker thread must have its own.
+ */
+struct arena_block {
+    struct arena_block* next;
+};
+
+struct arena {
+    // The main block
+    char* memory;
+    size_t capacity;
+    size_t used;
+
+    // The blocks allocated for what did not fit in the main
+    // block since the last reset, and their total size
+    struct arena_block* extra_blocks;
+    size_t extra_size;
+
+    // The biggest amount of memory needed between two resets
+    size_t peak;
+};
+
+
+/**
+ * Creates an empty arena.
+ *
+ * @return The arena or NULL in case of memory allocation error
+ */
+struct arena* new_arena();
+
+
+/**
+ * Allocates memory from the given arena. The memory is aligned on
+ * 64 bytes and is only valid until the next call to reset_arena().
+ * If the arena is NULL, the memory is allocated with malloc() and
+ * must be released with arena_free().
+ *
+ * @return The memory or NULL in case of memory allocation error
+ */
+void* arena_alloc(struct arena* arena, size_t size);
+
+
+/**
+ * Releases memory allocated with arena_alloc(). This does nothing if the arena
+ * is not NULL, since the memory of an arena is released all at once.
+ */
+void arena_free(struct arena* arena, void* ptr);
+
+
+/**
+ * Makes all the memory of the given arena available again, and
+ * grows it to the peak size if it was too small.
+ */
+void reset_arena(struct arena* arena);
+
+
+/**
+ * Frees all the memory associated to the given arena.
+ */
+void free_arena(struct arena* arena);
+
+#endif
@@ -1,13 +1,9 @@
 #include <math.h>
 #include "audionormalizer.h"
+#include "profiler.h"
 
 
-void normalize(float* samples, unsigned int size) {
-    float square_sum = 0;
-    for (unsigned int i = 0 ; i < size ; i++) {
-        square_sum += samples[i] * samples[i];
-    }
-
+float get_rms(float square_sum, unsigned int size) {
     // The 10.0 coefficient, the 0.1 minimum and 3.0 maximum
     // are taken from the original implementation from
     // https://github.com/AddictedCS/soundfingerprinting/blob/develop/src/SoundFingerprinting/Audio/AudioSamplesNormalizer.cs
@@ -18,15 +14,33 @@ void normalize(float* samples, unsigned int size) {
     } else if (rms > 3.0) {
         rms = 3.0;
     }
+    return rms;
+}
+
+
+float normalize_sample(float sample, float rms) {
+    float value = sample / rms;
+    if (value < -1.0) {
+        return -1.0;
+    }
+    if (value > 1.0) {
+        return 1.0;
+    }
+    return value;
+}
+
+
+void normalize(float* samples, unsigned int size) {
+    struct profile_span span;
+    begin_span(&span, PROFILE_NORMALIZE);
+    float square_sum = 0;
+    for (unsigned int i = 0 ; i < size ; i++) {
+        square_sum += samples[i] * samples[i];
+    }
 
+    float rms = get_rms(square_sum, size);
     for (unsigned int i = 0 ; i < size ; i++) {
-        float value = samples[i] / rms;
-        if (value < -1.0) {
-            samples[i] = -1.0;
-        } else if (value > 1.0) {
-            samples[i] = 1.0;
-        } else {
-            samples[i] = value;
-        }
+        samples[i] = normalize_sample(samples[i], rms);
     }
+    end_span(&span, size);
 }
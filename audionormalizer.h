@@ -13,4 +13,18 @@
  */
 void normalize(float* samples, unsigned int size);
 
+
+/**
+ * Returns the value by which samples must be divided to be
+ * normalized, given the sum of their squares and their number.
+ */
+float get_rms(float square_sum, unsigned int size);
+
+
+/**
+ * Returns the given sample divided by the given value and
+ * clipped to [-1.0;1.0].
+ */
+float normalize_sample(float sample, float rms);
+
 #endif
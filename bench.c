@@ -0,0 +1,510 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fft.h"
+#include "fingerprintio.h"
+#include "haar.h"
+#include "hannwindow.h"
+#include "hashcompare.h"
+#include "logbins.h"
+#include "lsh.h"
+#include "minhash.h"
+#include "rawfingerprints.h"
+#include "spectralimages.h"
+#include "toolutils.h"
+
+// This program times the main kernels of the fingerprinting and search code
+// in isolation, on synthetic inputs generated from a fixed seed, so that the
+// results can be compared between versions of the code and between machines:
+//
+//   $ make bench
+//   $ ./bench
+//   $ ./bench -json -runs 20 fft transform_image > results.json
+//
+// Each benchmark is first calibrated to find how many operations take about
+// -time milliseconds, and then this number of operations is timed -runs times.
+// For each benchmark, the mean time per operation, its standard deviation and
+// its minimum over the runs are reported, along with the number of items
+// (frames, images, signatures...) processed per second.
+//
+// The library is built without optimization flags by default, so for
+// meaningful numbers, build everything with the flags you ship, like
+// 'make CC="cc -O2" bench'.
+
+// The number of different inputs each benchmark cycles through
+#define N_INPUTS 64
+
+// The size of the synthetic database used by get_matches()
+#define DB_ENTRIES 100
+#define DB_SIGNATURES_PER_ENTRY 1000
+
+// The number of entries of the database written to a file for read_index()
+#define FILE_ENTRIES 10
+
+// The number of bytes changed in a database signature to get a query
+#define QUERY_CHANGES 20
+
+#define MAX_RUNS 1000
+
+
+struct bench_data {
+    // Frames of audio, multiplied by the Hann window
+    float frames[N_INPUTS][SAMPLES_PER_FRAME];
+
+    // Their FFT
+    float real[N_INPUTS][SAMPLES_PER_FRAME];
+    float imaginary[N_INPUTS][SAMPLES_PER_FRAME];
+
+    // Spectral images before scaling, after scaling and after the Haar transform
+    struct spectral_image raw_images[N_INPUTS];
+    struct spectral_image scaled_images[N_INPUTS];
+    struct spectral_image haar_images[N_INPUTS];
+
+    struct rawfingerprint fingerprints[N_INPUTS];
+    struct signature signatures[N_INPUTS];
+
+    // Scratch memory
+    float out_real[SAMPLES_PER_FRAME];
+    float out_imaginary[SAMPLES_PER_FRAME];
+    float bins[NUMBER_OF_BINS];
+    struct spectral_image image;
+    struct rawfingerprint fingerprint;
+    struct signature signature;
+    struct match_buffer buffer;
+
+    struct index* database;
+    struct lsh* lsh;
+    uint8_t queries[N_INPUTS][SIGNATURE_LENGTH];
+    char index_file[64];
+};
+
+
+struct benchmark {
+    const char* name;
+
+    // What the items are, and how many of them an operation processes
+    const char* unit;
+    unsigned long items_per_op;
+
+    // Runs the given number of operations
+    void (*run)(struct bench_data* data, unsigned long n_ops);
+};
+
+
+struct result {
+    unsigned long ops_per_run;
+    unsigned int n_runs;
+    double mean_ns;
+    double stddev_ns;
+    double min_ns;
+};
+
+
+// The results of the operations are added to this variable,
+// so that the compiler cannot consider them useless
+static volatile unsigned long sink;
+
+/**
+ * Returns a random MinHash value. Each value of a signature is the number of
+ * tries needed to find a bit set to 1 in a raw fingerprint where about 1/40
+ * of the bits are set, so it follows a geometric distribution.
+ */
+static uint8_t random_minhash_value() {
+    float u = random_float();
+    int value = (int)(log(1.0 - u) / log(1.0 - 1.0 / 40.0));
+    return value > 255 ? 255 : value;
+}
+
+
+static double time_in_nanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static void run_fft(struct bench_data* d, unsigned long n_ops) {
+    for (unsigned long i = 0 ; i < n_ops ; i++) {
+        fft(d->frames[i % N_INPUTS], d->out_real, d->out_imaginary);
+        sink += (unsigned long)d->out_real[1];
+    }
+}
+
+
+static void run_calculate_bins(struct bench_data* d, unsigned long n_ops) {
+    for (unsigned long i = 0 ; i < n_ops ; i++) {
+        calculate_bins(d->real[i % N_INPUTS], d->imaginary[i % N_INPUTS], d->bins);
+        sink += (unsigned long)d->bins[0];
+    }
+}
+
+
+// The spectral image kernels work in place, so each operation starts with
+// copying the input image, exactly like the fingerprinting pipeline does
+static void run_scale_to_full_spectrum(struct bench_data* d, unsigned long n_ops) {
+    for (unsigned long i = 0 ; i < n_ops ; i++) {
+        memcpy(&(d->image), &(d->raw_images[i % N_INPUTS]), sizeof(struct spectral_image));
+        scale_to_full_spectrum(d->image.image);
+        sink += (unsigned long)d->image.image[0];
+    }
+}
+
+
+static void run_transform_image(struct bench_data* d, unsigned long n_ops) {
+    for (unsigned long i = 0 ; i < n_ops ; i++) {
+        memcpy(&(d->image), &(d->scaled_images[i % N_INPUTS]), sizeof(struct spectral_image));
+        transform_image(&(d->image));
+        sink += (unsigned long)d->image.image[0];
+    }
+}
+
+
+static void run_build_raw_fingerprint(struct bench_data* d, unsigned long n_ops) {
+    for (unsigned long i = 0 ; i < n_ops ; i++) {
+        memset(&(d->fingerprint), 0, sizeof(struct rawfingerprint));
+        build_raw_fingerprint(&(d->haar_images[i % N_INPUTS]), &(d->fingerprint));
+        sink += d->fingerprint.bit_array[0];
+    }
+}
+
+
+static void run_calculate_signature(struct bench_data* d, unsigned long n_ops) {
+    for (unsigned long i = 0 ; i < n_ops ; i++) {
+        sink += calculate_signature(&(d->fingerprints[i % N_INPUTS]), &(d->signature));
+    }
+}
+
+
+static void run_compare_hashes(struct bench_data* d, unsigned long n_ops) {
+    for (unsigned long i = 0 ; i < n_ops ; i++) {
+        sink += compare_hashes(d->signatures[i % N_INPUTS].minhash, d->queries[(i / N_INPUTS) % N_INPUTS]);
+    }
+}
+
+
+static void run_get_matches(struct bench_data* d, unsigned long n_ops) {
+    for (unsigned long i = 0 ; i < n_ops ; i++) {
+        sink += get_matches(d->lsh, d->queries[i % N_INPUTS], &(d->buffer));
+    }
+}
+
+
+static void run_read_index(struct bench_data* d, unsigned long n_ops) {
+    for (unsigned long i = 0 ; i < n_ops ; i++) {
+        struct index* index;
+        if (SUCCESS == read_index(d->index_file, &index)) {
+            sink += index->n_entries;
+            free_index(index);
+        }
+    }
+}
+
+
+static struct benchmark benchmarks[] = {
+    { "fft", "frames", 1, run_fft },
+    { "calculate_bins", "frames", 1, run_calculate_bins },
+    { "scale_to_full_spectrum", "images", 1, run_scale_to_full_spectrum },
+    { "transform_image", "images", 1, run_transform_image },
+    { "build_raw_fingerprint", "images", 1, run_build_raw_fingerprint },
+    { "calculate_signature", "signatures", 1, run_calculate_signature },
+    { "compare_hashes", "comparisons", 1, run_compare_hashes },
+    { "get_matches", "queries", 1, run_get_matches },
+    { "read_index", "signatures", FILE_ENTRIES * DB_SIGNATURES_PER_ENTRY, run_read_index },
+};
+
+#define N_BENCHMARKS (sizeof(benchmarks) / sizeof(struct benchmark))
+
+
+/**
+ * Generates the audio and runs it through the fingerprinting steps one by one
+ * to get realistic inputs for each kernel.
+ */
+static int generate_audio_inputs(struct bench_data* d) {
+    // Enough frames to build N_INPUTS spectral images
+    unsigned int n_frames = SPECTRAL_IMAGE_WIDTH + (N_INPUTS - 1) * DISTANCE_BETWEEN_SPECTRAL_IMAGE_START;
+    unsigned int n_samples = SAMPLES_PER_FRAME + (n_frames - 1) * INTERVAL_BETWEEN_FRAMES;
+    float* samples = (float*)malloc(n_samples * sizeof(float));
+    float* bins = (float*)malloc(n_frames * NUMBER_OF_BINS * sizeof(float));
+    if (samples == NULL || bins == NULL) {
+        free(samples);
+        free(bins);
+        return MEMORY_ERROR;
+    }
+
+    // A few notes changing every quarter of a second, with some noise
+    float frequencies[3] = { 0, 0, 0 };
+    for (unsigned int i = 0 ; i < n_samples ; i++) {
+        if (i % 1378 == 0) {
+            for (int k = 0 ; k < 3 ; k++) {
+                frequencies[k] = 300 + 1700 * random_float();
+            }
+        }
+        float value = 0.1 * (random_float() - 0.5);
+        for (int k = 0 ; k < 3 ; k++) {
+            value += 0.2 * sinf(2 * M_PI * frequencies[k] * i / 5512.0);
+        }
+        samples[i] = value;
+    }
+
+    float* hann_window = get_Hann_window();
+    float frame[SAMPLES_PER_FRAME];
+    for (unsigned int i = 0 ; i < n_frames ; i++) {
+        for (unsigned int j = 0 ; j < SAMPLES_PER_FRAME ; j++) {
+            frame[j] = samples[i * INTERVAL_BETWEEN_FRAMES + j] * hann_window[j];
+        }
+        fft(frame, d->out_real, d->out_imaginary);
+        calculate_bins(d->out_real, d->out_imaginary, &(bins[i * NUMBER_OF_BINS]));
+        if (i < N_INPUTS) {
+            memcpy(d->frames[i], frame, sizeof(frame));
+            memcpy(d->real[i], d->out_real, sizeof(d->out_real));
+            memcpy(d->imaginary[i], d->out_imaginary, sizeof(d->out_imaginary));
+        }
+    }
+
+    for (unsigned int i = 0 ; i < N_INPUTS ; i++) {
+        memcpy(d->raw_images[i].image, &(bins[i * DISTANCE_BETWEEN_SPECTRAL_IMAGE_START * NUMBER_OF_BINS]),
+               sizeof(struct spectral_image));
+        d->scaled_images[i] = d->raw_images[i];
+        scale_to_full_spectrum(d->scaled_images[i].image);
+        d->haar_images[i] = d->scaled_images[i];
+        transform_image(&(d->haar_images[i]));
+        memset(&(d->fingerprints[i]), 0, sizeof(struct rawfingerprint));
+        build_raw_fingerprint(&(d->haar_images[i]), &(d->fingerprints[i]));
+        calculate_signature(&(d->fingerprints[i]), &(d->signatures[i]));
+    }
+
+    free(samples);
+    free(bins);
+    return SUCCESS;
+}
+
+
+/**
+ * Builds a database of random signatures, its LSH tables, and queries that are
+ * close to some of its signatures. Part of the database is also saved to a
+ * temporary file to be read by read_index().
+ */
+static int generate_database(struct bench_data* d) {
+    d->database = (struct index*)malloc(sizeof(struct index));
+    if (d->database == NULL) {
+        return MEMORY_ERROR;
+    }
+    d->database->n_entries = 0;
+    d->database->n_buckets = 0;
+    d->database->bytes_per_bucket = 0;
+    d->database->entries = (struct index_entry**)malloc(DB_ENTRIES * sizeof(struct index_entry*));
+    if (d->database->entries == NULL) {
+        free(d->database);
+        return MEMORY_ERROR;
+    }
+    for (unsigned int i = 0 ; i < DB_ENTRIES ; i++) {
+        struct index_entry* entry = (struct index_entry*)calloc(1, sizeof(struct index_entry));
+        if (entry == NULL) {
+            return MEMORY_ERROR;
+        }
+        d->database->entries[(d->database->n_entries)++] = entry;
+        char name[32];
+        sprintf(name, "entry%u.wav", i);
+        entry->filename = strdup(name);
+        entry->artist = strdup("");
+        entry->track_title = strdup("");
+        entry->album_title = strdup("");
+        entry->signatures = (struct signatures*)malloc(sizeof(struct signatures));
+        if (entry->filename == NULL || entry->artist == NULL || entry->track_title == NULL
+            || entry->album_title == NULL || entry->signatures == NULL) {
+            return MEMORY_ERROR;
+        }
+        entry->signatures->n_signatures = DB_SIGNATURES_PER_ENTRY;
+        entry->signatures->signatures = (struct signature*)malloc(DB_SIGNATURES_PER_ENTRY * sizeof(struct signature));
+        if (entry->signatures->signatures == NULL) {
+            return MEMORY_ERROR;
+        }
+        for (unsigned int j = 0 ; j < DB_SIGNATURES_PER_ENTRY ; j++) {
+            entry->signatures->signatures[j].position = j;
+            for (unsigned int k = 0 ; k < SIGNATURE_LENGTH ; k++) {
+                entry->signatures->signatures[j].minhash[k] = random_minhash_value();
+            }
+        }
+    }
+
+    d->lsh = create_hash_tables(d->database);
+    if (d->lsh == NULL) {
+        return MEMORY_ERROR;
+    }
+    init_match_buffer(&(d->buffer));
+
+    for (unsigned int i = 0 ; i < N_INPUTS ; i++) {
+        struct signatures* s = d->database->entries[next_random() % DB_ENTRIES]->signatures;
+        memcpy(d->queries[i], s->signatures[next_random() % s->n_signatures].minhash, SIGNATURE_LENGTH);
+        for (unsigned int k = 0 ; k < QUERY_CHANGES ; k++) {
+            d->queries[i][next_random() % SIGNATURE_LENGTH] = random_minhash_value();
+        }
+    }
+
+    strcpy(d->index_file, "/tmp/mnemophonix-bench-XXXXXX");
+    int fd = mkstemp(d->index_file);
+    if (fd == -1) {
+        return CANNOT_WRITE_FILE;
+    }
+    FILE* f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        return CANNOT_WRITE_FILE;
+    }
+    for (unsigned int i = 0 ; i < FILE_ENTRIES ; i++) {
+        struct index_entry* entry = d->database->entries[i];
+        save(f, entry->signatures, entry->filename, entry->artist, entry->track_title, entry->album_title);
+    }
+    if (fclose(f) != 0) {
+        return CANNOT_WRITE_FILE;
+    }
+    return SUCCESS;
+}
+
+
+static double time_ops(struct benchmark* b, struct bench_data* d, unsigned long n_ops) {
+    double before = time_in_nanoseconds();
+    b->run(d, n_ops);
+    return time_in_nanoseconds() - before;
+}
+
+
+static void run_benchmark(struct benchmark* b, struct bench_data* d, unsigned int n_runs,
+                          double run_ns, struct result* r) {
+    // Let's find how many operations we need for a run to last
+    // long enough, which also warms up the caches
+    unsigned long n_ops = 1;
+    while (time_ops(b, d, n_ops) < run_ns && n_ops < (1UL << 40)) {
+        n_ops *= 2;
+    }
+
+    double ns_per_op[MAX_RUNS];
+    double sum = 0;
+    r->min_ns = 0;
+    for (unsigned int i = 0 ; i < n_runs ; i++) {
+        ns_per_op[i] = time_ops(b, d, n_ops) / n_ops;
+        sum += ns_per_op[i];
+        if (i == 0 || ns_per_op[i] < r->min_ns) {
+            r->min_ns = ns_per_op[i];
+        }
+    }
+    r->ops_per_run = n_ops;
+    r->n_runs = n_runs;
+    r->mean_ns = sum / n_runs;
+    double variance = 0;
+    for (unsigned int i = 0 ; i < n_runs ; i++) {
+        variance += (ns_per_op[i] - r->mean_ns) * (ns_per_op[i] - r->mean_ns);
+    }
+    r->stddev_ns = n_runs > 1 ? sqrt(variance / (n_runs - 1)) : 0;
+}
+
+
+static void print_usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-json] [-runs <n>] [-time <ms>] [benchmark...]\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -json       print the results as JSON\n");
+    fprintf(stderr, "  -runs <n>   number of timed runs per benchmark (default: 10)\n");
+    fprintf(stderr, "  -time <ms>  duration of each run (default: 100)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Available benchmarks:");
+    for (unsigned int i = 0 ; i < N_BENCHMARKS ; i++) {
+        fprintf(stderr, " %s", benchmarks[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+
+int main(int argc, char* argv[]) {
+    int json = 0;
+    int n_runs = 10;
+    int run_ms = 100;
+
+    int i = 1;
+    for ( ; i < argc && argv[i][0] == '-' ; i++) {
+        if (!strcmp(argv[i], "-json")) {
+            json = 1;
+        } else if (!strcmp(argv[i], "-runs") && i + 1 < argc) {
+            n_runs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-time") && i + 1 < argc) {
+            run_ms = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (n_runs <= 0 || n_runs > MAX_RUNS || run_ms <= 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Without names, all the benchmarks are run
+    int selected[N_BENCHMARKS];
+    for (unsigned int k = 0 ; k < N_BENCHMARKS ; k++) {
+        selected[k] = (i == argc);
+    }
+    for ( ; i < argc ; i++) {
+        unsigned int k = 0;
+        while (k < N_BENCHMARKS && strcmp(argv[i], benchmarks[k].name)) {
+            k++;
+        }
+        if (k == N_BENCHMARKS) {
+            fprintf(stderr, "Unknown benchmark '%s'\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+        selected[k] = 1;
+    }
+
+    struct bench_data* d = (struct bench_data*)calloc(1, sizeof(struct bench_data));
+    if (d == NULL || SUCCESS != generate_audio_inputs(d)) {
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+    int res = generate_database(d);
+    if (res != SUCCESS) {
+        fprintf(stderr, res == MEMORY_ERROR ? "Memory allocation error\n" : "Cannot write temporary index file\n");
+        return 1;
+    }
+
+    if (json) {
+        // The machine and the compiler, to make sense of the results later
+        printf("{\"compiler\":\"%s\",\"cpus\":%ld,\"runs\":%d,\"run_ms\":%d,\"benchmarks\":[",
+               __VERSION__, sysconf(_SC_NPROCESSORS_ONLN), n_runs, run_ms);
+    } else {
+        printf("%-24s %14s %9s %14s %16s\n", "benchmark", "ns/op", "stddev", "min ns/op", "items/s");
+    }
+    int first = 1;
+    for (unsigned int k = 0 ; k < N_BENCHMARKS ; k++) {
+        if (!selected[k]) {
+            continue;
+        }
+        struct benchmark* b = &(benchmarks[k]);
+        struct result r;
+        run_benchmark(b, d, n_runs, run_ms * 1e6, &r);
+        double items_per_s = b->items_per_op * 1e9 / r.mean_ns;
+        if (json) {
+            printf("%s\n  {\"name\":\"%s\",\"unit\":\"%s\",\"items_per_op\":%lu,\"ops_per_run\":%lu,\"ns_per_op\":%.3f,"
+                   "\"stddev_ns\":%.3f,\"variance_ns2\":%.3f,\"min_ns\":%.3f,\"items_per_s\":%.1f}",
+                   first ? "" : ",", b->name, b->unit, b->items_per_op, r.ops_per_run, r.mean_ns,
+                   r.stddev_ns, r.stddev_ns * r.stddev_ns, r.min_ns, items_per_s);
+        } else {
+            printf("%-24s %14.1f %8.1f%% %14.1f %16.1f %s\n", b->name, r.mean_ns,
+                   100.0 * r.stddev_ns / r.mean_ns, r.min_ns, items_per_s, b->unit);
+        }
+        fflush(stdout);
+        first = 0;
+    }
+    if (json) {
+        printf("\n]}\n");
+    }
+
+    unlink(d->index_file);
+    clear_match_buffer(&(d->buffer));
+    free_hash_tables(d->lsh);
+    free_index(d->database);
+    free(d);
+    return 0;
+}
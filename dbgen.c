@@ -0,0 +1,689 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "fingerprintio.h"
+#include "lsh.h"
+#include "search.h"
+#include "toolutils.h"
+
+// This program writes synthetic fingerprint databases, so that the loading
+// of the database, the building of the LSH index and the search can be tested
+// at sizes that would take days to fingerprint:
+//
+//   $ make dbgen
+//   $ ./dbgen -tracks 5000 -queries 100 db queries
+//
+// The signatures are not random bytes: like real MinHash signatures, their
+// bytes follow a roughly geometric distribution (the position of the first
+// bit set in a sparse fingerprint), and consecutive signatures of a track share
+// about half of their bytes since their spectral images overlap. Both can be
+// measured on a real database with -model, instead of using the default values
+// that were measured on music.
+//
+// The queries are copies of random runs of signatures from the database in
+// which some bytes have been changed, like the signatures of a noisy excerpt
+// that does not start exactly on a spectral image. They are written in the
+// same format as the database, the name of each query saying where it comes
+// from.
+//
+// With -scale, the program generates databases of the given sizes in the given
+// directory instead and, for each of them, measures the time it takes to load
+// it and to build its LSH index, the peak memory use, and the latency and recall
+// of the planted queries. The results are printed as one line per size, ready
+// to be plotted:
+//
+//   $ ./dbgen -scale 10k,100k,1M,10M /tmp/scale
+//
+// The queries can be run with several numbers of probes per bucket, to see
+// how multi-probe lookups trade latency for recall:
+//
+//   $ ./dbgen -scale 100k -noise 0.6 -probes 0,8,16,32 /tmp/scale
+//
+// and with several layouts of the LSH buckets, to compare their memory
+// use, recall and latency:
+//
+//   $ ./dbgen -scale 100k -noise 0.6 -buckets 25x4,20x5,33x3 /tmp/scale
+
+// The default number of signatures of a track, which is
+// about 3 minutes of audio
+#define DEFAULT_TRACK_LENGTH 1900
+
+// The default number of signatures of a query, which is
+// about 5 seconds of audio
+#define DEFAULT_QUERY_LENGTH 34
+
+#define MAX_SCALE_SIZES 32
+
+#define MAX_PROBE_SETTINGS 16
+
+#define MAX_BUCKET_LAYOUTS 16
+
+
+/**
+ * The statistical model of the signatures.
+ */
+struct model {
+    // The cumulative distribution of the byte values
+    double cdf[256];
+
+    // The probability that a byte of a signature is
+    // the same as in the previous signature
+    double same_as_previous;
+};
+
+
+struct options {
+    unsigned int n_tracks;
+    unsigned int track_length;
+    unsigned int n_queries;
+    unsigned int query_length;
+    float noise;
+    uint64_t seed;
+    int json;
+    struct model model;
+
+    // The numbers of probes per bucket to measure with -scale
+    unsigned int probes[MAX_PROBE_SETTINGS];
+    unsigned int n_probe_settings;
+
+    // The bucket layouts to measure with -scale, the first one being
+    // saved in the generated database if there is one
+    unsigned int n_buckets[MAX_BUCKET_LAYOUTS];
+    unsigned int bytes_per_bucket[MAX_BUCKET_LAYOUTS];
+    unsigned int n_bucket_layouts;
+};
+
+
+static void set_seed(uint64_t seed) {
+    set_random_state(seed * 0x9E3779B97F4A7C15ULL + 1);
+    for (int k = 0 ; k < 8 ; k++) {
+        next_random();
+    }
+}
+
+
+/**
+ * Turns the given histogram of byte values into the cumulative distribution of the model.
+ */
+static void set_distribution(struct model* model, double histogram[256]) {
+    double total = 0;
+    for (unsigned int i = 0 ; i < 256 ; i++) {
+        total += histogram[i];
+    }
+    double sum = 0;
+    for (unsigned int i = 0 ; i < 256 ; i++) {
+        sum += histogram[i];
+        model->cdf[i] = sum / total;
+    }
+    model->cdf[255] = 1.0;
+}
+
+
+/**
+ * Given the measured fraction of bytes that are equal in consecutive signatures,
+ * sets the probability of keeping a byte, taking into account that a byte that
+ * is drawn again can get the same value by chance.
+ */
+static void set_same_as_previous(struct model* model, double equal_fraction) {
+    double collision = 0;
+    for (unsigned int i = 0 ; i < 256 ; i++) {
+        double p = model->cdf[i] - (i > 0 ? model->cdf[i - 1] : 0);
+        collision += p * p;
+    }
+    double keep = (equal_fraction - collision) / (1 - collision);
+    model->same_as_previous = keep < 0 ? 0 : (keep > 1 ? 1 : keep);
+}
+
+
+/**
+ * The default model: each byte is the position of the first bit set among
+ * the first 255 bits of a permutation of a fingerprint in which about one bit
+ * out of 37 is set, and 49% of the bytes are equal in consecutive signatures.
+ */
+static void init_default_model(struct model* model) {
+    double histogram[256];
+    double p = 1 / 37.5;
+    for (unsigned int i = 0 ; i < 255 ; i++) {
+        histogram[i] = p * pow(1 - p, i);
+    }
+    histogram[255] = pow(1 - p, 255);
+    set_distribution(model, histogram);
+    set_same_as_previous(model, 0.49);
+}
+
+
+/**
+ * Measures the model on the given real database.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ *         CANNOT_READ_FILE if the file cannot be read
+ *         DECODING_ERROR if the file cannot be parsed correctly
+ *                        or does not contain enough signatures
+ */
+static int measure_model(const char* filename, struct model* model) {
+    struct index* database;
+    int res = read_index(filename, &database);
+    if (res != SUCCESS) {
+        return res;
+    }
+    double histogram[256] = { 0 };
+    unsigned long n_pairs = 0;
+    unsigned long n_equal = 0;
+    for (unsigned int i = 0 ; i < database->n_entries ; i++) {
+        struct signatures* s = database->entries[i]->signatures;
+        for (unsigned int j = 0 ; j < s->n_signatures ; j++) {
+            for (unsigned int k = 0 ; k < SIGNATURE_LENGTH ; k++) {
+                histogram[s->signatures[j].minhash[k]]++;
+            }
+            if (j > 0 && s->signatures[j].position == s->signatures[j - 1].position + 1) {
+                n_pairs++;
+                for (unsigned int k = 0 ; k < SIGNATURE_LENGTH ; k++) {
+                    n_equal += s->signatures[j].minhash[k] == s->signatures[j - 1].minhash[k];
+                }
+            }
+        }
+    }
+    free_index(database);
+    if (n_pairs == 0) {
+        return DECODING_ERROR;
+    }
+    set_distribution(model, histogram);
+    set_same_as_previous(model, n_equal / (double)(n_pairs * SIGNATURE_LENGTH));
+    return SUCCESS;
+}
+
+
+/**
+ * Draws a byte value from the distribution of the model.
+ */
+static uint8_t random_byte(struct model* model) {
+    double x = random_double();
+    unsigned int min = 0;
+    unsigned int max = 255;
+    while (min < max) {
+        unsigned int middle = (min + max) / 2;
+        if (model->cdf[middle] > x) {
+            max = middle;
+        } else {
+            min = middle + 1;
+        }
+    }
+    return (uint8_t)min;
+}
+
+
+/**
+ * Returns the median of the byte values of the model.
+ */
+static unsigned int get_median(struct model* model) {
+    unsigned int i = 0;
+    while (model->cdf[i] < 0.5) {
+        i++;
+    }
+    return i;
+}
+
+
+/**
+ * Generates the signatures of track #n, which only depend on the seed and n.
+ */
+static struct signatures* generate_track(struct options* o, unsigned int n) {
+    set_seed(o->seed ^ ((uint64_t)n << 32 | n));
+    struct signatures* s = (struct signatures*)malloc(sizeof(struct signatures));
+    if (s == NULL) {
+        return NULL;
+    }
+    // Between half and one and a half times the average length
+    s->n_signatures = o->track_length / 2 + next_random() % (o->track_length + 1);
+    s->signatures = (struct signature*)malloc(s->n_signatures * sizeof(struct signature));
+    if (s->signatures == NULL) {
+        free(s);
+        return NULL;
+    }
+    for (unsigned int i = 0 ; i < s->n_signatures ; i++) {
+        for (unsigned int k = 0 ; k < SIGNATURE_LENGTH ; k++) {
+            if (i > 0 && random_double() < o->model.same_as_previous) {
+                s->signatures[i].minhash[k] = s->signatures[i - 1].minhash[k];
+            } else {
+                s->signatures[i].minhash[k] = random_byte(&(o->model));
+            }
+        }
+        s->signatures[i].position = i;
+    }
+    return s;
+}
+
+
+/**
+ * Picks where query #n comes from, which only depends on the seed and n.
+ */
+static void pick_query(struct options* o, unsigned int n, unsigned int* track, double* start) {
+    set_seed(~o->seed ^ n);
+    (*track) = next_random() % o->n_tracks;
+    // The start is a fraction of the track, since we only know its length once generated
+    (*start) = random_double();
+}
+
+
+/**
+ * Returns a copy of a run of the given signatures, starting at the given fraction of
+ * them, where bytes are replaced with random values with the noise probability.
+ * The positions of the query start at 0.
+ */
+static struct signatures* make_query(struct options* o, struct signatures* track, double start, unsigned int* first) {
+    struct signatures* q = (struct signatures*)malloc(sizeof(struct signatures));
+    if (q == NULL) {
+        return NULL;
+    }
+    q->n_signatures = o->query_length < track->n_signatures ? o->query_length : track->n_signatures;
+    q->signatures = (struct signature*)malloc(q->n_signatures * sizeof(struct signature));
+    if (q->signatures == NULL) {
+        free(q);
+        return NULL;
+    }
+    (*first) = (unsigned int)(start * (track->n_signatures - q->n_signatures + 1));
+    for (unsigned int i = 0 ; i < q->n_signatures ; i++) {
+        for (unsigned int k = 0 ; k < SIGNATURE_LENGTH ; k++) {
+            uint8_t value = track->signatures[*first + i].minhash[k];
+            q->signatures[i].minhash[k] = random_double() < o->noise ? random_byte(&(o->model)) : value;
+        }
+        q->signatures[i].position = i;
+    }
+    return q;
+}
+
+
+/**
+ * Writes the synthetic database to the given file, and if queries_filename
+ * is not NULL, the queries to that file.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ *         CANNOT_WRITE_FILE if a file cannot be written
+ */
+static int generate_database(struct options* o, const char* filename, const char* queries_filename) {
+    FILE* db = fopen(filename, "w");
+    if (db == NULL) {
+        return CANNOT_WRITE_FILE;
+    }
+    FILE* queries = NULL;
+    if (queries_filename != NULL) {
+        queries = fopen(queries_filename, "w");
+        if (queries == NULL) {
+            fclose(db);
+            return CANNOT_WRITE_FILE;
+        }
+    }
+
+    if (o->n_bucket_layouts > 0) {
+        save_bucket_layout(db, o->n_buckets[0], o->bytes_per_bucket[0]);
+    }
+    int res = SUCCESS;
+    char name[128];
+    for (unsigned int n = 0 ; n < o->n_tracks && res == SUCCESS ; n++) {
+        struct signatures* track = generate_track(o, n);
+        if (track == NULL) {
+            res = MEMORY_ERROR;
+            break;
+        }
+        snprintf(name, sizeof(name), "track%07u", n);
+        save(db, track, name, NULL, NULL, NULL);
+
+        for (unsigned int i = 0 ; queries != NULL && i < o->n_queries ; i++) {
+            unsigned int query_track;
+            double start;
+            pick_query(o, i, &query_track, &start);
+            if (query_track != n) {
+                continue;
+            }
+            unsigned int first;
+            struct signatures* query = make_query(o, track, start, &first);
+            if (query == NULL) {
+                res = MEMORY_ERROR;
+                break;
+            }
+            snprintf(name, sizeof(name), "query%05u of track%07u at %u", i, n, first);
+            save(queries, query, name, NULL, NULL, NULL);
+            free_signatures(query);
+        }
+        free_signatures(track);
+    }
+
+    if (fclose(db) != 0 && res == SUCCESS) {
+        res = CANNOT_WRITE_FILE;
+    }
+    if (queries != NULL && fclose(queries) != 0 && res == SUCCESS) {
+        res = CANNOT_WRITE_FILE;
+    }
+    return res;
+}
+
+
+/**
+ * Runs the planted queries on the given database, measuring the share of
+ * them that are found in the right track and percentiles of their latency.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int run_planted_queries(struct options* o, struct index* database, struct lsh* lsh, float* recall, double p[3]) {
+    double* latencies = (double*)malloc(o->n_queries * sizeof(double));
+    if (latencies == NULL) {
+        return MEMORY_ERROR;
+    }
+    unsigned int n_found = 0;
+    for (unsigned int i = 0 ; i < o->n_queries ; i++) {
+        unsigned int track;
+        double start;
+        pick_query(o, i, &track, &start);
+        unsigned int first_signature;
+        struct signatures* query = make_query(o, database->entries[track]->signatures, start, &first_signature);
+        if (query == NULL) {
+            free(latencies);
+            return MEMORY_ERROR;
+        }
+        struct search_result result;
+        double before_search = time_in_milliseconds();
+        int n = search_top_matches(query, database, lsh, &result, 1, 0);
+        latencies[i] = time_in_milliseconds() - before_search;
+        free_signatures(query);
+        if (n < 0) {
+            free(latencies);
+            return n;
+        }
+        if (n == 1 && result.is_match && result.entry_index == (int)track) {
+            n_found++;
+        }
+    }
+    (*recall) = o->n_queries > 0 ? n_found / (float)o->n_queries : 0;
+    p[0] = get_percentile(latencies, o->n_queries, 50);
+    p[1] = get_percentile(latencies, o->n_queries, 95);
+    p[2] = get_percentile(latencies, o->n_queries, 99);
+    free(latencies);
+    return SUCCESS;
+}
+
+
+/**
+ * Generates a database of the given number of signatures in the given directory,
+ * loads it, indexes it, runs the planted queries and prints the measures.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ *         CANNOT_WRITE_FILE if the database cannot be written
+ *         CANNOT_READ_FILE or DECODING_ERROR if it cannot be read back
+ */
+static int measure_scale(struct options* o, const char* dir, unsigned long n_signatures, int first) {
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s/db_%lu", dir, n_signatures);
+    o->n_tracks = (n_signatures + o->track_length - 1) / o->track_length;
+    double before = time_in_milliseconds();
+    int res = generate_database(o, filename, NULL);
+    if (res != SUCCESS) {
+        return res;
+    }
+    double generate_ms = time_in_milliseconds() - before;
+
+    before = time_in_milliseconds();
+    struct index* database;
+    res = read_index(filename, &database);
+    if (res != SUCCESS) {
+        return res;
+    }
+    double load_ms = time_in_milliseconds() - before;
+    unsigned long actual_signatures = 0;
+    for (unsigned int i = 0 ; i < database->n_entries ; i++) {
+        actual_signatures += database->entries[i]->signatures->n_signatures;
+    }
+
+    // The databases are generated without any layout, so that the
+    // one to measure can be set before building the hash tables
+    unsigned int n_layouts = o->n_bucket_layouts > 0 ? o->n_bucket_layouts : 1;
+    for (unsigned int l = 0 ; l < n_layouts ; l++) {
+        if (o->n_bucket_layouts > 0) {
+            database->n_buckets = o->n_buckets[l];
+            database->bytes_per_bucket = o->bytes_per_bucket[l];
+        }
+        before = time_in_milliseconds();
+        struct lsh* lsh = create_hash_tables(database);
+        if (lsh == NULL) {
+            free_index(database);
+            return MEMORY_ERROR;
+        }
+        double lsh_ms = time_in_milliseconds() - before;
+        char layout[32];
+        snprintf(layout, sizeof(layout), "%ux%u", lsh->n_buckets, lsh->bytes_per_bucket);
+
+        // The sizes are measured in increasing order, so the peak is the one of this size
+        // and of the biggest layout measured so far
+        long peak_rss_kb = get_peak_rss_in_kb();
+        for (unsigned int k = 0 ; k < o->n_probe_settings ; k++) {
+            set_probes_per_bucket(o->probes[k]);
+            float recall;
+            double p[3];
+            res = run_planted_queries(o, database, lsh, &recall, p);
+            if (res != SUCCESS) {
+                free_hash_tables(lsh);
+                free_index(database);
+                return res;
+            }
+            int first_line = first && l == 0 && k == 0;
+            double lsh_mb = get_hash_tables_size(lsh) / (1024.0 * 1024.0);
+            if (o->json) {
+                printf("%s{\"signatures\":%lu,\"tracks\":%u,\"generate_ms\":%.1f,\"load_ms\":%.1f,\"buckets\":\"%s\","
+                       "\"lsh_build_ms\":%.1f,\"lsh_mb\":%.1f,\"peak_rss_kb\":%ld,\"probes\":%u,\"queries\":%u,"
+                       "\"recall\":%.4f,\"query_ms\":{\"p50\":%.3f,\"p95\":%.3f,\"p99\":%.3f}}",
+                       first_line ? "[\n" : ",\n", actual_signatures, database->n_entries, generate_ms, load_ms, layout,
+                       lsh_ms, lsh_mb, peak_rss_kb, o->probes[k], o->n_queries, recall, p[0], p[1], p[2]);
+            } else {
+                if (first_line) {
+                    printf("# signatures\ttracks\tgenerate_ms\tload_ms\tbuckets\tlsh_build_ms\tlsh_mb\tpeak_rss_kb\tprobes\t"
+                           "recall\tquery_p50_ms\tquery_p95_ms\tquery_p99_ms\n");
+                }
+                printf("%lu\t%u\t%.1f\t%.1f\t%s\t%.1f\t%.1f\t%ld\t%u\t%.4f\t%.3f\t%.3f\t%.3f\n", actual_signatures,
+                       database->n_entries, generate_ms, load_ms, layout, lsh_ms, lsh_mb, peak_rss_kb, o->probes[k],
+                       recall, p[0], p[1], p[2]);
+            }
+            fflush(stdout);
+        }
+        free_hash_tables(lsh);
+    }
+
+    free_index(database);
+    // The databases can be big, so we do not keep them
+    remove(filename);
+    return SUCCESS;
+}
+
+
+/**
+ * Parses a number of signatures like 500, 100k or 10M.
+ * Returns 0 if the string is not valid.
+ */
+static unsigned long parse_size(const char* s, char* *end) {
+    unsigned long value = strtoul(s, end, 10);
+    if ((*end) == s) {
+        return 0;
+    }
+    switch (**end) {
+        case 'k': case 'K': value *= 1000; (*end)++; break;
+        case 'm': case 'M': value *= 1000000; (*end)++; break;
+        default: break;
+    }
+    return value;
+}
+
+
+static int compare_sizes(const unsigned long* a, const unsigned long* b) {
+    return (*a > *b) - (*a < *b);
+}
+
+
+static void print_error(int res) {
+    switch (res) {
+        case MEMORY_ERROR: fprintf(stderr, "Memory allocation error\n"); break;
+        case CANNOT_WRITE_FILE: fprintf(stderr, "Cannot write the database\n"); break;
+        case CANNOT_READ_FILE: fprintf(stderr, "Cannot read the database\n"); break;
+        default: fprintf(stderr, "Cannot decode the database\n"); break;
+    }
+}
+
+
+static void print_usage(const char* name) {
+    fprintf(stderr, "Usage: %s [options] <db> [<queries>]\n", name);
+    fprintf(stderr, "       %s -scale <size>[,<size>...] [options] <dir>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Writes a synthetic database, and optionally near-duplicate queries planted in it.\n");
+    fprintf(stderr, "With -scale, measures how loading, indexing and searching scale with the number\n");
+    fprintf(stderr, "of signatures (like 100k or 10M) of databases generated in <dir>.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -tracks <n>          number of tracks (default: 1000, ignored with -scale)\n");
+    fprintf(stderr, "  -length <n>          average number of signatures per track (default: %d)\n", DEFAULT_TRACK_LENGTH);
+    fprintf(stderr, "  -queries <n>         number of queries (default: 100)\n");
+    fprintf(stderr, "  -query-length <n>    number of signatures per query (default: %d)\n", DEFAULT_QUERY_LENGTH);
+    fprintf(stderr, "  -noise <p>           probability that a byte of a query is changed (default: 0.5)\n");
+    fprintf(stderr, "  -model <db>          measure the distribution of the signatures on this real database\n");
+    fprintf(stderr, "  -seed <n>            seed of the database and of the queries (default: 1)\n");
+    fprintf(stderr, "  -probes <n>[,<n>...] numbers of probes per bucket to measure with -scale (default: 0)\n");
+    fprintf(stderr, "  -buckets <l>[,<l>...] LSH bucket layouts like 25x4 to measure with -scale; the first\n");
+    fprintf(stderr, "                       one is saved in the database otherwise (default: %dx%d)\n",
+            DEFAULT_N_BUCKETS, DEFAULT_BYTES_PER_BUCKET);
+    fprintf(stderr, "  -json                print the -scale results as JSON\n");
+}
+
+
+int main(int argc, char* argv[]) {
+    struct options o;
+    o.n_tracks = 1000;
+    o.track_length = DEFAULT_TRACK_LENGTH;
+    o.n_queries = 100;
+    o.query_length = DEFAULT_QUERY_LENGTH;
+    o.noise = 0.5;
+    o.seed = 1;
+    o.json = 0;
+    init_default_model(&o.model);
+    o.probes[0] = 0;
+    o.n_probe_settings = 1;
+    o.n_bucket_layouts = 0;
+    unsigned long sizes[MAX_SCALE_SIZES];
+    unsigned int n_sizes = 0;
+
+    int i = 1;
+    for ( ; i < argc && argv[i][0] == '-' ; i++) {
+        if (!strcmp(argv[i], "-json")) {
+            o.json = 1;
+        } else if (!strcmp(argv[i], "-tracks") && i + 1 < argc) {
+            o.n_tracks = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-length") && i + 1 < argc) {
+            o.track_length = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-queries") && i + 1 < argc) {
+            o.n_queries = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-query-length") && i + 1 < argc) {
+            o.query_length = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-noise") && i + 1 < argc) {
+            o.noise = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-seed") && i + 1 < argc) {
+            o.seed = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-model") && i + 1 < argc) {
+            int res = measure_model(argv[++i], &o.model);
+            if (res != SUCCESS) {
+                fprintf(stderr, "Cannot measure the signatures of '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-probes") && i + 1 < argc) {
+            char* s = argv[++i];
+            o.n_probe_settings = 0;
+            while (o.n_probe_settings < MAX_PROBE_SETTINGS) {
+                char* end;
+                o.probes[o.n_probe_settings] = strtoul(s, &end, 10);
+                if (end == s || o.probes[o.n_probe_settings] > MAX_PROBES_PER_BUCKET) {
+                    break;
+                }
+                o.n_probe_settings++;
+                s = end;
+                if (*s != ',') {
+                    break;
+                }
+                s++;
+            }
+            if (*s != '\0' || o.n_probe_settings == 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-buckets") && i + 1 < argc) {
+            char* s = argv[++i];
+            o.n_bucket_layouts = 0;
+            while (o.n_bucket_layouts < MAX_BUCKET_LAYOUTS) {
+                unsigned int n;
+                unsigned int w;
+                int len;
+                if (2 != sscanf(s, "%ux%u%n", &n, &w, &len) || !is_valid_bucket_layout(n, w)) {
+                    break;
+                }
+                o.n_buckets[o.n_bucket_layouts] = n;
+                o.bytes_per_bucket[o.n_bucket_layouts] = w;
+                o.n_bucket_layouts++;
+                s += len;
+                if (*s != ',') {
+                    break;
+                }
+                s++;
+            }
+            if (*s != '\0' || o.n_bucket_layouts == 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-scale") && i + 1 < argc) {
+            char* s = argv[++i];
+            while (n_sizes < MAX_SCALE_SIZES && (sizes[n_sizes] = parse_size(s, &s)) > 0) {
+                n_sizes++;
+                if (*s != ',') {
+                    break;
+                }
+                s++;
+            }
+            if (*s != '\0') {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    int n_args = argc - i;
+    if (o.track_length == 0 || o.query_length == 0 || o.noise < 0 || o.noise > 1
+        || (n_sizes > 0 && n_args != 1) || (n_sizes == 0 && (n_args < 1 || n_args > 2 || o.n_tracks == 0))) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    fprintf(stderr, "Byte values: %.1f%% of 0, median %u; %.1f%% of the bytes kept in consecutive signatures\n",
+            100 * o.model.cdf[0], get_median(&o.model), 100 * o.model.same_as_previous);
+    if (n_sizes == 0) {
+        int res = generate_database(&o, argv[i], n_args == 2 ? argv[i + 1] : NULL);
+        if (res != SUCCESS) {
+            print_error(res);
+            return 1;
+        }
+        return 0;
+    }
+
+    mkdir(argv[i], 0755);
+    qsort(sizes, n_sizes, sizeof(unsigned long), (int (*)(const void*, const void*))compare_sizes);
+    for (unsigned int k = 0 ; k < n_sizes ; k++) {
+        fprintf(stderr, "Measuring %lu signatures...\n", sizes[k]);
+        int res = measure_scale(&o, argv[i], sizes[k], k == 0);
+        if (res != SUCCESS) {
+            print_error(res);
+            return 1;
+        }
+    }
+    if (o.json) {
+        printf("\n]\n");
+    }
+    return 0;
+}
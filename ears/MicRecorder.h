@@ -9,6 +9,4 @@
             mutex:(pthread_mutex_t*)mutex
             condition:(pthread_cond_t*)cond;
 
-- (void)notifyMatch;
-
 @end
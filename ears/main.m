@@ -10,6 +10,7 @@
 #include "fingerprintio.h"
 #include "lsh.h"
 #include "search.h"
+#include "stream.h"
 #include "wav.h"
 
 
@@ -53,43 +54,69 @@ void startCapture(struct index* database_index, struct lsh* lsh, int verbose) {
 
     dispatch_queue_t audioDataOutputQueue = dispatch_queue_create("AudioDataOutputQueue", DISPATCH_QUEUE_SERIAL);
     MicRecorder *controller = [[MicRecorder alloc] init];
-    int nBytesInBuffer;
+    int nBytesInBuffer = 0;
     uint8_t pcm_buffer[TEN_SECONDS];
     [controller setParameters:pcm_buffer nBytesInBuffer:&nBytesInBuffer mutex:&audio_mutex condition:&condition];
     [output setSampleBufferDelegate:controller queue:audioDataOutputQueue];
-    
+
+    // The audio is fingerprinted incrementally as it arrives, and we look
+    // for matches in the signatures of the last 10 seconds
+    struct stream_fingerprinter* fingerprinter = new_stream_fingerprinter();
+    struct stream_search* stream_search = new_stream_search(database_index, lsh, 10.0);
+    uint8_t* new_data = (uint8_t*)malloc(TEN_SECONDS);
+    if (fingerprinter == NULL || stream_search == NULL || new_data == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+
     int last_match = -1;
     while (true) {
         pthread_cond_wait(&condition, &mutex);
         pthread_mutex_lock(&audio_mutex);
-        float* samples;
-        int res = convert_samples(pcm_buffer, nBytesInBuffer, &samples);
+        int n_new_bytes = nBytesInBuffer;
+        memcpy(new_data, pcm_buffer, n_new_bytes);
+        nBytesInBuffer = 0;
         pthread_mutex_unlock(&audio_mutex);
-        
-        if (res > 0) {
-            struct signatures* fingerprint;
-            res = generate_fingerprint_from_samples(samples, res, &fingerprint);
-            free(samples);
-            if (res == SUCCESS) {
-                int best_match = search(fingerprint, database_index, lsh, verbose);
-                free_signatures(fingerprint);
-                if (best_match >= 0 && best_match != last_match) {
-                    last_match = best_match;
-                    printf("\nFound match: '%s'\n", database_index->entries[best_match]->filename);
-                    if (database_index->entries[best_match]->artist[0]) {
-                        printf("Artist: %s\n", database_index->entries[best_match]->artist);
-                    }
-                    if (database_index->entries[best_match]->track_title[0]) {
-                        printf("Track title: %s\n", database_index->entries[best_match]->track_title);
-                    }
-                    if (database_index->entries[best_match]->album_title[0]) {
-                        printf("Album title: %s\n", database_index->entries[best_match]->album_title);
-                    }
-                    printf("\n");
-                    [controller notifyMatch];
-                }
+
+        struct signatures* new_signatures;
+        int n_signatures = add_pcm_data(fingerprinter, new_data, n_new_bytes, &new_signatures);
+        if (n_signatures == 0) {
+            continue;
+        }
+        if (n_signatures < 0 || MEMORY_ERROR == add_stream_signatures(stream_search, new_signatures)) {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
+        struct search_result result;
+        int n_results = get_stream_matches(stream_search, &result, 1, verbose);
+        if (n_results == MEMORY_ERROR) {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
+        if (n_results != 1 || !result.is_match) {
+            continue;
+        }
+        int best_match = result.entry_index;
+        if (best_match != last_match) {
+            last_match = best_match;
+            printf("\nFound match: '%s'\n", database_index->entries[best_match]->filename);
+            if (database_index->entries[best_match]->artist[0]) {
+                printf("Artist: %s\n", database_index->entries[best_match]->artist);
             }
+            if (database_index->entries[best_match]->track_title[0]) {
+                printf("Track title: %s\n", database_index->entries[best_match]->track_title);
+            }
+            if (database_index->entries[best_match]->album_title[0]) {
+                printf("Album title: %s\n", database_index->entries[best_match]->album_title);
+            }
+            printf("Score: %.1f with %d matching signatures\n", result.average_score, result.n_matches);
+            printf("\n");
         }
+
+        // When we have had a hit, we start from scratch so that if we
+        // switch to a different song, the votes for the song we have
+        // just identified won't hide it
+        reset_stream_search(stream_search);
     }
 
     pthread_mutex_destroy(&audio_mutex);
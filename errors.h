@@ -28,4 +28,14 @@
 // Returned when a search operation cannot find any match
 #define NO_MATCH_FOUND -7
 
+// Returned when an output file cannot be written
+#define CANNOT_WRITE_FILE -8
+
+// Returned when the LSH buckets cannot be laid out as requested
+#define INVALID_BUCKET_LAYOUT -9
+
+// Returned when a socket path is a file that is not a socket
+// or the socket of a server that is still running
+#define SOCKET_IN_USE -10
+
 #endif
@@ -48,7 +48,9 @@ char* generate_wave_file(char* input, char* *artist, char* *track_title, char* *
         case 0: {
             // Child process
             execlp("ffmpeg", "ffmpeg", "-i", input, "-acodec", "pcm_s16le", "-ar", "44100", "-f", "wav", wav, "-f", "ffmetadata", metadata, NULL);
-            return NULL;
+            // If we get here, ffmpeg could not be launched. We must not return
+            // since we would then have 2 copies of the caller running
+            _exit(1);
         }
         default: {
             // Parent process
@@ -63,3 +65,26 @@ char* generate_wave_file(char* input, char* *artist, char* *track_title, char* *
     }
     return strdup(wav);
 }
+
+
+int generate_fingerprint_from_any_file(char* input, struct signatures* *fingerprint,
+                                        char* *artist, char* *track_title, char* *album_title, struct arena* arena) {
+    *artist = NULL;
+    *track_title = NULL;
+    *album_title = NULL;
+    int res = generate_fingerprint(input, fingerprint, artist, track_title, album_title, arena);
+    if (res != UNSUPPORTED_WAVE_FORMAT && res != NOT_A_WAVE_FILE) {
+        return res;
+    }
+
+    // Not a wave file ? Let's try to convert it to a wave file
+    // with ffmpeg
+    char* generated_wav = generate_wave_file(input, artist, track_title, album_title);
+    if (generated_wav == NULL) {
+        return res;
+    }
+    res = generate_fingerprint(generated_wav, fingerprint, NULL, NULL, NULL, arena);
+    remove(generated_wav);
+    free(generated_wav);
+    return res;
+}
@@ -1,6 +1,7 @@
 #ifndef _FFMPEG_H
 #define _FFMPEG_H
 
+#include "fingerprinting.h"
 
 /**
  * Tries to convert the input file to a 44100Hz wave file,
@@ -12,4 +13,20 @@
  */
 char* generate_wave_file(char* input, char* *artist, char* *track_title, char* *album_title);
 
+
+/**
+ * Calculates the fingerprint of the given file like generate_fingerprint()
+ * does, except that if the file is not a 16-bit 44100Hz PCM wave file, an
+ * attempt is made to convert it to one with ffmpeg first. The metadata
+ * pointers are set to NULL if no metadata is found. The arena is passed
+ * to generate_fingerprint().
+ *
+ * @return SUCCESS on success
+ *         UNSUPPORTED_WAVE_FORMAT or NOT_A_WAVE_FILE if the file is not a wave
+ *                                 file we can read and could not be converted
+ *         any other error code returned by generate_fingerprint() otherwise
+ */
+int generate_fingerprint_from_any_file(char* input, struct signatures* *fingerprint,
+                                        char* *artist, char* *track_title, char* *album_title, struct arena* arena);
+
 #endif
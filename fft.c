@@ -1,10 +1,12 @@
 #include <math.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include "fft.h"
 
-static uint16_t reversed[2048] = { 0xFFFF };
+static uint16_t reversed[2048];
+static pthread_once_t reversed_once = PTHREAD_ONCE_INIT;
 
 /**
  * Given a 16-bit value like 00000ABCDEFGHIJK, this
@@ -66,13 +68,18 @@ static void inplace_fft(float* real, float* imaginary) {
 }
 
 
-int fft(float* source, float* real, float* imaginary) {
-    // If needed, let's initialize the 'reversed' array
-    if (reversed[0] == 0xFFFF) {
-        for (int i = 0 ; i < 2048 ; i++) {
-            reversed[i] = reverse_bits(i);
-        }
+static void initialize_reversed() {
+    for (int i = 0 ; i < 2048 ; i++) {
+        reversed[i] = reverse_bits(i);
     }
+}
+
+
+int fft(float* source, float* real, float* imaginary) {
+    // If needed, let's initialize the 'reversed' array. Since several
+    // threads may get here at the same time, we must make sure that none
+    // of them can see a partially initialized array
+    pthread_once(&reversed_once, initialize_reversed);
 
     // When computing the FFT on floats, we need to treat them
     // as complex numbers so let's use null imaginary values
@@ -1,14 +1,306 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "audionormalizer.h"
 #include "fingerprinting.h"
-#include "haar.h"
-#include "minhash.h"
-#include "rawfingerprints.h"
+#include "logbins.h"
+#include "pipeline.h"
+#include "profiler.h"
+#include "resample.h"
 #include "spectralimages.h"
 #include "wav.h"
 
+// The number of 44100Hz samples read at a time when
+// the file is processed in segments
+#define READ_CHUNK_SIZE 65536
+
+// Spectral image #i starts at the 5512Hz sample #i * IMAGE_STEP and
+// needs IMAGE_SPAN samples
+#define IMAGE_STEP (DISTANCE_BETWEEN_SPECTRAL_IMAGE_START * INTERVAL_BETWEEN_FRAMES)
+#define IMAGE_SPAN (SAMPLES_PER_FRAME + (SPECTRAL_IMAGE_WIDTH - 1) * INTERVAL_BETWEEN_FRAMES)
+
+// The smallest segment we accept to work on, whatever the memory
+// budget, so that each segment produces a few spectral images
+#define MIN_SEGMENT_SIZE 16384
+
+static size_t max_memory = 0;
+
+
+void set_max_memory(size_t bytes) {
+    max_memory = bytes;
+}
+
+
+/**
+ * Returns the number of spectral images in the given number of 5512Hz samples.
+ */
+static unsigned int get_n_images(unsigned int n_samples) {
+    if (n_samples < IMAGE_SPAN) {
+        return 0;
+    }
+    return 1 + (n_samples - IMAGE_SPAN) / IMAGE_STEP;
+}
+
+
+/**
+ * Estimates the memory needed to fingerprint the given number of 44100Hz samples
+ * in one go: the 44100Hz samples, the 5512Hz samples, the bins of all the frames
+ * and the signatures.
+ */
+static size_t estimate_memory_needed(unsigned int n_samples_44100Hz) {
+    size_t n_samples = n_samples_44100Hz / 8;
+    size_t n_frames = n_samples / INTERVAL_BETWEEN_FRAMES;
+    return n_samples_44100Hz * sizeof(float)
+            + n_samples * sizeof(float)
+            + n_frames * NUMBER_OF_BINS * sizeof(float)
+            + get_n_images(n_samples) * (sizeof(struct signature) + 1);
+}
+
+
+typedef int (*sample_consumer)(float* samples, unsigned int n_samples, void* data);
+
+
+/**
+ * Reads the samples of the given file from the beginning, a chunk at a time,
+ * and passes them to the given function once resampled to 5512Hz. The samples
+ * are the same as the ones read_samples() would produce before normalization.
+ *
+ * @return SUCCESS on success
+ *         DECODING_ERROR in case of I/O error when reading the file
+ *         MEMORY_ERROR in case of memory allocation error
+ *         or any error returned by the consumer function
+ */
+static int stream_5512Hz_samples(struct wav_reader* reader, sample_consumer consumer, void* data) {
+    float* samples_44100Hz = (float*)malloc(READ_CHUNK_SIZE * sizeof(float));
+    float* samples_5512Hz = (float*)malloc((READ_CHUNK_SIZE / 8) * sizeof(float));
+    if (samples_44100Hz == NULL || samples_5512Hz == NULL) {
+        free(samples_44100Hz);
+        free(samples_5512Hz);
+        return MEMORY_ERROR;
+    }
+    count_profile_bytes(PROFILE_DECODE, READ_CHUNK_SIZE * sizeof(float));
+    count_profile_bytes(PROFILE_RESAMPLE, (READ_CHUNK_SIZE / 8) * sizeof(float));
+
+    rewind_wav_reader(reader);
+    int res = SUCCESS;
+    unsigned int n_kept = 0;
+    while (res == SUCCESS) {
+        int n_read = read_next_samples(reader, samples_44100Hz + n_kept, READ_CHUNK_SIZE - n_kept);
+        if (n_read < 0) {
+            res = n_read;
+            break;
+        }
+        unsigned int n_samples = n_kept + n_read;
+
+        if (n_samples < READ_CHUNK_SIZE) {
+            // This is the end of the file, so the last samples must be
+            // resampled like resample() does, with incomplete filter windows.
+            // Since the chunks always start on a multiple of 8, this gives
+            // the same samples as resampling the whole file at once
+            float* last_samples = resample(samples_44100Hz, n_samples, NULL);
+            if (last_samples == NULL) {
+                res = MEMORY_ERROR;
+            } else {
+                res = consumer(last_samples, n_samples / 8, data);
+                free(last_samples);
+            }
+            break;
+        }
+
+        unsigned int n = resample_available(samples_44100Hz, n_samples, samples_5512Hz);
+        res = consumer(samples_5512Hz, n, data);
+        n_kept = n_samples - 8 * n;
+        memmove(samples_44100Hz, samples_44100Hz + 8 * n, n_kept * sizeof(float));
+    }
+
+    free(samples_44100Hz);
+    free(samples_5512Hz);
+    return res;
+}
+
+
+struct square_sum {
+    float sum;
+    unsigned int n_samples;
+};
+
+
+static int add_squares(float* samples, unsigned int n_samples, struct square_sum* s) {
+    // Like normalize() does, the squares must be added one by one in
+    // order to get exactly the same float value
+    struct profile_span span;
+    begin_span(&span, PROFILE_NORMALIZE);
+    for (unsigned int i = 0 ; i < n_samples ; i++) {
+        s->sum += samples[i] * samples[i];
+    }
+    end_span(&span, n_samples);
+    s->n_samples += n_samples;
+    return SUCCESS;
+}
+
+
+struct segmented_fingerprint {
+    float rms;
+
+    // The normalized samples of the current segment. The first
+    // sample is the first one of spectral image #first_image
+    float* segment;
+    unsigned int segment_size;
+    unsigned int n_samples;
+    unsigned int first_image;
+
+    struct signatures* signatures;
+    struct pipeline_stats stats;
+};
+
+
+/**
+ * Fingerprints the samples of the current segment, and then keeps the ones
+ * that are needed by the spectral images that did not fit in the segment.
+ */
+static int process_segment(struct segmented_fingerprint* f) {
+    unsigned int n_images = get_n_images(f->n_samples);
+    if (n_images == 0) {
+        return SUCCESS;
+    }
+
+    // The memory of a segment must be released right away, so
+    // there is no point in using an arena here
+    struct signatures* signatures;
+    struct pipeline_stats stats;
+    int res = build_fingerprint(f->segment, f->n_samples, &signatures, &stats, NULL);
+    if (res != SUCCESS) {
+        return res;
+    }
+    for (unsigned int i = 0 ; i < signatures->n_signatures ; i++) {
+        struct signature* signature = &(f->signatures->signatures[f->signatures->n_signatures]);
+        *signature = signatures->signatures[i];
+        signature->position += f->first_image;
+        (f->signatures->n_signatures)++;
+    }
+    free_signatures(signatures);
+
+    f->stats.n_workers = stats.n_workers;
+    f->stats.wall_ms += stats.wall_ms;
+    for (unsigned int s = 0 ; s < N_PIPELINE_STAGES ; s++) {
+        f->stats.stage_ms[s] += stats.stage_ms[s];
+        f->stats.n_tasks[s] += stats.n_tasks[s];
+    }
+    f->stats.idle_ms += stats.idle_ms;
+
+    unsigned int start = n_images * IMAGE_STEP;
+    memmove(f->segment, f->segment + start, (f->n_samples - start) * sizeof(float));
+    f->n_samples -= start;
+    f->first_image += n_images;
+    return SUCCESS;
+}
+
+
+static int add_to_segment(float* samples, unsigned int n_samples, struct segmented_fingerprint* f) {
+    while (n_samples > 0) {
+        if (f->n_samples == f->segment_size) {
+            int res = process_segment(f);
+            if (res != SUCCESS) {
+                return res;
+            }
+        }
+        unsigned int n = f->segment_size - f->n_samples;
+        if (n > n_samples) {
+            n = n_samples;
+        }
+        struct profile_span span;
+        begin_span(&span, PROFILE_NORMALIZE);
+        for (unsigned int i = 0 ; i < n ; i++) {
+            f->segment[(f->n_samples)++] = normalize_sample(samples[i], f->rms);
+        }
+        end_span(&span, n);
+        samples += n;
+        n_samples -= n;
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * Calculates the same fingerprint as the one obtained by reading all the samples
+ * with read_samples() and passing them to build_fingerprint(), but without ever
+ * holding all the samples in memory. The file is read twice: once to calculate the
+ * value needed to normalize the samples, and once to fingerprint the normalized
+ * samples by segments that overlap just enough for each spectral image to fit
+ * entirely in one segment.
+ */
+static int generate_fingerprint_in_segments(struct wav_reader* reader, unsigned int n_samples_44100Hz,
+                                            struct signatures* *fingerprint, struct arena* arena) {
+    unsigned int n_samples = n_samples_44100Hz / 8;
+    unsigned int n_images = get_n_images(n_samples);
+    if (n_images == 0) {
+        return FILE_TOO_SMALL;
+    }
+
+    // The read buffers and the final signatures are needed whatever the segment size,
+    // and each segment sample costs its own value, 2 bytes of frame bins and a share
+    // of the signatures of the segment
+    size_t fixed = READ_CHUNK_SIZE * sizeof(float) + (READ_CHUNK_SIZE / 8) * sizeof(float)
+                    + n_images * sizeof(struct signature);
+    size_t cost_per_sample = sizeof(float) + (NUMBER_OF_BINS * sizeof(float)) / INTERVAL_BETWEEN_FRAMES + 1;
+    size_t segment_size = max_memory > fixed ? (max_memory - fixed) / cost_per_sample : 0;
+    if (segment_size < MIN_SEGMENT_SIZE) {
+        segment_size = MIN_SEGMENT_SIZE;
+    }
+    if (segment_size > n_samples) {
+        segment_size = n_samples;
+    }
+    fprintf(stderr, "Fingerprinting by segments of %zu 5512Hz samples to fit in %zu bytes...\n", segment_size, max_memory);
+
+    fprintf(stderr, "Calculating the RMS of the samples...\n");
+    struct square_sum square_sum = { 0, 0 };
+    int res = stream_5512Hz_samples(reader, (sample_consumer)add_squares, &square_sum);
+    if (res != SUCCESS) {
+        return res;
+    }
+    fprintf(stderr, "%d 5512Hz mono samples\n", square_sum.n_samples);
+
+    struct segmented_fingerprint f;
+    memset(&f, 0, sizeof(f));
+    f.rms = get_rms(square_sum.sum, square_sum.n_samples);
+    f.segment_size = segment_size;
+    f.segment = (float*)arena_alloc(arena, segment_size * sizeof(float));
+    f.signatures = (struct signatures*)malloc(sizeof(struct signatures));
+    if (f.segment == NULL || f.signatures == NULL) {
+        arena_free(arena, f.segment);
+        free(f.signatures);
+        return MEMORY_ERROR;
+    }
+    count_profile_bytes(PROFILE_NORMALIZE, segment_size * sizeof(float));
+    f.signatures->n_signatures = 0;
+    f.signatures->signatures = (struct signature*)malloc(n_images * sizeof(struct signature));
+    if (f.signatures->signatures == NULL) {
+        arena_free(arena, f.segment);
+        free(f.signatures);
+        return MEMORY_ERROR;
+    }
+
+    res = stream_5512Hz_samples(reader, (sample_consumer)add_to_segment, &f);
+    if (res == SUCCESS) {
+        res = process_segment(&f);
+    }
+    arena_free(arena, f.segment);
+    if (res != SUCCESS) {
+        free_signatures(f.signatures);
+        return res;
+    }
+    if (is_profiling_enabled()) {
+        print_pipeline_stats(stderr, &(f.stats));
+    }
+    fprintf(stderr, "Generated %d signatures\n", f.signatures->n_signatures);
+
+    *fingerprint = f.signatures;
+    return SUCCESS;
+}
+
+
 int generate_fingerprint(const char* wav, struct signatures* *fingerprint,
-                            char* *artist, char* *track_title, char* *album_title) {
+                            char* *artist, char* *track_title, char* *album_title, struct arena* arena) {
     // Let's make sure we have a wave file we can read
     struct wav_reader* reader;
     int res = new_wav_reader(wav, &reader);
@@ -34,42 +326,40 @@ int generate_fingerprint(const char* wav, struct signatures* *fingerprint,
     reader->track_title = NULL;
     reader->album_title = NULL;
 
+    // If the whole file does not fit in the memory budget,
+    // we have to process it bit by bit
+    unsigned int n_samples_44100Hz = reader->data_chunk_size / reader->wBlockAlign;
+    if (max_memory != 0 && estimate_memory_needed(n_samples_44100Hz) > max_memory) {
+        res = generate_fingerprint_in_segments(reader, n_samples_44100Hz, fingerprint, arena);
+        free_wav_reader(reader);
+        return res;
+    }
+
     // Let's downsample the file into 5512Hz mono float samples between -1.0 and 1.0
     float* samples;
-    int n = read_samples(reader, &samples);
+    int n = read_samples(reader, &samples, arena);
     free_wav_reader(reader);
     fprintf(stderr, "%d 5512Hz mono samples\n", n);
+    if (n < 0) {
+        return n;
+    }
     if (n < SAMPLES_PER_FRAME) {
-        free(samples);
-        return n < 0 ? n : FILE_TOO_SMALL;
+        arena_free(arena, samples);
+        return FILE_TOO_SMALL;
     }
 
     // Once we get the 5512Hz mono audio samples, the next step
     // is to build many small signatures corresponding to small
     // sample zones that overlap a lot.
-    struct spectral_images* spectral_images;
-    res = build_spectral_images(samples, n, &spectral_images);
-    free(samples);
-
+    struct signatures* signatures;
+    struct pipeline_stats stats;
+    res = build_fingerprint(samples, n, &signatures, &stats, arena);
+    arena_free(arena, samples);
     if (res != SUCCESS) {
         return res;
     }
-
-    fprintf(stderr, "Got %d spectral images\n", spectral_images->n_images);
-    fprintf(stderr, "Applying Haar transform to spectral images\n");
-    apply_Haar_transform(spectral_images);
-
-    fprintf(stderr, "Building raw fingerprints\n");
-    struct rawfingerprints* rawfingerprints = build_raw_fingerprints(spectral_images);
-    free_spectral_images(spectral_images);
-    if (rawfingerprints == NULL) {
-        return MEMORY_ERROR;
-    }
-
-    struct signatures* signatures = build_signatures(rawfingerprints);
-    free_rawfingerprints(rawfingerprints);
-    if (signatures == NULL) {
-        return MEMORY_ERROR;
+    if (is_profiling_enabled()) {
+        print_pipeline_stats(stderr, &stats);
     }
     fprintf(stderr, "Generated %d signatures\n", signatures->n_signatures);
 
@@ -78,32 +368,17 @@ int generate_fingerprint(const char* wav, struct signatures* *fingerprint,
 }
 
 
-int generate_fingerprint_from_samples(float* samples, unsigned int size, struct signatures* *fingerprint) {
+int generate_fingerprint_from_samples(float* samples, unsigned int size, struct signatures* *fingerprint, struct arena* arena) {
     if (size < SAMPLES_PER_FRAME) {
         return FILE_TOO_SMALL;
     }
 
-    struct spectral_images* spectral_images;
-    int res = build_spectral_images(samples, size, &spectral_images);
-
+    struct signatures* signatures;
+    int res = build_fingerprint(samples, size, &signatures, NULL, arena);
     if (res != SUCCESS) {
         return res;
     }
 
-    apply_Haar_transform(spectral_images);
-
-    struct rawfingerprints* rawfingerprints = build_raw_fingerprints(spectral_images);
-    free_spectral_images(spectral_images);
-    if (rawfingerprints == NULL) {
-        return MEMORY_ERROR;
-    }
-
-    struct signatures* signatures = build_signatures(rawfingerprints);
-    free_rawfingerprints(rawfingerprints);
-    if (signatures == NULL) {
-        return MEMORY_ERROR;
-    }
-
     *fingerprint = signatures;
     return SUCCESS;
 }
@@ -1,10 +1,22 @@
 #ifndef _FINGERPRINTING_H
 #define _FINGERPRINTING_H
 
+#include "arena.h"
 #include "errors.h"
 #include "minhash.h"
 
 
+/**
+ * Sets the maximum amount of memory, in bytes, that generate_fingerprint()
+ * should use for its buffers, 0 meaning no limit. When a file needs more than
+ * that to be processed in one go, it is read twice and fingerprinted by segments
+ * sized to fit in the budget, which gives exactly the same fingerprint. The
+ * signatures themselves are always kept in memory, so a budget smaller than
+ * what they need cannot be honored.
+ */
+void set_max_memory(size_t bytes);
+
+
 /**
  * Given a 16-bit 44100Hz PCM wave file, this function
  * calculates an audio fingerprint for this file.
@@ -14,6 +26,9 @@
  * @param artist Where to store the artist name read from the .wav file, if any
  * @param track_title Where to store the track title read from the .wav file, if any
  * @param album_title Where to store the album title read from the .wav file, if any
+ * @param arena If not NULL, the arena to allocate the intermediate buffers from, so
+ *              that fingerprinting many files does not need new allocations for each
+ *              file. The caller is responsible for resetting it between files
  * @return SUCCESS on success
  *         CANNOT_READ_FILE if the file cannot be read
  *         MEMORY_ERROR in case of memory allocation error
@@ -24,7 +39,7 @@
  *         FILE_TOO_SMALL if the wave file is too small to generate a fingerprint
  */
 int generate_fingerprint(const char* wav, struct signatures* *fingerprint,
-                            char* *artist, char* *track_title, char* *album_title);
+                            char* *artist, char* *track_title, char* *album_title, struct arena* arena);
 
 
 /**
@@ -34,11 +49,12 @@ int generate_fingerprint(const char* wav, struct signatures* *fingerprint,
  * @param samples The samples
  * @param size The number of samples
  * @param fingerprint Where to store the fingerprint
+ * @param arena If not NULL, the arena to allocate the intermediate buffers from
  * @return SUCCESS on success
  *         MEMORY_ERROR in case of memory allocation error
  *         FILE_TOO_SMALL if the sample array is too small to generate a fingerprint
  */
-int generate_fingerprint_from_samples(float* samples, unsigned int size, struct signatures* *fingerprint);
+int generate_fingerprint_from_samples(float* samples, unsigned int size, struct signatures* *fingerprint, struct arena* arena);
 
 
 #endif
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "fingerprintio.h"
+#include "lsh.h"
+#include "profiler.h"
 
 
 static void free_index_entry(struct index_entry* entry);
@@ -14,15 +16,30 @@ void save(FILE* f, struct signatures* fingerprint, const char* wavname,
     fprintf(f, "%s\n", track_title != NULL ? track_title : "");
     fprintf(f, "%s\n", album_title != NULL ? album_title : "");
     fprintf(f, "%d\n", fingerprint->n_signatures);
+    // Formatting the bytes ourselves is much faster than calling
+    // fprintf() for each of them, which matters for big databases
+    static const char digits[] = "0123456789abcdef";
+    char line[2 * SIGNATURE_LENGTH + 1];
+    line[2 * SIGNATURE_LENGTH] = '\0';
     for (unsigned int i = 0 ; i < fingerprint->n_signatures ; i++) {
         for (unsigned int j = 0 ; j < SIGNATURE_LENGTH ; j++) {
-            fprintf(f, "%02x", fingerprint->signatures[i].minhash[j]);
+            line[2 * j] = digits[fingerprint->signatures[i].minhash[j] >> 4];
+            line[2 * j + 1] = digits[fingerprint->signatures[i].minhash[j] & 15];
         }
-        fprintf(f,"\n");
+        fprintf(f, "%s %u\n", line, fingerprint->signatures[i].position);
     }
 }
 
 
+// The beginning of the lines giving the layout of the LSH buckets
+#define BUCKET_LAYOUT_PREFIX "#buckets "
+
+
+void save_bucket_layout(FILE* f, unsigned int n_buckets, unsigned int bytes_per_bucket) {
+    fprintf(f, "%s%ux%u\n", BUCKET_LAYOUT_PREFIX, n_buckets, bytes_per_bucket);
+}
+
+
 /**
  * Reads a line from the given file and puts it, without the \n
  * in the given buffer. If dst is not NULL, the content of the
@@ -62,19 +79,57 @@ static int readline(FILE* f, char* buffer, unsigned int size, char* *dst) {
 
 
 /**
- * Reads an index entry from the given file.
+ * Parses a bucket layout line and checks that it is valid and
+ * consistent with the layout lines found before.
+ *
+ * @param line The line to parse, without its prefix
+ * @param index The index to update
+ * @return SUCCESS on success
+ *         DECODING_ERROR if the line cannot be parsed correctly, if
+ *                        the layout is invalid or if it is not the
+ *                        same as the one of the previous layout lines
+ */
+static int read_bucket_layout(const char* line, struct index* index) {
+    unsigned int n_buckets;
+    unsigned int bytes_per_bucket;
+    char end;
+    if (2 != sscanf(line, "%ux%u%c", &n_buckets, &bytes_per_bucket, &end)
+        || !is_valid_bucket_layout(n_buckets, bytes_per_bucket)) {
+        return DECODING_ERROR;
+    }
+    if (index->n_buckets != 0 && (index->n_buckets != n_buckets || index->bytes_per_bucket != bytes_per_bucket)) {
+        return DECODING_ERROR;
+    }
+    index->n_buckets = n_buckets;
+    index->bytes_per_bucket = bytes_per_bucket;
+    return SUCCESS;
+}
+
+
+/**
+ * Reads an index entry from the given file, taking into account
+ * the bucket layout lines that may precede it.
  *
  * @param f The file to read from
+ * @param index The index being read, whose bucket layout may be updated
  * @param entry Where to store the result
  * @return SUCCESS on success
  *         CANNOT_READ_FILE if we have reached the end of file
  *         MEMORY_ERROR in case of memory allocation error
  *         DECODING_ERROR if the file cannot be parsed correctly
  */
-static int read_entry(FILE* f, struct index_entry* *entry) {
+static int read_entry(FILE* f, struct index* index, struct index_entry* *entry) {
     char buffer[1024];
-    if (CANNOT_READ_FILE == readline(f, buffer, 1024, NULL)) {
-        return CANNOT_READ_FILE;
+    while (1) {
+        if (CANNOT_READ_FILE == readline(f, buffer, 1024, NULL)) {
+            return CANNOT_READ_FILE;
+        }
+        if (strncmp(buffer, BUCKET_LAYOUT_PREFIX, strlen(BUCKET_LAYOUT_PREFIX))) {
+            break;
+        }
+        if (SUCCESS != read_bucket_layout(buffer + strlen(BUCKET_LAYOUT_PREFIX), index)) {
+            return DECODING_ERROR;
+        }
     }
 
     (*entry) = (struct index_entry*)calloc(1, sizeof(struct index_entry));
@@ -133,8 +188,13 @@ static int read_entry(FILE* f, struct index_entry* *entry) {
             free_index_entry(*entry);
             return res == CANNOT_READ_FILE ? DECODING_ERROR : res;
         }
-        if (strlen(buffer) != 200) {
-            // We expect 100 values represented each with 2 hexadecimal digits
+        // We expect 100 values represented each with 2 hexadecimal digits,
+        // optionally followed by a space and the position of the hash
+        unsigned int len = strlen(buffer);
+        if (len == 200) {
+            (*entry)->signatures->signatures[i].position = i;
+        } else if (len < 202 || buffer[200] != ' '
+                    || 1 != sscanf(&(buffer[201]), "%u", &((*entry)->signatures->signatures[i].position))) {
             free_index_entry(*entry);
             return DECODING_ERROR;
         }
@@ -166,6 +226,8 @@ int read_index(const char* filename, struct index* *index) {
     }
 
     (*index)->n_entries = 0;
+    (*index)->n_buckets = 0;
+    (*index)->bytes_per_bucket = 0;
     unsigned int capacity = 1;
     (*index)->entries = (struct index_entry**)malloc(capacity * sizeof(struct index_entry*));
     if ((*index)->entries == NULL) {
@@ -174,24 +236,32 @@ int read_index(const char* filename, struct index* *index) {
         return MEMORY_ERROR;
     }
 
+    struct profile_span span;
+    begin_span(&span, PROFILE_DB_PARSE);
+    unsigned long n_signatures = 0;
     struct index_entry* tmp;
     while (1) {
-        int res = read_entry(f, &tmp);
+        int res = read_entry(f, *index, &tmp);
         if (res == CANNOT_READ_FILE) {
             break;
         }
 
         if (res != SUCCESS) {
+            end_span(&span, n_signatures);
             free_index(*index);
             fclose(f);
             return res;
         }
+        n_signatures += tmp->signatures->n_signatures;
+        count_profile_bytes(PROFILE_DB_PARSE, sizeof(struct index_entry) + sizeof(struct signatures)
+                                                + tmp->signatures->n_signatures * sizeof(struct signature));
 
         if (capacity == (*index)->n_entries) {
             // If the array is full, it's time to reallocate
             capacity = 2 * capacity;
             struct index_entry** new_array = (struct index_entry**)realloc((*index)->entries, capacity * sizeof(struct index_entry*));
             if (new_array == NULL) {
+                end_span(&span, n_signatures);
                 free_index(*index);
                 fclose(f);
                 return MEMORY_ERROR;
@@ -200,6 +270,7 @@ int read_index(const char* filename, struct index* *index) {
         }
         (*index)->entries[((*index)->n_entries)++] = tmp;
     }
+    end_span(&span, n_signatures);
 
     fclose(f);
     return SUCCESS;
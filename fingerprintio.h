@@ -25,6 +25,11 @@ struct index {
 
     // The entries
     struct index_entry** entries;
+
+    // The layout of the LSH buckets to use for this database,
+    // or 0 and 0 if the database does not specify one
+    unsigned int n_buckets;
+    unsigned int bytes_per_bucket;
 };
 
 /**
@@ -37,7 +42,9 @@ struct index {
  * - number of hashes
  *
  * This is followed by one line per hash, where each hash line consists of the hexadecimal representation
- * of the 100 bytes that constitute a hash.
+ * of the 100 bytes that constitute a hash, followed by a space and the position of the hash in the
+ * audio input. When reading an index, lines without a position are accepted for compatibility with
+ * older files, in which case the index of the hash in the list is used as its position.
  *
  * @param f The file to save to
  * @param fingerprint The fingerprint to save
@@ -49,6 +56,15 @@ struct index {
 void save(FILE* f, struct signatures* fingerprint, const char* wavname,
             const char* artist, const char* track_title, const char* album_title);
 
+/**
+ * Saves a line telling which layout of LSH buckets to use for the database,
+ * so that the choice made when building the database does not have to be
+ * repeated each time it is loaded. The line can be anywhere in the database,
+ * so that databases can still be made by concatenating index files, but all
+ * the layout lines of a database must be the same.
+ */
+void save_bucket_layout(FILE* f, unsigned int n_buckets, unsigned int bytes_per_bucket);
+
 /**
  * Loads the index contained in the given file.
  *
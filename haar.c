@@ -1,17 +1,12 @@
 #include <math.h>
-#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "haar.h"
+#include "threadpool.h"
 
-#define N_THREADS 8
-
-
-struct haar_transform_job {
-    struct spectral_image* images;
-    unsigned int first_image;
-    unsigned int last_image;
-};
+// The minimum number of images that a thread
+// transforms at once when working in parallel
+#define MIN_IMAGES_PER_CHUNK 4
 
 
 /**
@@ -42,9 +37,6 @@ static void transform_array(float* data, unsigned int size) {
 }
 
 
-/**
- * Transforms in place a spectral image.
- */
 void transform_image(struct spectral_image* image) {
     // The 2D standard Haar transform consists of applying
     // the 1D Haar transform to each row of the image and then
@@ -73,37 +65,14 @@ void transform_image(struct spectral_image* image) {
 }
 
 
-static void* launch_Haar_job(struct haar_transform_job* job) {
-    for (unsigned int i = job->first_image ; i <= job->last_image ; i++) {
-        transform_image(&(job->images[i]));
+static int launch_Haar_job(struct spectral_image* images, unsigned int first_image, unsigned int end) {
+    for (unsigned int i = first_image ; i < end ; i++) {
+        transform_image(&(images[i]));
     }
-
-    return NULL;
+    return SUCCESS;
 }
 
 
 void apply_Haar_transform(struct spectral_images* spectral_images) {
-    unsigned int n_Haar_threads = N_THREADS;
-    if (spectral_images->n_images < 2 * N_THREADS) {
-        n_Haar_threads = 1;
-    }
-    pthread_t thread[N_THREADS];
-    struct haar_transform_job haar_job[N_THREADS];
-    unsigned int images_per_thread = spectral_images->n_images / n_Haar_threads;
-
-    for (unsigned int k = 0 ; k < n_Haar_threads ; k++) {
-        unsigned int start = k * images_per_thread;
-        unsigned int end = (k == n_Haar_threads - 1)
-                        ? spectral_images->n_images - 1
-                        : (k + 1) * images_per_thread - 1;
-        haar_job[k].images = spectral_images->images;
-        haar_job[k].first_image = start;
-        haar_job[k].last_image = end;
-
-        pthread_create(&(thread[k]), NULL, (void* (*)(void*))launch_Haar_job, &(haar_job[k]));
-    }
-    for (unsigned int k = 0 ; k < n_Haar_threads ; k++) {
-        pthread_join(thread[k], NULL);
-    }
+    parallel_for(spectral_images->n_images, MIN_IMAGES_PER_CHUNK, (parallel_function)launch_Haar_job, spectral_images->images);
 }
-
@@ -30,4 +30,10 @@
 void apply_Haar_transform(struct spectral_images* images);
 
 
+/**
+ * Transforms in place a single spectral image.
+ */
+void transform_image(struct spectral_image* image);
+
+
 #endif
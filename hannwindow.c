@@ -1,8 +1,10 @@
 #include <math.h>
+#include <pthread.h>
 #include "hannwindow.h"
 
 
-static float window[SAMPLES_PER_FRAME] = { 666 };
+static float window[SAMPLES_PER_FRAME];
+static pthread_once_t window_once = PTHREAD_ONCE_INIT;
 
 
 static void initialize() {
@@ -13,9 +15,7 @@ static void initialize() {
 
 
 float* get_Hann_window() {
-    if (window[0] > 600) {
-        initialize();
-    }
+    pthread_once(&window_once, initialize);
 
     return window;
 }
@@ -0,0 +1,143 @@
+#include <pthread.h>
+#include "hashcompare.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_SIMD
+#endif
+
+
+// How many candidates ahead we prefetch in compare_hashes_batch()
+#define PREFETCH_DISTANCE 8
+
+
+static unsigned int compare_hashes_scalar(uint8_t* hash1, uint8_t* hash2) {
+    unsigned int n = 0;
+    for (unsigned int i = 0 ; i < SIGNATURE_LENGTH ; i++) {
+        if (hash1[i] == hash2[i]) {
+            n++;
+        }
+    }
+    return n;
+}
+
+
+#ifdef X86_SIMD
+
+// The vectorized versions compare the hashes by blocks of 16, 32 or 64 bytes.
+// Since SIGNATURE_LENGTH is not a multiple of the block size, the last block is
+// read so that it ends exactly at the end of the hash and the bytes it shares
+// with the previous block are shifted out of the comparison mask. This way we
+// never read past the end of a hash.
+
+__attribute__((target("sse2")))
+static unsigned int compare_hashes_sse2(uint8_t* hash1, uint8_t* hash2) {
+    unsigned int n = 0;
+    unsigned int i = 0;
+    for ( ; i + 16 <= SIGNATURE_LENGTH ; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i*)(hash1 + i));
+        __m128i b = _mm_loadu_si128((__m128i*)(hash2 + i));
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)));
+    }
+    if (i < SIGNATURE_LENGTH) {
+        unsigned int start = SIGNATURE_LENGTH - 16;
+        __m128i a = _mm_loadu_si128((__m128i*)(hash1 + start));
+        __m128i b = _mm_loadu_si128((__m128i*)(hash2 + start));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+        n += __builtin_popcount(mask >> (i - start));
+    }
+    return n;
+}
+
+
+__attribute__((target("avx2,popcnt")))
+static unsigned int compare_hashes_avx2(uint8_t* hash1, uint8_t* hash2) {
+    unsigned int n = 0;
+    unsigned int i = 0;
+    for ( ; i + 32 <= SIGNATURE_LENGTH ; i += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i*)(hash1 + i));
+        __m256i b = _mm256_loadu_si256((__m256i*)(hash2 + i));
+        n += __builtin_popcount((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+    }
+    if (i < SIGNATURE_LENGTH) {
+        unsigned int start = SIGNATURE_LENGTH - 32;
+        __m256i a = _mm256_loadu_si256((__m256i*)(hash1 + start));
+        __m256i b = _mm256_loadu_si256((__m256i*)(hash2 + start));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        n += __builtin_popcount(mask >> (i - start));
+    }
+    return n;
+}
+
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static unsigned int compare_hashes_avx512(uint8_t* hash1, uint8_t* hash2) {
+    unsigned int n = 0;
+    unsigned int i = 0;
+    for ( ; i + 64 <= SIGNATURE_LENGTH ; i += 64) {
+        __m512i a = _mm512_loadu_si512((void*)(hash1 + i));
+        __m512i b = _mm512_loadu_si512((void*)(hash2 + i));
+        n += __builtin_popcountll(_mm512_cmpeq_epi8_mask(a, b));
+    }
+    if (i < SIGNATURE_LENGTH) {
+        // With AVX-512, we can use a masked load that does not
+        // touch the bytes past the end of the hash
+        __mmask64 tail = (((__mmask64)1) << (SIGNATURE_LENGTH - i)) - 1;
+        __m512i a = _mm512_maskz_loadu_epi8(tail, (void*)(hash1 + i));
+        __m512i b = _mm512_maskz_loadu_epi8(tail, (void*)(hash2 + i));
+        n += __builtin_popcountll(_mm512_mask_cmpeq_epi8_mask(tail, a, b));
+    }
+    return n;
+}
+
+#endif
+
+
+// The implementation selected for the current CPU
+static unsigned int (*implementation)(uint8_t*, uint8_t*) = compare_hashes_scalar;
+static pthread_once_t implementation_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Selects the best implementation for the current CPU.
+ */
+static void select_implementation() {
+#ifdef X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt")) {
+        implementation = compare_hashes_avx512;
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        implementation = compare_hashes_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        implementation = compare_hashes_sse2;
+    }
+#endif
+}
+
+
+/**
+ * Returns the best implementation for the current CPU,
+ * selecting it on the first call.
+ */
+static unsigned int (*get_implementation())(uint8_t*, uint8_t*) {
+    pthread_once(&implementation_once, select_implementation);
+    return implementation;
+}
+
+
+unsigned int compare_hashes(uint8_t* hash1, uint8_t* hash2) {
+    return get_implementation()(hash1, hash2);
+}
+
+
+void compare_hashes_batch(uint8_t* hash, uint8_t** candidates, unsigned int n, unsigned int* scores) {
+    unsigned int (*compare)(uint8_t*, uint8_t*) = get_implementation();
+    for (unsigned int i = 0 ; i < n ; i++) {
+        if (i + PREFETCH_DISTANCE < n) {
+            // A hash spans 2 or 3 cache lines, so let's fetch its first and last bytes
+            __builtin_prefetch(candidates[i + PREFETCH_DISTANCE]);
+            __builtin_prefetch(candidates[i + PREFETCH_DISTANCE] + SIGNATURE_LENGTH - 1);
+        }
+        scores[i] = compare(hash, candidates[i]);
+    }
+}
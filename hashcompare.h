@@ -0,0 +1,35 @@
+#ifndef _HASHCOMPARE_H
+#define _HASHCOMPARE_H
+
+#include <stdint.h>
+#include "minhash.h"
+
+
+/**
+ * Returns the number of bytes that are identical between
+ * the given hashes of SIGNATURE_LENGTH bytes.
+ *
+ * Since this is called for every candidate that passes the
+ * LSH bucket filter, the comparison is vectorized when the CPU
+ * allows it: on x86, the best of the AVX-512, AVX2 and SSE2
+ * implementations is selected at runtime, the other platforms
+ * using a plain byte loop.
+ */
+unsigned int compare_hashes(uint8_t* hash1, uint8_t* hash2);
+
+
+/**
+ * Compares the given hash with each of the n given candidate
+ * hashes, prefetching the candidates a few iterations ahead since
+ * they are usually scattered in memory.
+ *
+ * @param hash The hash to compare
+ * @param candidates An array of n hashes of SIGNATURE_LENGTH bytes
+ * @param n The number of candidates
+ * @param scores Where to store the number of identical bytes between
+ *               hash and each candidate
+ */
+void compare_hashes_batch(uint8_t* hash, uint8_t** candidates, unsigned int n, unsigned int* scores);
+
+
+#endif
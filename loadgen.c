@@ -0,0 +1,306 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "toolutils.h"
+#include "wav.h"
+
+// This program is a load generator for the 'mnemophonix serve' mode. It
+// opens several concurrent connections to the server and sends identification
+// requests for the files listed in the given list file, cycling through the list
+// until the requested number of requests has been sent. It then prints the
+// throughput and the latency distribution as seen by the clients.
+//
+//   $ ./mnemophonix serve db /tmp/mnemophonix.sock &
+//   $ make loadgen
+//   $ ./loadgen -c 8 -n 1000 /tmp/mnemophonix.sock list
+//
+// With -pcm, the files must be 44100Hz 16-bit stereo wave files. Their samples are
+// loaded once and sent as raw PCM payloads, so that the measure does not include
+// the decoding of the files by the server.
+
+#define MAX_CLIENTS 256
+
+// The maximum length of a response line
+#define MAX_RESPONSE_LINE 8192
+
+struct input {
+    char* filename;
+
+    // The raw samples to send in PCM mode
+    uint8_t* pcm;
+    unsigned int pcm_size;
+};
+
+
+struct load {
+    const char* socket_path;
+    int pcm;
+
+    struct input* inputs;
+    unsigned int n_inputs;
+
+    unsigned int n_requests;
+    unsigned int next_request;
+
+    // The latency of each request in milliseconds
+    double* latencies;
+
+    unsigned int n_matches;
+    unsigned int n_no_matches;
+    unsigned int n_errors;
+
+    pthread_mutex_t lock;
+};
+
+
+static int connect_to_server(const char* socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static void* launch_client(struct load* load) {
+    int fd = connect_to_server(load->socket_path);
+    FILE* in = fd < 0 ? NULL : fdopen(fd, "r");
+    int fd2 = fd < 0 ? -1 : dup(fd);
+    FILE* out = fd2 < 0 ? NULL : fdopen(fd2, "w");
+    if (in == NULL || out == NULL) {
+        fprintf(stderr, "Cannot connect to '%s'\n", load->socket_path);
+        if (in != NULL) fclose(in);
+        if (out != NULL) fclose(out);
+        return NULL;
+    }
+
+    char response[MAX_RESPONSE_LINE];
+    while (1) {
+        pthread_mutex_lock(&(load->lock));
+        unsigned int i = load->next_request;
+        if (i < load->n_requests) {
+            (load->next_request)++;
+        }
+        pthread_mutex_unlock(&(load->lock));
+        if (i >= load->n_requests) {
+            break;
+        }
+
+        struct input* input = &(load->inputs[i % load->n_inputs]);
+        double before = time_in_milliseconds();
+        if (load->pcm) {
+            fprintf(out, "PCM %u\n", input->pcm_size);
+            fwrite(input->pcm, sizeof(uint8_t), input->pcm_size, out);
+        } else {
+            fprintf(out, "FILE %s\n", input->filename);
+        }
+        fflush(out);
+        int ok = (NULL != fgets(response, MAX_RESPONSE_LINE, in));
+        double latency = time_in_milliseconds() - before;
+
+        pthread_mutex_lock(&(load->lock));
+        load->latencies[i] = latency;
+        if (ok && strstr(response, "\"status\":\"ok\"")) {
+            (load->n_matches)++;
+        } else if (ok && strstr(response, "\"status\":\"no_match\"")) {
+            (load->n_no_matches)++;
+        } else {
+            (load->n_errors)++;
+        }
+        pthread_mutex_unlock(&(load->lock));
+
+        if (!ok) {
+            fprintf(stderr, "Connection closed by the server\n");
+            break;
+        }
+    }
+
+    fclose(out);
+    fclose(in);
+    return NULL;
+}
+
+
+/**
+ * Loads the raw samples of the given 44100Hz 16-bit stereo wave file.
+ */
+static int load_pcm(struct input* input) {
+    struct wav_reader* reader;
+    int res = new_wav_reader(input->filename, &reader);
+    if (res != SUCCESS) {
+        return res;
+    }
+    if (reader->wChannels != 2) {
+        free_wav_reader(reader);
+        return UNSUPPORTED_WAVE_FORMAT;
+    }
+    input->pcm_size = reader->data_chunk_size;
+    input->pcm = (uint8_t*)malloc(input->pcm_size > 0 ? input->pcm_size : 1);
+    if (input->pcm == NULL) {
+        free_wav_reader(reader);
+        return MEMORY_ERROR;
+    }
+    if (0 != fseek(reader->f, reader->data_chunk_position, SEEK_SET)
+        || input->pcm_size != fread(input->pcm, sizeof(uint8_t), input->pcm_size, reader->f)) {
+        free_wav_reader(reader);
+        return DECODING_ERROR;
+    }
+    free_wav_reader(reader);
+    return SUCCESS;
+}
+
+
+static int read_inputs(const char* list, struct load* load) {
+    FILE* f = fopen(list, "r");
+    if (f == NULL) {
+        return CANNOT_READ_FILE;
+    }
+
+    unsigned int capacity = 16;
+    load->n_inputs = 0;
+    load->inputs = (struct input*)malloc(capacity * sizeof(struct input));
+    if (load->inputs == NULL) {
+        fclose(f);
+        return MEMORY_ERROR;
+    }
+
+    char buffer[4096];
+    while (NULL != fgets(buffer, 4096, f)) {
+        int len = strlen(buffer);
+        if (len > 0 && buffer[len - 1] == '\n') {
+            buffer[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (load->n_inputs == capacity) {
+            capacity *= 2;
+            struct input* tmp = (struct input*)realloc(load->inputs, capacity * sizeof(struct input));
+            if (tmp == NULL) {
+                fclose(f);
+                return MEMORY_ERROR;
+            }
+            load->inputs = tmp;
+        }
+        struct input* input = &(load->inputs[load->n_inputs]);
+        input->filename = strdup(buffer);
+        input->pcm = NULL;
+        input->pcm_size = 0;
+        if (input->filename == NULL) {
+            fclose(f);
+            return MEMORY_ERROR;
+        }
+        if (load->pcm) {
+            if (SUCCESS != load_pcm(input)) {
+                fprintf(stderr, "Cannot load '%s' as a 44100Hz 16-bit stereo wave file\n", buffer);
+                fclose(f);
+                return DECODING_ERROR;
+            }
+        }
+        (load->n_inputs)++;
+    }
+
+    fclose(f);
+    return SUCCESS;
+}
+
+
+static void print_usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-pcm] [-c <clients>] [-n <requests>] <socket> <list>\n", name);
+    fprintf(stderr, "  Sends <requests> identification requests (default: 1 per input) to the\n");
+    fprintf(stderr, "  server listening on <socket> from <clients> concurrent connections\n");
+    fprintf(stderr, "  (default: 1), using the input files listed in <list>, one per line.\n");
+    fprintf(stderr, "  With -pcm, the samples of the files are sent instead of their paths.\n");
+}
+
+
+int main(int argc, char* argv[]) {
+    struct load load;
+    load.pcm = 0;
+    load.n_requests = 0;
+    unsigned int n_clients = 1;
+
+    int i = 1;
+    for ( ; i < argc && argv[i][0] == '-' ; i++) {
+        if (!strcmp(argv[i], "-pcm")) {
+            load.pcm = 1;
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            n_clients = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            load.n_requests = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - i != 2 || n_clients == 0 || n_clients > MAX_CLIENTS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    load.socket_path = argv[i];
+
+    switch (read_inputs(argv[i + 1], &load)) {
+        case CANNOT_READ_FILE: fprintf(stderr, "Cannot read file '%s'\n", argv[i + 1]); return 1;
+        case MEMORY_ERROR: fprintf(stderr, "Memory allocation error\n"); return 1;
+        case SUCCESS: break;
+        default: return 1;
+    }
+    if (load.n_inputs == 0) {
+        fprintf(stderr, "No input in '%s'\n", argv[i + 1]);
+        return 1;
+    }
+    if (load.n_requests == 0) {
+        load.n_requests = load.n_inputs;
+    }
+
+    load.latencies = (double*)calloc(load.n_requests, sizeof(double));
+    if (load.latencies == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+    load.next_request = 0;
+    load.n_matches = 0;
+    load.n_no_matches = 0;
+    load.n_errors = 0;
+    pthread_mutex_init(&(load.lock), NULL);
+
+    double before = time_in_milliseconds();
+    pthread_t thread[MAX_CLIENTS];
+    for (unsigned int k = 0 ; k < n_clients ; k++) {
+        pthread_create(&(thread[k]), NULL, (void* (*)(void*))launch_client, &load);
+    }
+    for (unsigned int k = 0 ; k < n_clients ; k++) {
+        pthread_join(thread[k], NULL);
+    }
+    double total = time_in_milliseconds() - before;
+    pthread_mutex_destroy(&(load.lock));
+
+    // If some connections failed, some requests may never have been sent
+    unsigned int n = load.next_request;
+
+    printf("%u requests from %u clients in %.3f s (%.1f requests/s)\n", n, n_clients,
+            total / 1000.0, total > 0 ? n * 1000.0 / total : 0.0);
+    printf("%u matches, %u no matches, %u errors\n", load.n_matches, load.n_no_matches, load.n_errors);
+    if (n > 0) {
+        printf("latency (ms): p50 %.3f  p95 %.3f  p99 %.3f  max %.3f\n",
+                get_percentile(load.latencies, n, 50),
+                get_percentile(load.latencies, n, 95),
+                get_percentile(load.latencies, n, 99),
+                get_percentile(load.latencies, n, 100));
+    }
+
+    return load.n_errors == 0 && n == load.n_requests ? 0 : 1;
+}
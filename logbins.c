@@ -1,4 +1,5 @@
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include "logbins.h"
@@ -6,7 +7,8 @@
 #define MINIMUM_FREQUENCY 318
 #define MAXIMUM_FREQUENCY 2000
 
-static uint16_t bin_indexes[NUMBER_OF_BINS + 1] = { 0xFFFF };
+static uint16_t bin_indexes[NUMBER_OF_BINS + 1];
+static pthread_once_t bin_indexes_once = PTHREAD_ONCE_INIT;
 
 
 /**
@@ -56,10 +58,8 @@ static void generate_bin_indexes() {
 
 
 void calculate_bins(float* real, float* imaginary, float* bins) {
-    if (bin_indexes[0] == 0xFFFF) {
-        // If needed, let's initialize the bin indexes
-        generate_bin_indexes();
-    }
+    // If needed, let's initialize the bin indexes
+    pthread_once(&bin_indexes_once, generate_bin_indexes);
 
     for (unsigned int i = 0 ; i < NUMBER_OF_BINS ; i++) {
         unsigned int min_index = bin_indexes[i];
@@ -1,24 +1,87 @@
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include "lsh.h"
+#include "profiler.h"
+#include "threadpool.h"
 
+// Below this number of signatures, building the hash tables is so fast
+// that it is not worth creating threads
+#define MIN_SIGNATURES_PER_THREAD 16384
 
-void free_signature_list(struct signature_list* list) {
-    struct signature_list* tmp;
-    while (list != NULL) {
-        tmp = list->next;
-        free(list);
-        list = tmp;
+// How many signatures ahead fill_hash_table() prefetches the slots
+#define PREFETCH_DISTANCE 16
+
+
+struct hash_tables_job {
+    struct index* database;
+    struct lsh* tables;
+};
+
+
+// The epoch is stored in the 24 highest bits of collision counter stamps
+#define MAX_EPOCH (1 << 24)
+
+// The number of classes of list lengths in the statistics
+#define N_LENGTH_CLASSES 12
+
+
+static unsigned int max_list_length = DEFAULT_MAX_LIST_LENGTH;
+static unsigned int probes_per_bucket = 0;
+static unsigned int n_buckets = DEFAULT_N_BUCKETS;
+static unsigned int bytes_per_bucket = DEFAULT_BYTES_PER_BUCKET;
+
+
+int is_valid_bucket_layout(unsigned int n, unsigned int bytes) {
+    return bytes >= MIN_BYTES_PER_BUCKET && bytes <= MAX_BYTES_PER_BUCKET
+        && n >= 1 && n * bytes <= SIGNATURE_LENGTH;
+}
+
+
+int set_bucket_layout(unsigned int n, unsigned int bytes) {
+    if (!is_valid_bucket_layout(n, bytes)) {
+        return INVALID_BUCKET_LAYOUT;
     }
+    n_buckets = n;
+    bytes_per_bucket = bytes;
+    return SUCCESS;
+}
+
+
+void get_bucket_layout(unsigned int* n, unsigned int* bytes) {
+    *n = n_buckets;
+    *bytes = bytes_per_bucket;
+}
+
+
+void set_max_list_length(unsigned int max_length) {
+    max_list_length = max_length;
+}
+
+
+void set_probes_per_bucket(unsigned int n_probes) {
+    probes_per_bucket = n_probes < MAX_PROBES_PER_BUCKET ? n_probes : MAX_PROBES_PER_BUCKET;
+}
+
+
+static void free_collision_counter(struct collision_counter* counter) {
+    free(counter->stamps);
+    free(counter);
 }
 
 
 void free_hash_tables(struct lsh* tables) {
-    for (unsigned int i = 0 ; i < N_BUCKETS ; i++) {
-        for (unsigned int j = 0 ; j < tables->size ; j++) {
-            free_signature_list(tables->buckets[i][j]);
-        }
-        free(tables->buckets[i]);
+    for (unsigned int i = 0 ; i < tables->n_buckets ; i++) {
+        free(tables->buckets[i].slots);
+        free(tables->buckets[i].wide_slots);
+        free(tables->items[i]);
     }
+    while (tables->free_counters != NULL) {
+        struct collision_counter* tmp = tables->free_counters->next;
+        free_collision_counter(tables->free_counters);
+        tables->free_counters = tmp;
+    }
+    pthread_mutex_destroy(&(tables->counters_lock));
     free(tables);
 }
 
@@ -32,23 +95,291 @@ static unsigned int count_signatures(struct index* database) {
 }
 
 
-struct signature_list* new_signature_list(unsigned int entry_index, unsigned int signature_index, struct signature_list* next) {
-    struct signature_list* l = (struct signature_list*)malloc(sizeof(struct signature_list));
-    if (l == NULL) {
+/**
+ * Returns the value of the given bucket of the given hash, made of the
+ * bytes of the bucket taken as a big-endian number. This is called for
+ * every bucket of every signature, so there is one unrolled case per
+ * possible bucket width instead of a loop over the bytes.
+ */
+static uint64_t get_bucket_value(struct lsh* tables, uint8_t* hash, unsigned int bucket) {
+    uint8_t* b = hash + bucket * tables->bytes_per_bucket;
+    switch (tables->bytes_per_bucket) {
+        case 3: return ((uint64_t)b[0] << 16) | ((uint64_t)b[1] << 8) | b[2];
+        case 4: return ((uint64_t)b[0] << 24) | ((uint64_t)b[1] << 16) | ((uint64_t)b[2] << 8) | b[3];
+        default: return ((uint64_t)b[0] << 32) | ((uint64_t)b[1] << 24) | ((uint64_t)b[2] << 16)
+                        | ((uint64_t)b[3] << 8) | b[4];
+    }
+}
+
+
+/**
+ * Mixes all the bits of the given bucket value, so that values that only differ
+ * by a few bits, like the ones of neighbouring buckets, do not end up in
+ * neighbouring slots. This is the finalizer of MurmurHash3.
+ */
+static uint64_t mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+
+static int init_bucket_table(struct bucket_table* t, unsigned int capacity, int wide) {
+    t->capacity = capacity;
+    t->size = 0;
+    t->slots = NULL;
+    t->wide_slots = NULL;
+    if (wide) {
+        t->wide_slots = (struct wide_hash_table_slot*)malloc(capacity * sizeof(struct wide_hash_table_slot));
+        if (t->wide_slots == NULL) {
+            return MEMORY_ERROR;
+        }
+        for (unsigned int i = 0 ; i < capacity ; i++) {
+            t->wide_slots[i].first_item = EMPTY_SLOT;
+        }
+    } else {
+        t->slots = (struct hash_table_slot*)malloc(capacity * sizeof(struct hash_table_slot));
+        if (t->slots == NULL) {
+            return MEMORY_ERROR;
+        }
+        for (unsigned int i = 0 ; i < capacity ; i++) {
+            t->slots[i].first_item = EMPTY_SLOT;
+        }
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * Returns the slot where the lookup of the given value starts.
+ */
+static unsigned int get_home_slot(struct bucket_table* t, uint64_t value) {
+    // The capacity is not a power of 2, so the high bits of the hash
+    // are scaled to it instead of being masked
+    return (unsigned int)(((mix(value) >> 32) * t->capacity) >> 32);
+}
+
+
+/**
+ * Returns the first_item field of the slot of the given table that holds the
+ * given value. If there is none, returns NULL, or if create is not 0, uses the
+ * empty slot where the value belongs, whose first_item is still EMPTY_SLOT.
+ * Since the tables are never full, there is always such an empty slot.
+ */
+static uint32_t* find_slot(struct bucket_table* t, uint64_t value, int create) {
+    unsigned int index = get_home_slot(t, value);
+    if (t->wide_slots != NULL) {
+        struct wide_hash_table_slot* slots = t->wide_slots;
+        while (slots[index].first_item != EMPTY_SLOT) {
+            if (slots[index].value == value) {
+                return &(slots[index].first_item);
+            }
+            index = (index + 1 == t->capacity) ? 0 : index + 1;
+        }
+        if (!create) {
+            return NULL;
+        }
+        slots[index].value = value;
+        (t->size)++;
+        return &(slots[index].first_item);
+    }
+
+    struct hash_table_slot* slots = t->slots;
+    while (slots[index].first_item != EMPTY_SLOT) {
+        if (slots[index].value == (uint32_t)value) {
+            return &(slots[index].first_item);
+        }
+        index = (index + 1 == t->capacity) ? 0 : index + 1;
+    }
+    if (!create) {
         return NULL;
     }
+    slots[index].value = (uint32_t)value;
+    (t->size)++;
+    return &(slots[index].first_item);
+}
+
+
+static void prefetch_slot(struct bucket_table* t, uint64_t value) {
+    unsigned int index = get_home_slot(t, value);
+    if (t->wide_slots != NULL) {
+        __builtin_prefetch(&(t->wide_slots[index]), 1);
+    } else {
+        __builtin_prefetch(&(t->slots[index]), 1);
+    }
+}
+
+
+/**
+ * Returns the first_item field of the slot #index of the given table.
+ */
+static uint32_t* get_slot(struct bucket_table* t, unsigned int index) {
+    return t->wide_slots != NULL ? &(t->wide_slots[index].first_item) : &(t->slots[index].first_item);
+}
+
+
+/**
+ * Returns the first item of the list of the given slot, or END_OF_LIST if it is dropped.
+ */
+static uint32_t get_list(uint32_t* first_item) {
+    return *first_item == DROPPED_LIST ? END_OF_LIST : *first_item;
+}
+
+
+/**
+ * Returns the first item of the list of the signatures whose given bucket
+ * has the given value, or END_OF_LIST if there are none.
+ */
+static uint32_t find_list(struct lsh* tables, unsigned int bucket, uint64_t value) {
+    uint32_t* first_item = find_slot(&(tables->buckets[bucket]), value, 0);
+    return first_item == NULL ? END_OF_LIST : get_list(first_item);
+}
+
+
+/**
+ * Gets the bucket values to look up for the given bucket of the given hash:
+ * the exact bucket value first, and then the neighbouring values, skipping
+ * the values already found since a list must only be visited once.
+ *
+ * @return The number of values stored in the given array, that
+ *         must be able to hold 1 + MAX_PROBES_PER_BUCKET values
+ */
+static unsigned int get_probe_values(struct lsh* tables, uint8_t* hash, unsigned int bucket, uint64_t* values) {
+    unsigned int width = tables->bytes_per_bucket;
+    uint64_t value = get_bucket_value(tables, hash, bucket);
+    values[0] = value;
+    unsigned int n = 1;
+
+    // Probe #p changes the byte #((p / 2) % width) by +/-(1 + p / (2 * width)),
+    // so that all the bytes get their +1 and -1 before any byte gets its +2
+    for (unsigned int p = 0 ; p < probes_per_bucket ; p++) {
+        unsigned int byte = (p / 2) % width;
+        int delta = 1 + p / (2 * width);
+        int original = hash[bucket * width + byte];
+        int neighbour = (p % 2 == 0) ? original + delta : original - delta;
+        // 255 means that no bit was found, so it has no neighbours
+        if (original == 255 || neighbour < 0 || neighbour >= 255) {
+            continue;
+        }
+        unsigned int shift = 8 * (width - 1 - byte);
+        uint64_t probe = (value & ~((uint64_t)0xFF << shift)) | ((uint64_t)neighbour << shift);
+        unsigned int k = 0;
+        while (k < n && values[k] != probe) {
+            k++;
+        }
+        if (k == n) {
+            values[n++] = probe;
+        }
+    }
+    return n;
+}
 
-    l->entry_index = entry_index;
-    l->signature_index = signature_index;
-    l->next = next;
 
-    return l;
+/**
+ * Prepends the item #n to the list of the given value in the given table.
+ */
+static void add_item(struct bucket_table* table, struct signature_list* items, uint32_t n, uint64_t value) {
+    uint32_t* first_item = find_slot(table, value, 1);
+    items[n].next = *first_item;
+    *first_item = n;
 }
 
 
-static uint32_t get_minhash(uint8_t* hash, int index) {
-    int base = index * BYTES_PER_BUCKET_HASH;
-    return (hash[base] << 24) | (hash[base + 1] << 16) | (hash[base + 2] << 8) | hash[base + 3];
+/**
+ * Adds all the signatures of the database to the hash table of the given bucket.
+ * Since signatures are always visited in the same order and prepended to their
+ * list, the lists are the same no matter which thread fills the table.
+ *
+ * The slots are spread over a table much bigger than the caches, so the values
+ * are computed PREFETCH_DISTANCE signatures before they are added, which gives
+ * the time to prefetch their slots.
+ *
+ * @return The number of signatures added
+ */
+static unsigned int fill_hash_table(struct index* database, struct lsh* tables, unsigned int bucket) {
+    struct bucket_table* table = &(tables->buckets[bucket]);
+    struct signature_list* items = tables->items[bucket];
+    uint64_t values[PREFETCH_DISTANCE];
+    // The number of signatures whose values were computed, and the number of signatures added
+    unsigned int n_seen = 0;
+    unsigned int n = 0;
+
+    for (unsigned int i = 0 ; i < database->n_entries ; i++) {
+        struct signatures* signatures = database->entries[i]->signatures;
+        for (unsigned int j = 0 ; j < signatures->n_signatures ; j++, n_seen++) {
+            if (n_seen - n == PREFETCH_DISTANCE) {
+                add_item(table, items, n, values[n % PREFETCH_DISTANCE]);
+                n++;
+            }
+            uint64_t value = get_bucket_value(tables, signatures->signatures[j].minhash, bucket);
+            prefetch_slot(table, value);
+            values[n_seen % PREFETCH_DISTANCE] = value;
+            items[n_seen].entry_index = i;
+            items[n_seen].signature_index = j;
+        }
+    }
+    for ( ; n < n_seen ; n++) {
+        add_item(table, items, n, values[n % PREFETCH_DISTANCE]);
+    }
+    return n;
+}
+
+
+static int launch_hash_tables_job(struct hash_tables_job* job, unsigned int first_bucket, unsigned int end) {
+    struct profile_span span;
+    begin_span(&span, PROFILE_LSH_BUILD);
+    unsigned long n_added = 0;
+    for (unsigned int i = first_bucket ; i < end ; i++) {
+        n_added += fill_hash_table(job->database, job->tables, i);
+    }
+    end_span(&span, n_added);
+    return SUCCESS;
+}
+
+
+/**
+ * Drops the lists longer than the maximum from the hash tables of the
+ * buckets in [first_bucket;end[. Their items are left in place, since
+ * the item arrays are indexed by signature number.
+ */
+static int launch_stop_list_job(struct lsh* tables, unsigned int first_bucket, unsigned int end) {
+    for (unsigned int i = first_bucket ; i < end ; i++) {
+        for (unsigned int j = 0 ; j < tables->buckets[i].capacity ; j++) {
+            unsigned int length = 0;
+            struct signature_list* items = tables->items[i];
+            uint32_t* first_item = get_slot(&(tables->buckets[i]), j);
+            uint32_t tmp = get_list(first_item);
+            while (tmp != END_OF_LIST && length <= tables->max_list_length) {
+                length++;
+                tmp = items[tmp].next;
+            }
+            if (length <= tables->max_list_length) {
+                continue;
+            }
+            while (tmp != END_OF_LIST) {
+                length++;
+                tmp = items[tmp].next;
+            }
+            *first_item = DROPPED_LIST;
+            (tables->n_stopped_lists[i])++;
+            tables->n_stopped_signatures[i] += length;
+        }
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * Returns the number of threads to use to build hash tables
+ * for the given number of signatures.
+ */
+static unsigned int get_n_threads(unsigned int total_signatures) {
+    unsigned int n_threads = get_thread_pool_size();
+    unsigned int max_useful_threads = 1 + total_signatures / MIN_SIGNATURES_PER_THREAD;
+    return n_threads < max_useful_threads ? n_threads : max_useful_threads;
 }
 
 
@@ -57,56 +388,292 @@ struct lsh* create_hash_tables(struct index* database) {
     if (tables == NULL) {
         return NULL;
     }
+    pthread_mutex_init(&(tables->counters_lock), NULL);
+    if (is_valid_bucket_layout(database->n_buckets, database->bytes_per_bucket)) {
+        tables->n_buckets = database->n_buckets;
+        tables->bytes_per_bucket = database->bytes_per_bucket;
+    } else {
+        tables->n_buckets = n_buckets;
+        tables->bytes_per_bucket = bytes_per_bucket;
+    }
     unsigned int total_signatures = count_signatures(database);
-    tables->size = total_signatures / 2;
-    for (unsigned int i = 0 ; i < N_BUCKETS ; i++) {
-        tables->buckets[i] = (struct signature_list**)calloc(tables->size, sizeof(struct signature_list*));
-        if (tables->buckets[i] == NULL) {
+    tables->n_signatures = total_signatures;
+    // The tables are sized for the worst case where all the values of a bucket are
+    // different, so that they never need to be rehashed, and kept at most 3/4 full
+    // so that probing stays short
+    unsigned int capacity = total_signatures + total_signatures / 3 + 1;
+    for (unsigned int i = 0 ; i < tables->n_buckets ; i++) {
+        int res = init_bucket_table(&(tables->buckets[i]), capacity, tables->bytes_per_bucket > 4);
+        tables->items[i] = (struct signature_list*)malloc((total_signatures > 0 ? total_signatures : 1) * sizeof(struct signature_list));
+        if (res != SUCCESS || tables->items[i] == NULL) {
             free_hash_tables(tables);
             return NULL;
         }
     }
 
-    for (unsigned int i = 0 ; i < database->n_entries ; i++) {
-        for (unsigned int j = 0 ; j < database->entries[i]->signatures->n_signatures ; j++) {
-            uint8_t* hash = database->entries[i]->signatures->signatures[j].minhash;
-            for (unsigned int k = 0 ; k < N_BUCKETS ; k++) {
-                uint32_t index = get_minhash(hash, k) % tables->size;
-                struct signature_list* tmp = new_signature_list(i, j, tables->buckets[k][index]);
-                if (tmp == NULL) {
-                    free_hash_tables(tables);
-                    return NULL;
-                }
-                tables->buckets[k][index] = tmp;
+    // The hash tables are independent from each other, so we can fill them in parallel.
+    // A table cannot be split between threads, since the slot of a value depends on the
+    // values added before it
+    unsigned int n_threads = get_n_threads(total_signatures);
+
+    struct hash_tables_job job;
+    job.database = database;
+    job.tables = tables;
+    parallel_for(tables->n_buckets, tables->n_buckets / n_threads, (parallel_function)launch_hash_tables_job, &job);
+    count_profile_bytes(PROFILE_LSH_BUILD, get_hash_tables_size(tables));
+
+    tables->max_list_length = max_list_length;
+    if (tables->max_list_length != 0) {
+        parallel_for(tables->n_buckets, tables->n_buckets / n_threads, (parallel_function)launch_stop_list_job, tables);
+    }
+    return tables;
+}
+
+
+size_t get_hash_tables_size(struct lsh* tables) {
+    size_t size = sizeof(struct lsh);
+    for (unsigned int i = 0 ; i < tables->n_buckets ; i++) {
+        size_t slot_size = tables->buckets[i].wide_slots != NULL ? sizeof(struct wide_hash_table_slot) : sizeof(struct hash_table_slot);
+        size += tables->buckets[i].capacity * slot_size
+                + (size_t)tables->n_signatures * sizeof(struct signature_list);
+    }
+    return size;
+}
+
+
+static int compare_lengths(const unsigned int* a, const unsigned int* b) {
+    return (*a < *b) - (*a > *b);
+}
+
+
+int print_lsh_stats(FILE* f, struct lsh* tables) {
+    // The lengths of the non empty lists of a hash table, to find the longest ones
+    unsigned int max_capacity = 0;
+    for (unsigned int i = 0 ; i < tables->n_buckets ; i++) {
+        if (tables->buckets[i].capacity > max_capacity) {
+            max_capacity = tables->buckets[i].capacity;
+        }
+    }
+    unsigned int* lengths = (unsigned int*)malloc(max_capacity * sizeof(unsigned int));
+    if (lengths == NULL) {
+        return MEMORY_ERROR;
+    }
+    fprintf(f, "%u signatures, %u buckets of %u bytes\n\n", tables->n_signatures,
+            tables->n_buckets, tables->bytes_per_bucket);
+
+    // List lengths are counted by classes: 1, 2, 3-4, 5-8, ..., and more than the last limit
+    fprintf(f, "bucket   values    mean     max  top 1%%  dropped |");
+    for (unsigned int c = 0 ; c < N_LENGTH_CLASSES - 1 ; c++) {
+        fprintf(f, " %6u", 1 << c);
+    }
+    fprintf(f, " %6s\n", "more");
+
+    unsigned int max_length = 0;
+    unsigned long n_top_items = 0;
+    unsigned long n_top_lists = 0;
+    unsigned long n_stopped_lists = 0;
+    unsigned long n_stopped_signatures = 0;
+    unsigned long n_all_listed = 0;
+    for (unsigned int i = 0 ; i < tables->n_buckets ; i++) {
+        unsigned int n_lists = 0;
+        unsigned int classes[N_LENGTH_CLASSES] = { 0 };
+        for (unsigned int j = 0 ; j < tables->buckets[i].capacity ; j++) {
+            unsigned int length = 0;
+            for (uint32_t tmp = get_list(get_slot(&(tables->buckets[i]), j)) ; tmp != END_OF_LIST ; tmp = tables->items[i][tmp].next) {
+                length++;
+            }
+            if (length == 0) {
+                continue;
             }
+            lengths[n_lists++] = length;
+            unsigned int c = 0;
+            while (c < N_LENGTH_CLASSES - 1 && length > (1u << c)) {
+                c++;
+            }
+            classes[c]++;
+        }
+
+        qsort(lengths, n_lists, sizeof(unsigned int), (int (*)(const void*, const void*))compare_lengths);
+        unsigned int n_top = (n_lists + 99) / 100;
+        unsigned long top_items = 0;
+        for (unsigned int j = 0 ; j < n_top ; j++) {
+            top_items += lengths[j];
+        }
+        n_top_items += top_items;
+        n_top_lists += n_top;
+        if (n_lists > 0 && lengths[0] > max_length) {
+            max_length = lengths[0];
+        }
+
+        unsigned int n_listed = tables->n_signatures - tables->n_stopped_signatures[i];
+        fprintf(f, "%6u %8u %7.2f %7u %7.1f%% %8u |", i, tables->buckets[i].size,
+                n_lists > 0 ? n_listed / (float)n_lists : 0, n_lists > 0 ? lengths[0] : 0,
+                n_listed > 0 ? 100.0 * top_items / n_listed : 0, tables->n_stopped_lists[i]);
+        n_stopped_lists += tables->n_stopped_lists[i];
+        n_stopped_signatures += tables->n_stopped_signatures[i];
+        n_all_listed += n_listed;
+        for (unsigned int c = 0 ; c < N_LENGTH_CLASSES ; c++) {
+            fprintf(f, " %6u", classes[c]);
         }
+        fprintf(f, "\n");
     }
+    free(lengths);
 
-    return tables;
+    fprintf(f, "\nLongest list: %u signatures\n", max_length);
+    fprintf(f, "Signatures in the 1%% longest lists: %.1f%% (%lu lists)\n",
+            n_all_listed > 0 ? 100.0 * n_top_items / n_all_listed : 0, n_top_lists);
+    if (tables->max_list_length != 0) {
+        fprintf(f, "Lists dropped for having more than %u signatures: %lu (%.1f%% of the signatures)\n",
+                tables->max_list_length, n_stopped_lists,
+                tables->n_signatures > 0 ? 100.0 * n_stopped_signatures / ((unsigned long)tables->n_buckets * tables->n_signatures) : 0);
+    }
+    return SUCCESS;
 }
 
 
-int get_matches(struct lsh* tables, uint8_t* hash, struct signature_list* *list) {
-    (*list) = NULL;
-    int n = 0;
+void init_match_buffer(struct match_buffer* buffer) {
+    buffer->size = 0;
+    buffer->capacity = 0;
+    buffer->matches = NULL;
+    buffer->n_allocations = 0;
+    buffer->n_band_hits = 0;
+}
+
 
-    for (unsigned int i = 0 ; i < N_BUCKETS ; i++) {
-        uint32_t index = get_minhash(hash, i) % tables->size;
-        struct signature_list* tmp = tables->buckets[i][index];
+void clear_match_buffer(struct match_buffer* buffer) {
+    free(buffer->matches);
+    init_match_buffer(buffer);
+}
+
+
+/**
+ * Adds the signature represented by the given list item to the given buffer.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int add_match(struct match_buffer* buffer, struct signature_list* item) {
+    if (buffer->size == buffer->capacity) {
+        // If the array is full, it's time to reallocate
+        unsigned int capacity = buffer->capacity == 0 ? 1024 : 2 * buffer->capacity;
+        struct partial_match* new_array = (struct partial_match*)realloc(buffer->matches, capacity * sizeof(struct partial_match));
+        if (new_array == NULL) {
+            return MEMORY_ERROR;
+        }
+        buffer->matches = new_array;
+        buffer->capacity = capacity;
+        (buffer->n_allocations)++;
+    }
+    buffer->matches[buffer->size].entry_index = item->entry_index;
+    buffer->matches[buffer->size].signature_index = item->signature_index;
+    (buffer->size)++;
+    return SUCCESS;
+}
 
-        // Let's add all these matches to our list
-        while (tmp != NULL) {
-            struct signature_list* new_item = new_signature_list(tmp->entry_index, tmp->signature_index, *list);
-            if (new_item == NULL) {
-                free_signature_list(*list);
-                return MEMORY_ERROR;
+
+int get_matches(struct lsh* tables, uint8_t* hash, struct match_buffer* buffer) {
+    buffer->size = 0;
+
+    uint64_t values[1 + MAX_PROBES_PER_BUCKET];
+    for (unsigned int i = 0 ; i < tables->n_buckets ; i++) {
+        struct signature_list* items = tables->items[i];
+        unsigned int n_values = get_probe_values(tables, hash, i, values);
+        for (unsigned int k = 0 ; k < n_values ; k++) {
+            uint32_t tmp = find_list(tables, i, values[k]);
+
+            // Let's add all these matches to our buffer
+            while (tmp != END_OF_LIST) {
+                if (MEMORY_ERROR == add_match(buffer, &(items[tmp]))) {
+                    return MEMORY_ERROR;
+                }
+                tmp = items[tmp].next;
             }
-            (*list) = new_item;
-            n++;
+        }
+    }
+
+    buffer->n_band_hits += buffer->size;
+    return buffer->size;
+}
+
+
+struct collision_counter* get_collision_counter(struct lsh* tables) {
+    pthread_mutex_lock(&(tables->counters_lock));
+    struct collision_counter* counter = tables->free_counters;
+    if (counter != NULL) {
+        tables->free_counters = counter->next;
+        (tables->n_free_counters)--;
+    }
+    pthread_mutex_unlock(&(tables->counters_lock));
+    if (counter != NULL) {
+        return counter;
+    }
 
-            tmp = tmp->next;
+    counter = (struct collision_counter*)malloc(sizeof(struct collision_counter));
+    if (counter == NULL) {
+        return NULL;
+    }
+    // Stamps with the epoch 0 are never considered current
+    counter->epoch = 0;
+    counter->stamps = (uint32_t*)calloc(tables->n_signatures > 0 ? tables->n_signatures : 1, sizeof(uint32_t));
+    if (counter->stamps == NULL) {
+        free(counter);
+        return NULL;
+    }
+    counter->next = NULL;
+    return counter;
+}
+
+
+void release_collision_counter(struct lsh* tables, struct collision_counter* counter) {
+    pthread_mutex_lock(&(tables->counters_lock));
+    if (tables->n_free_counters >= get_thread_pool_size()) {
+        pthread_mutex_unlock(&(tables->counters_lock));
+        free_collision_counter(counter);
+        return;
+    }
+    counter->next = tables->free_counters;
+    tables->free_counters = counter;
+    (tables->n_free_counters)++;
+    pthread_mutex_unlock(&(tables->counters_lock));
+}
+
+
+int get_candidates(struct lsh* tables, uint8_t* hash, unsigned int min_bucket_matches,
+                    struct collision_counter* counter, struct match_buffer* buffer) {
+    buffer->size = 0;
+
+    (counter->epoch)++;
+    if (counter->epoch == MAX_EPOCH) {
+        // When we run out of epochs, we have to actually clear the stamps
+        memset(counter->stamps, 0, tables->n_signatures * sizeof(uint32_t));
+        counter->epoch = 1;
+    }
+    uint32_t current = counter->epoch << 8;
+
+    uint64_t values[1 + MAX_PROBES_PER_BUCKET];
+    for (unsigned int i = 0 ; i < tables->n_buckets ; i++) {
+        struct signature_list* items = tables->items[i];
+        unsigned int n_values = get_probe_values(tables, hash, i, values);
+        for (unsigned int k = 0 ; k < n_values ; k++) {
+            uint32_t tmp = find_list(tables, i, values[k]);
+
+            // A signature is in only one list of each hash table, so it
+            // can only be counted once per bucket
+            while (tmp != END_OF_LIST) {
+                // The position of the item in the array is the signature number
+                uint32_t* stamp = &(counter->stamps[tmp]);
+                if (((*stamp) & 0xFFFFFF00) != current) {
+                    (*stamp) = current;
+                }
+                (*stamp)++;
+                if (((*stamp) & 0xFF) == min_bucket_matches && MEMORY_ERROR == add_match(buffer, &(items[tmp]))) {
+                    return MEMORY_ERROR;
+                }
+                (buffer->n_band_hits)++;
+                tmp = items[tmp].next;
+            }
         }
     }
 
-    return n;
+    return buffer->size;
 }
@@ -1,12 +1,28 @@
 #ifndef _LSH_H
 #define _LSH_H
 
+#include <pthread.h>
+#include <stdio.h>
 #include "fingerprintio.h"
 #include "minhash.h"
 
-#define BYTES_PER_BUCKET_HASH 4
+// A signature is split into buckets of consecutive bytes, whose number and size
+// can be chosen at runtime. Wider buckets are more selective but less likely
+// to match for similar signatures, and fewer buckets take less memory
+#define MIN_BYTES_PER_BUCKET 3
+#define MAX_BYTES_PER_BUCKET 5
+#define MAX_BUCKETS (SIGNATURE_LENGTH / MIN_BYTES_PER_BUCKET)
 
-#define N_BUCKETS (SIGNATURE_LENGTH / BYTES_PER_BUCKET_HASH)
+// The default layout: 25 buckets of 4 bytes
+#define DEFAULT_BYTES_PER_BUCKET 4
+#define DEFAULT_N_BUCKETS (SIGNATURE_LENGTH / DEFAULT_BYTES_PER_BUCKET)
+
+// In a hash table of a database without common values, the
+// lists have an average length of 2 and are never that long
+#define DEFAULT_MAX_LIST_LENGTH 1024
+
+// The maximum number of neighbouring values probed per bucket
+#define MAX_PROBES_PER_BUCKET 64
 
 
 /**
@@ -17,8 +33,76 @@ struct signature_list {
     unsigned int entry_index;
     // Index of the the signature
     unsigned int signature_index;
-    // Next list item
-    struct signature_list* next;
+    // Position of the next list item in the item array of the bucket,
+    // or END_OF_LIST
+    uint32_t next;
+};
+
+#define END_OF_LIST UINT32_MAX
+
+
+/**
+ * A slot of a bucket hash table. The tables use open addressing, so a slot
+ * holds the exact value of the bucket its list is for, and a lookup only
+ * returns the signatures whose bucket really has the value looked for.
+ * The list is given by the position of its first item in the item array
+ * of the bucket, so that a slot only takes 8 bytes for buckets of up to
+ * 4 bytes. Wider buckets need wide slots to hold their values.
+ */
+struct hash_table_slot {
+    uint32_t value;
+    uint32_t first_item;
+};
+
+struct wide_hash_table_slot {
+    uint64_t value;
+    uint32_t first_item;
+};
+
+// The first_item of a slot that is not used, which is an empty list
+#define EMPTY_SLOT END_OF_LIST
+
+// The first_item of a slot whose list was dropped for being too long. Such
+// slots are kept so that the lookups of the values stored after them still
+// find them
+#define DROPPED_LIST (UINT32_MAX - 1)
+
+
+/**
+ * The hash table of a bucket, with one slot per distinct value of the bucket.
+ */
+struct bucket_table {
+    // The number of slots
+    unsigned int capacity;
+
+    // The number of non empty slots
+    unsigned int size;
+
+    // The slots, wide_slots being used instead of slots
+    // for buckets of more than 4 bytes
+    struct hash_table_slot* slots;
+    struct wide_hash_table_slot* wide_slots;
+};
+
+
+/**
+ * When looking for a hash, we want to know which signatures of the database
+ * share at least a given number of buckets with it. Instead of gathering and
+ * sorting all the bucket matches, this structure counts them in an array indexed
+ * by signature number. To avoid clearing the whole array for each new hash,
+ * each count is stamped with the epoch at which it was last updated, so that
+ * a count with an old stamp is known to be 0.
+ */
+struct collision_counter {
+    // The current epoch, incremented for each new hash
+    uint32_t epoch;
+
+    // For each signature of the database, the number of buckets it shares
+    // with the current hash in the lowest 8 bits and the epoch in the other bits
+    uint32_t* stamps;
+
+    // Next free counter, if any
+    struct collision_counter* next;
 };
 
 
@@ -26,14 +110,100 @@ struct signature_list {
  * This structure represents one hash table per bucket.
  */
 struct lsh {
-    // The size of each hash table
-    unsigned int size;
+    // The number of buckets and the number of bytes of each of them
+    unsigned int n_buckets;
+    unsigned int bytes_per_bucket;
+
+    // The total number of signatures in the database
+    unsigned int n_signatures;
+
+    // Collision counters are large, so we keep the ones that are not
+    // in use to reuse them for the next searches, but no more than
+    // one per thread of the pool
+    struct collision_counter* free_counters;
+    unsigned int n_free_counters;
+    pthread_mutex_t counters_lock;
 
     // The array containing one hash table per bucket
-    struct signature_list** buckets[N_BUCKETS];
+    struct bucket_table buckets[MAX_BUCKETS];
+
+    // For each bucket, the list items used by its hash table. Since every
+    // signature of the database appears exactly once in each hash table,
+    // all the items of a hash table are allocated as a single array where
+    // the item for the nth signature of the database is at position n
+    struct signature_list* items[MAX_BUCKETS];
+
+    // The maximum length of the lists when the tables were built, 0 meaning
+    // no limit, and for each bucket, the number of lists that were longer
+    // and the number of signatures they contained
+    unsigned int max_list_length;
+    unsigned int n_stopped_lists[MAX_BUCKETS];
+    unsigned int n_stopped_signatures[MAX_BUCKETS];
 };
 
 
+/**
+ * Returns 1 if a signature can be split into the given number of
+ * buckets of the given number of bytes; 0 otherwise.
+ */
+int is_valid_bucket_layout(unsigned int n_buckets, unsigned int bytes_per_bucket);
+
+
+/**
+ * Sets the layout of the hash tables built for the databases that do not
+ * specify one, the default being DEFAULT_N_BUCKETS buckets of
+ * DEFAULT_BYTES_PER_BUCKET bytes.
+ *
+ * @return SUCCESS on success
+ *         INVALID_BUCKET_LAYOUT if the layout is not valid
+ */
+int set_bucket_layout(unsigned int n_buckets, unsigned int bytes_per_bucket);
+
+
+/**
+ * Gets the layout set with set_bucket_layout().
+ */
+void get_bucket_layout(unsigned int* n_buckets, unsigned int* bytes_per_bucket);
+
+
+/**
+ * Sets the maximum length of the hash table lists, 0 meaning no limit.
+ * The default is DEFAULT_MAX_LIST_LENGTH.
+ *
+ * Near-silent or very repetitive audio produces signatures with common
+ * values, like runs of 255 when no bit was found in a permutation. These
+ * values end up in lists that are much longer than the others, which every
+ * signature with the same value has to walk, while they tell very little
+ * about the audio, like stop words in a text. When building hash tables, the
+ * lists longer than the maximum are therefore dropped, so that lookups skip
+ * them. The signatures they contained can still be found with their other
+ * buckets.
+ */
+void set_max_list_length(unsigned int max_length);
+
+
+/**
+ * Sets how many neighbouring values of each bucket of a hash are also
+ * looked up by get_matches() and get_candidates(), up to MAX_PROBES_PER_BUCKET.
+ * The default is 0, i.e. only the exact values are looked up.
+ *
+ * A bucket only matches if all its bytes are equal, but the bytes of
+ * similar signatures often differ only slightly, since a MinHash value
+ * moves to a nearby position when the bits around the first set bit change.
+ * The neighbours of a bucket value are obtained by adding +1, -1, +2, -2...
+ * to one of its bytes, the smallest changes being probed first. This
+ * multi-probe lookup finds more of the similar signatures for the same
+ * hash tables, at the cost of more lookups per bucket.
+ */
+void set_probes_per_bucket(unsigned int n_probes);
+
+
+/**
+ * Returns the number of bytes used by the given hash tables.
+ */
+size_t get_hash_tables_size(struct lsh* tables);
+
+
 /**
  * LSH stands for Locality Sensitive Hashing. Instead of using one big hash
  * per complex object that would be very likely to differ, this approach
@@ -44,7 +214,12 @@ struct lsh {
  * for instance by computing the raw distance between the full hashes.
  *
  * Given a raw database, returns a structure containing one hash table per bucket,
- * or NULL in case of memory allocation error.
+ * or NULL in case of memory allocation error. The buckets follow the layout of the
+ * database if it has one, and the one given to set_bucket_layout() otherwise.
+ *
+ * The hash tables are built in parallel, each thread filling whole hash tables,
+ * so that the resulting tables are always the same as the ones that would be
+ * produced by a single thread.
  */
 struct lsh* create_hash_tables(struct index* database);
 
@@ -56,29 +231,117 @@ void free_hash_tables(struct lsh* tables);
 
 
 /**
- * Creates a new signature list item.
+ * Prints statistics about the occupancy of the given hash tables: for each
+ * bucket, the number of lists of each length, the longest list, the share
+ * of the signatures that are in the 1% longest lists and the number of lists
+ * dropped for being too long. Long lists are the ones that make lookups slow,
+ * since every query hitting them has to walk them.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int print_lsh_stats(FILE* f, struct lsh* tables);
+
+
+/**
+ * This structure represents a partial match, i.e. a signature
+ * of the database that has at least one bucket in common with
+ * the signature we are looking for.
+ */
+struct partial_match {
+    // Index of the entry in the database this signature belongs to
+    unsigned int entry_index;
+    // Index of the the signature
+    unsigned int signature_index;
+};
+
+
+/**
+ * This is a growable array of partial matches meant to be reused
+ * for all the signatures of a query, so that once it is large enough,
+ * looking for matches does not need any memory allocation.
+ */
+struct match_buffer {
+    // The number of partial matches in the array
+    unsigned int size;
+
+    // The number of partial matches the array can hold
+    unsigned int capacity;
+
+    // The partial matches
+    struct partial_match* matches;
+
+    // How many times the array had to be (re)allocated
+    unsigned int n_allocations;
+
+    // How many hash table list items have been visited by the
+    // lookups made with this buffer, whether they were added or not
+    unsigned long n_band_hits;
+};
+
+
+/**
+ * Initializes the given buffer with an empty array.
+ */
+void init_match_buffer(struct match_buffer* buffer);
+
+
+/**
+ * Frees the memory associated to the array of the given buffer.
+ */
+void clear_match_buffer(struct match_buffer* buffer);
+
+
+/**
+ * Looks for all the partial matches found for the given hash in
+ * the given hash tables. The hash table lists are read in place, so that
+ * the only memory allocation that can happen is the growth of the buffer.
+ *
+ * @param tables The LSH tables to look into
+ * @param hash A MinHash signature of SIGNATURE_LENGTH bytes
+ * @param buffer Where to store all the partial matches. Its previous
+ *               content is discarded
+ * @return The number of partial matches on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int get_matches(struct lsh* tables, uint8_t* hash, struct match_buffer* buffer);
+
+
+/**
+ * Returns a collision counter for the given hash tables, reusing a
+ * counter released earlier if possible, or NULL in case of memory
+ * allocation error. It is safe to call this from multiple threads.
  */
-struct signature_list* new_signature_list(unsigned int entry_index, unsigned int signature_index, struct signature_list* next);
+struct collision_counter* get_collision_counter(struct lsh* tables);
 
 
 /**
- * Frees all the memory associated to the given list.
+ * Gives back the given counter to the given hash tables so that it can
+ * be reused for another search. Counters are only meant to be held while
+ * looking up signatures, so that there are never more of them than threads
+ * doing lookups; the ones that are given back when there is already one
+ * free counter per thread of the pool are freed.
  */
-void free_signature_list(struct signature_list* list);
+void release_collision_counter(struct lsh* tables, struct collision_counter* counter);
 
 
 /**
- * Returns a list containing all the partial matches found for the
- * given hash in the given hash tables.
+ * Looks for all the signatures that share at least min_bucket_matches
+ * buckets with the given hash. Each bucket hit costs a single counter update,
+ * and a signature is added to the results exactly once, when its count reaches
+ * min_bucket_matches.
  *
  * @param tables The LSH tables to look into
  * @param hash A MinHash signature of SIGNATURE_LENGTH bytes
- * @param list Where to store all the partial matches. The caller
- *             is responsible for freeing it after use
- * @return The length of the list on success
+ * @param min_bucket_matches The minimum number of buckets to share with the hash
+ * @param counter A counter obtained with get_collision_counter()
+ * @param buffer Where to store the matching signatures. Its previous
+ *               content is discarded
+ * @return The number of matching signatures on success
  *         MEMORY_ERROR in case of memory allocation error
  */
-int get_matches(struct lsh* tables, uint8_t* hash, struct signature_list* *list);
+int get_candidates(struct lsh* tables, uint8_t* hash, unsigned int min_bucket_matches,
+                    struct collision_counter* counter, struct match_buffer* buffer);
 
 
 #endif
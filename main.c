@@ -1,52 +1,610 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <unistd.h>
 
 #include "ffmpeg.h"
 #include "fingerprinting.h"
 #include "fingerprintio.h"
 #include "lsh.h"
+#include "monitor.h"
+#include "profiler.h"
 #include "search.h"
+#include "server.h"
+#include "stream.h"
+#include "threadpool.h"
+#include "toolutils.h"
 
-static long time_in_milliseconds() {
-    struct timeval tv;
-    gettimeofday(&tv,NULL);
-    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+// The maximum number of workers used in batch search mode
+#define MAX_WORKERS 64
+
+// The number of candidates to print in search mode
+#define MAX_RESULTS 5
+
+// In listen mode, the size of the chunks of PCM data read from stdin (about 93ms)
+// and the duration of the audio window in which we look for matches
+#define LISTEN_CHUNK_SIZE (4096 * 4)
+#define LISTEN_WINDOW_IN_SECONDS 10.0
+
+/**
+ * Returns the number of workers to use, which is the size
+ * of the thread pool, capped at MAX_WORKERS.
+ */
+static unsigned int get_n_workers() {
+    unsigned int n = get_thread_pool_size();
+    return n > MAX_WORKERS ? MAX_WORKERS : n;
 }
 
 
-int main(int argc, char* argv[]) {
+/**
+ * Parses a memory size like "512", "512M", "2G" or "800K". A number
+ * without suffix is a number of megabytes.
+ *
+ * @return The size in bytes, or 0 if the size is invalid
+ */
+static size_t parse_memory_size(const char* s) {
+    char* end;
+    long long value = strtoll(s, &end, 10);
+    if (end == s || value <= 0) {
+        return 0;
+    }
+    size_t unit;
+    if (!strcmp(end, "") || !strcmp(end, "M")) {
+        unit = 1024 * 1024;
+    } else if (!strcmp(end, "K")) {
+        unit = 1024;
+    } else if (!strcmp(end, "G")) {
+        unit = 1024 * 1024 * 1024;
+    } else {
+        return 0;
+    }
+    return (size_t)value * unit;
+}
+
+
+// Whether the bucket layout was given with the '--buckets' option
+static int bucket_layout_given = 0;
+
+
+static void print_usage(const char* name) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, " ---                                                       ---\n");
+    fprintf(stderr, " \\  \\  mnemophonix - A simple audio fingerprinting system  \\  \\\n");
+    fprintf(stderr, " O  O                                                      O  O\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "All the modes accept a '--threads <n>' option before the mode name to set\n");
+    fprintf(stderr, "the number of threads to use instead of one per CPU. The %s\n", THREADS_ENV_VARIABLE);
+    fprintf(stderr, "environment variable can be used for the same purpose.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "They also accept a '--max-memory <size>' option to limit the memory used\n");
+    fprintf(stderr, "to fingerprint a file, in megabytes or with a K, M or G suffix. Files too\n");
+    fprintf(stderr, "big for that are fingerprinted by segments, which gives the same results\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "The '--max-list-length <n>' option sets the length above which the lists\n");
+    fprintf(stderr, "of the LSH hash tables are dropped when a database is loaded, 0 meaning no\n");
+    fprintf(stderr, "limit (default: %d). Such lists come from values that are too common to\n", DEFAULT_MAX_LIST_LENGTH);
+    fprintf(stderr, "tell anything about the audio, and would slow down every search\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "The '--probes <n>' option makes searches also look up n neighbouring values\n");
+    fprintf(stderr, "of each LSH bucket, up to %d, which finds more of the similar signatures\n", MAX_PROBES_PER_BUCKET);
+    fprintf(stderr, "but makes the search slower (default: 0)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "The '--buckets <n>x<w>' option splits signatures into n LSH buckets of w bytes,\n");
+    fprintf(stderr, "with w between %d and %d (default: %dx%d). In index mode, the layout is saved\n",
+            MIN_BYTES_PER_BUCKET, MAX_BYTES_PER_BUCKET, DEFAULT_N_BUCKETS, DEFAULT_BYTES_PER_BUCKET);
+    fprintf(stderr, "in the index so that the database always uses it. In the other modes, it is\n");
+    fprintf(stderr, "used for the databases that do not specify one\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "With the '--profile' option, the time, CPU time, number of items and bytes\n");
+    fprintf(stderr, "allocated of each processing phase are printed as JSON on stderr at the end.\n");
+    fprintf(stderr, "The '--trace <file>' option does the same and also saves the work of each\n");
+    fprintf(stderr, "thread in the given file, in the Chrome trace event format\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s index <input>\n", name);
+    fprintf(stderr, "  Prints to stdout the index data generated for the given input file. Since\n");
+    fprintf(stderr, "  the index file format is a text one, you can create a database containing\n");
+    fprintf(stderr, "  multiple indexes like this:\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  $ %s index song1.mp3 > db\n", name);
+    fprintf(stderr, "  $ %s index song2.wav >> db\n", name);
+    fprintf(stderr, "  $ %s index movie.mp4 >> db\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s search [--explain] <input> <index>\n", name);
+    fprintf(stderr, "  Looks for the given input file in the given index file. With --explain,\n");
+    fprintf(stderr, "  also prints the best candidates, how many bucket hits, candidates and good\n");
+    fprintf(stderr, "  deep checks the search went through, and the time spent on each step\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s search-batch <index> <list>\n", name);
+    fprintf(stderr, "  Loads the given index file once and then looks for all the input files\n");
+    fprintf(stderr, "  listed in the given file, one per line ('-' to read the list from stdin).\n");
+    fprintf(stderr, "  For each input, prints a line with the tab-separated input file name, the\n");
+    fprintf(stderr, "  matching entry name or '-' if there is no match, and the fingerprinting\n");
+    fprintf(stderr, "  and search times in milliseconds\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s lsh-stats <index>\n", name);
+    fprintf(stderr, "  Loads the given index file and prints statistics about the lists of its LSH\n");
+    fprintf(stderr, "  hash tables: how many lists of each length, the longest ones, and the share\n");
+    fprintf(stderr, "  of the signatures that are in the 1%% longest lists\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s serve <index> <socket>\n", name);
+    fprintf(stderr, "  Loads the given index file once and then answers identification requests\n");
+    fprintf(stderr, "  sent on the given Unix socket, either as 'FILE <path>' lines or as\n");
+    fprintf(stderr, "  'PCM <n>' lines followed by n bytes of raw 44100Hz 16-bit stereo samples.\n");
+    fprintf(stderr, "  Each request gets a one-line JSON response\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s listen <index>\n", name);
+    fprintf(stderr, "  Loads the given index file and then reads raw 44100Hz 16-bit stereo PCM\n");
+    fprintf(stderr, "  data from stdin, printing the matches found as the audio arrives, like:\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  $ ffmpeg -i radio.mp3 -f s16le -ac 2 -ar 44100 - | %s listen db\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "%s monitor <index> <input1> [<input2> ...]\n", name);
+    fprintf(stderr, "  Like listen, but for several streams at once. Each input is a file or a FIFO\n");
+    fprintf(stderr, "  providing raw 44100Hz 16-bit stereo PCM data. Prints a tab-separated line\n");
+    fprintf(stderr, "  for each detection with the time, the input, the position in the stream in\n");
+    fprintf(stderr, "  seconds, the matching entry name and the score, and the CPU time spent on\n");
+    fprintf(stderr, "  each stream when all the inputs have been read entirely\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "The input file format that this code can process is 44100Hz 16-bit PCM.\n");
+    fprintf(stderr, "If it is not the case, an attempt will be made to generate such a file using\n");
+    fprintf(stderr, "ffmpeg. Because ** ffmpeg rocks **, you can use this program with pretty\n");
+    fprintf(stderr, "much any audio or video file !\n");
+    fprintf(stderr, "\n");
+}
+
+
+/**
+ * Calculates the fingerprint of the given file, converting it with ffmpeg first if needed.
+ * In case of error, prints an error message.
+ *
+ * @return SUCCESS on success
+ *         the error code returned by generate_fingerprint_from_any_file() otherwise
+ */
+static int fingerprint_file(char* input, struct signatures* *fingerprint,
+                            char* *artist, char* *track_title, char* *album_title, struct arena* arena) {
+    int res = generate_fingerprint_from_any_file(input, fingerprint, artist, track_title, album_title, arena);
+    switch (res) {
+        case CANNOT_READ_FILE: fprintf(stderr, "Cannot read file '%s'\n", input); break;
+        case MEMORY_ERROR: fprintf(stderr, "Memory allocation error\n"); break;
+        case DECODING_ERROR: fprintf(stderr, "Cannot decode file '%s'\n", input); break;
+        case FILE_TOO_SMALL: fprintf(stderr, "'%s' is too small to generate a fingerprint\n", input); break;
+        case UNSUPPORTED_WAVE_FORMAT:
+        case NOT_A_WAVE_FILE: fprintf(stderr, "'%s' is not a wave file and we could not convert it to one with fffmpeg\n", input); break;
+    }
+    return res;
+}
+
+
+/**
+ * Loads the given database and builds its LSH tables, printing the time
+ * it took to the given stream. In case of error, prints an error message.
+ *
+ * @return SUCCESS on success
+ *         the error code returned by read_index() otherwise
+ */
+static int load_database(const char* index, struct index* *database_index, struct lsh* *lsh, FILE* status) {
+    fprintf(status, "Loading database %s...\n", index);
+    long before_loading_db = time_in_milliseconds();
+    int res = read_index(index, database_index);
+    if (res != SUCCESS) {
+        switch (res) {
+            case CANNOT_READ_FILE: fprintf(stderr, "Cannot read file '%s'\n", index); return res;
+            case MEMORY_ERROR: fprintf(stderr, "Memory allocation error\n"); return res;
+            default: fprintf(stderr, "Cannot decode file '%s'\n", index); return res;
+        }
+    }
+    long after_loading_db = time_in_milliseconds();
+    fprintf(status, "(raw database loading took %ld ms)\n", after_loading_db - before_loading_db);
+
+    (*lsh) = create_hash_tables(*database_index);
+    if ((*lsh) == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return MEMORY_ERROR;
+    }
+    long after_lsh = time_in_milliseconds();
+    fprintf(status, "(lsh index building took %ld ms)\n", after_lsh - after_loading_db);
+    return SUCCESS;
+}
+
+
+/**
+ * The result of one query in batch search mode.
+ */
+struct batch_result {
+    // Whether the query has been processed
+    int done;
+    // SUCCESS or the error code of the fingerprinting
+    int error;
+    int best_match;
+    long fingerprint_ms;
+    long search_ms;
+};
+
+
+/**
+ * The state shared by the workers in batch search mode.
+ */
+struct batch {
+    struct index* database_index;
+    struct lsh* lsh;
+
+    char** inputs;
+    unsigned int n_inputs;
+    struct batch_result* results;
+
+    // Protects the fields below
+    pthread_mutex_t lock;
+    // The index of the next input to process
+    unsigned int next_input;
+    // The index of the next result to print, since we want
+    // to print them in the order of the input list
+    unsigned int next_result;
+    unsigned int n_matches;
+    unsigned int n_errors;
+};
+
+
+static void print_batch_results(struct batch* batch) {
+    while (batch->next_result < batch->n_inputs && batch->results[batch->next_result].done) {
+        struct batch_result* r = &(batch->results[batch->next_result]);
+        const char* match = "-";
+        if (r->error == SUCCESS && r->best_match >= 0) {
+            match = batch->database_index->entries[r->best_match]->filename;
+            (batch->n_matches)++;
+        } else if (r->error != SUCCESS) {
+            (batch->n_errors)++;
+        }
+        printf("%s\t%s\t%ld\t%ld\n", batch->inputs[batch->next_result], match, r->fingerprint_ms, r->search_ms);
+        (batch->next_result)++;
+    }
+    fflush(stdout);
+}
+
+
+static void* launch_batch_worker(struct batch* batch) {
+    // The buffers needed to fingerprint a file are taken from an arena that
+    // is recycled for each file. If we cannot get one, we just use malloc()
+    struct arena* arena = new_arena();
+    while (1) {
+        pthread_mutex_lock(&(batch->lock));
+        unsigned int i = batch->next_input;
+        if (i < batch->n_inputs) {
+            (batch->next_input)++;
+        }
+        pthread_mutex_unlock(&(batch->lock));
+        if (i >= batch->n_inputs) {
+            if (arena != NULL) {
+                free_arena(arena);
+            }
+            return NULL;
+        }
+        if (arena != NULL) {
+            reset_arena(arena);
+        }
+
+        struct batch_result result;
+        result.done = 1;
+        result.best_match = NO_MATCH_FOUND;
+        result.search_ms = 0;
+
+        struct signatures* fingerprint;
+        char* artist = NULL;
+        char* track_title = NULL;
+        char* album_title = NULL;
+        long before = time_in_milliseconds();
+        result.error = fingerprint_file(batch->inputs[i], &fingerprint, &artist, &track_title, &album_title, arena);
+        long after_fingerprint = time_in_milliseconds();
+        result.fingerprint_ms = after_fingerprint - before;
+        free(artist);
+        free(track_title);
+        free(album_title);
+
+        if (result.error == SUCCESS) {
+            result.best_match = search(fingerprint, batch->database_index, batch->lsh, 0);
+            result.search_ms = time_in_milliseconds() - after_fingerprint;
+            free_signatures(fingerprint);
+            if (result.best_match == MEMORY_ERROR) {
+                result.error = MEMORY_ERROR;
+            }
+        }
+
+        pthread_mutex_lock(&(batch->lock));
+        batch->results[i] = result;
+        print_batch_results(batch);
+        pthread_mutex_unlock(&(batch->lock));
+    }
+}
+
+
+/**
+ * Reads the given list file, one input file name per line.
+ *
+ * @return The number of file names read on success
+ *         CANNOT_READ_FILE if the file cannot be read
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int read_input_list(const char* list, char** *inputs) {
+    FILE* f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+    if (f == NULL) {
+        return CANNOT_READ_FILE;
+    }
+
+    unsigned int n = 0;
+    unsigned int capacity = 16;
+    (*inputs) = (char**)malloc(capacity * sizeof(char*));
+    if ((*inputs) == NULL) {
+        if (f != stdin) fclose(f);
+        return MEMORY_ERROR;
+    }
+
+    char buffer[4096];
+    while (NULL != fgets(buffer, 4096, f)) {
+        int len = strlen(buffer);
+        if (len > 0 && buffer[len - 1] == '\n') {
+            buffer[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (n == capacity) {
+            capacity *= 2;
+            char** new_array = (char**)realloc(*inputs, capacity * sizeof(char*));
+            if (new_array == NULL) {
+                if (f != stdin) fclose(f);
+                return MEMORY_ERROR;
+            }
+            (*inputs) = new_array;
+        }
+        (*inputs)[n] = strdup(buffer);
+        if ((*inputs)[n] == NULL) {
+            if (f != stdin) fclose(f);
+            return MEMORY_ERROR;
+        }
+        n++;
+    }
+
+    if (f != stdin) fclose(f);
+    return n;
+}
+
+
+static int search_batch(const char* index, const char* list) {
+    struct batch batch;
+    int n = read_input_list(list, &(batch.inputs));
+    if (n < 0) {
+        switch (n) {
+            case CANNOT_READ_FILE: fprintf(stderr, "Cannot read file '%s'\n", list); return 1;
+            case MEMORY_ERROR: fprintf(stderr, "Memory allocation error\n"); return 1;
+        }
+    }
+    batch.n_inputs = n;
+
+    if (SUCCESS != load_database(index, &(batch.database_index), &(batch.lsh), stderr)) {
+        return 1;
+    }
+
+    batch.results = (struct batch_result*)calloc(batch.n_inputs > 0 ? batch.n_inputs : 1, sizeof(struct batch_result));
+    if (batch.results == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+    pthread_mutex_init(&(batch.lock), NULL);
+    batch.next_input = 0;
+    batch.next_result = 0;
+    batch.n_matches = 0;
+    batch.n_errors = 0;
+
+    unsigned int n_workers = get_n_workers();
+    if (n_workers > batch.n_inputs) {
+        n_workers = batch.n_inputs > 0 ? batch.n_inputs : 1;
+    }
+
+    // Only the result lines go to stdout, so that it can be parsed
+    fprintf(stderr, "Searching %u inputs with %u workers...\n", batch.n_inputs, n_workers);
+    fflush(stdout);
+    long before = time_in_milliseconds();
+    pthread_t thread[MAX_WORKERS];
+    for (unsigned int k = 0 ; k < n_workers ; k++) {
+        pthread_create(&(thread[k]), NULL, (void* (*)(void*))launch_batch_worker, &batch);
+    }
+    for (unsigned int k = 0 ; k < n_workers ; k++) {
+        pthread_join(thread[k], NULL);
+    }
+    long total = time_in_milliseconds() - before;
+
+    fprintf(stderr, "%u inputs, %u matches, %u errors in %ld ms (%.1f inputs/s, peak RSS %ld KB)\n", batch.n_inputs,
+            batch.n_matches, batch.n_errors, total, total > 0 ? 1000.0 * batch.n_inputs / total : 0, get_peak_rss_in_kb());
+    pthread_mutex_destroy(&(batch.lock));
+
+    // Since we are done, the process will be terminated so there is no point
+    // in cleaning up memory as all the pages will be recycled by the OS.
+    return batch.n_errors == 0 ? 0 : 1;
+}
+
+
+static int serve_database(const char* index, const char* socket_path) {
+    struct index* database_index;
+    struct lsh* lsh;
+    if (SUCCESS != load_database(index, &database_index, &lsh, stdout)) {
+        return 1;
+    }
+
+    unsigned int n_workers = get_n_workers();
+    printf("Listening on '%s' with %u workers...\n", socket_path, n_workers);
+    fflush(stdout);
+    switch (serve(socket_path, database_index, lsh, n_workers)) {
+        case CANNOT_READ_FILE: fprintf(stderr, "Cannot listen on '%s'\n", socket_path); break;
+        case SOCKET_IN_USE: fprintf(stderr, "'%s' is not a socket or is used by a running server\n", socket_path); break;
+        case MEMORY_ERROR: fprintf(stderr, "Memory allocation error\n"); break;
+    }
+    return 1;
+}
+
+
+static void print_entry(struct index_entry* entry) {
+    printf("Found match: '%s'\n", entry->filename);
+    if (entry->artist[0]) {
+        printf("Artist: %s\n", entry->artist);
+    }
+    if (entry->track_title[0]) {
+        printf("Track title: %s\n", entry->track_title);
+    }
+    if (entry->album_title[0]) {
+        printf("Album title: %s\n", entry->album_title);
+    }
+}
+
+
+static int listen_to_stdin(const char* index) {
+    struct index* database_index;
+    struct lsh* lsh;
+    if (SUCCESS != load_database(index, &database_index, &lsh, stdout)) {
+        return 1;
+    }
+
+    struct stream_fingerprinter* fingerprinter = new_stream_fingerprinter();
+    struct stream_search* stream_search = new_stream_search(database_index, lsh, LISTEN_WINDOW_IN_SECONDS);
+    if (fingerprinter == NULL || stream_search == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+
+    printf("Listening...\n");
+    fflush(stdout);
+    uint8_t buffer[LISTEN_CHUNK_SIZE];
+    unsigned long n_bytes = 0;
+    unsigned long n_signatures = 0;
+    int last_match = NO_MATCH_FOUND;
+    long before = time_in_milliseconds();
+    size_t n;
+    while (0 != (n = fread(buffer, sizeof(uint8_t), LISTEN_CHUNK_SIZE, stdin))) {
+        n_bytes += n;
+        struct signatures* new_signatures;
+        int res = add_pcm_data(fingerprinter, buffer, n, &new_signatures);
+        if (res == 0) {
+            continue;
+        }
+        struct search_result result;
+        if (res < 0 || MEMORY_ERROR == add_stream_signatures(stream_search, new_signatures)
+            || MEMORY_ERROR == (res = get_stream_matches(stream_search, &result, 1, 0))) {
+            fprintf(stderr, "Memory allocation error\n");
+            return 1;
+        }
+        n_signatures += new_signatures->n_signatures;
+        if (res == 1 && result.is_match) {
+            if (result.entry_index != last_match) {
+                last_match = result.entry_index;
+                float now = n_bytes / (44100.0 * 4);
+                printf("\n[%.1f s] ", now);
+                print_entry(database_index->entries[result.entry_index]);
+                printf("Score: %.1f with %d matching signatures, %.1f s into the track\n\n",
+                        result.average_score, result.n_matches, now + result.offset_in_seconds);
+                fflush(stdout);
+            }
+
+            // Like the microphone listener, we start from scratch after each
+            // match, so that a track that has just been identified does not
+            // hide the next one until its votes get out of the window
+            reset_stream_search(stream_search);
+        }
+    }
+    long total = time_in_milliseconds() - before;
+    fprintf(stderr, "%.1f s of audio, %lu signatures processed in %ld ms\n", n_bytes / (44100.0 * 4), n_signatures, total);
+
+    // Since we are done, the process will be terminated so there is no point
+    // in cleaning up memory as all the pages will be recycled by the OS.
+    return 0;
+}
+
+
+static int monitor_streams(const char* index, char** inputs, unsigned int n_inputs) {
+    struct index* database_index;
+    struct lsh* lsh;
+    if (SUCCESS != load_database(index, &database_index, &lsh, stdout)) {
+        return 1;
+    }
+
+    // There is no point in having more workers than streams
+    unsigned int n_workers = get_n_workers();
+    if (n_workers > n_inputs) {
+        n_workers = n_inputs;
+    }
+    printf("Monitoring %u streams with %u workers...\n", n_inputs, n_workers);
+    fflush(stdout);
+    switch (monitor(inputs, n_inputs, database_index, lsh, n_workers)) {
+        case SUCCESS: return 0;
+        case MEMORY_ERROR: fprintf(stderr, "Memory allocation error\n"); return 1;
+        default: return 1;
+    }
+}
+
+
+/**
+ * Loads the given database and prints statistics about its LSH tables.
+ */
+static int print_database_stats(const char* index) {
+    struct index* database_index;
+    struct lsh* lsh;
+    if (SUCCESS != load_database(index, &database_index, &lsh, stdout)) {
+        return 1;
+    }
+    printf("\n");
+    if (SUCCESS != print_lsh_stats(stdout, lsh)) {
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+    free_hash_tables(lsh);
+    free_index(database_index);
+    return 0;
+}
+
+
+/**
+ * Runs the mode given on the command line, once the
+ * options placed before the mode name have been removed.
+ */
+static int run_mode(int argc, char* argv[]) {
+    int explain = 0;
+    if (argc >= 3 && !strcmp(argv[1], "search") && !strcmp(argv[2], "--explain")) {
+        explain = 1;
+        argv[2] = argv[1];
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
     if (argc < 2
-        || (strcmp(argv[1], "index") && strcmp(argv[1], "search"))
-        || (!strcmp(argv[1], "search") && argc != 4)) {
-
-        fprintf(stderr, "\n");
-        fprintf(stderr, " ---                                                       ---\n");
-        fprintf(stderr, " \\  \\  mnemophonix - A simple audio fingerprinting system  \\  \\\n");
-        fprintf(stderr, " O  O                                                      O  O\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "Usage:\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%s index <input>\n", argv[0]);
-        fprintf(stderr, "  Prints to stdout the index data generated for the given input file. Since\n");
-        fprintf(stderr, "  the index file format is a text one, you can create a database containing\n");
-        fprintf(stderr, "  multiple indexes like this:\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "  $ %s index song1.mp3 > db\n", argv[0]);
-        fprintf(stderr, "  $ %s index song2.wav >> db\n", argv[0]);
-        fprintf(stderr, "  $ %s index movie.mp4 >> db\n", argv[0]);
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%s search <input> <index>\n", argv[0]);
-        fprintf(stderr, "  Looks for the given input file in the given index file\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "The input file format that this code can process is 44100Hz 16-bit PCM.\n");
-        fprintf(stderr, "If it is not the case, an attempt will be made to generate such a file using\n");
-        fprintf(stderr, "ffmpeg. Because ** ffmpeg rocks **, you can use this program with pretty\n");
-        fprintf(stderr, "much any audio or video file !\n");
-        fprintf(stderr, "\n");
+        || (strcmp(argv[1], "index") && strcmp(argv[1], "search") && strcmp(argv[1], "search-batch") && strcmp(argv[1], "serve")
+            && strcmp(argv[1], "listen") && strcmp(argv[1], "monitor") && strcmp(argv[1], "lsh-stats"))
+        || (!strcmp(argv[1], "index") && argc != 3)
+        || (!strcmp(argv[1], "lsh-stats") && argc != 3)
+        || (!strcmp(argv[1], "search") && argc != 4)
+        || (!strcmp(argv[1], "search-batch") && argc != 4)
+        || (!strcmp(argv[1], "serve") && argc != 4)
+        || (!strcmp(argv[1], "listen") && argc != 3)
+        || (!strcmp(argv[1], "monitor") && argc < 4)) {
+        print_usage(argv[0]);
         return 1;
     }
+
+    if (!strcmp(argv[1], "search-batch")) {
+        return search_batch(argv[2], argv[3]);
+    }
+    if (!strcmp(argv[1], "serve")) {
+        return serve_database(argv[2], argv[3]);
+    }
+    if (!strcmp(argv[1], "listen")) {
+        return listen_to_stdin(argv[2]);
+    }
+    if (!strcmp(argv[1], "monitor")) {
+        return monitor_streams(argv[2], argv + 3, argc - 3);
+    }
+    if (!strcmp(argv[1], "lsh-stats")) {
+        return print_database_stats(argv[2]);
+    }
+
     char* input = argv[2];
 
     struct signatures* fingerprint;
@@ -54,67 +612,49 @@ int main(int argc, char* argv[]) {
     char* track_title;
     char* album_title;
 
-    int res = generate_fingerprint(input, &fingerprint, &artist, &track_title, &album_title);
-    if (res != SUCCESS) {
-        switch (res) {
-            case CANNOT_READ_FILE: fprintf(stderr, "Cannot read file '%s'\n", input); return 1;
-            case MEMORY_ERROR: fprintf(stderr, "Memory allocation error\n"); return 1;
-            case DECODING_ERROR: fprintf(stderr, "Cannot decode file '%s'\n", input); return 1;
-            case FILE_TOO_SMALL: fprintf(stderr, "'%s' is too small to generate a fingerprint\n", input); return 1;
-            case UNSUPPORTED_WAVE_FORMAT:
-            case NOT_A_WAVE_FILE: {
-                // Not a wave file ? Let's try to convert it to a wave file
-                // with ffmpeg
-                char* generated_wav = generate_wave_file(input, &artist, &track_title, &album_title);
-                if (generated_wav == NULL) {
-                    fprintf(stderr, "'%s' is not a wave file and we could not convert it to one with fffmpeg\n", input);
-                    return 1;
-                }
-                res = generate_fingerprint(generated_wav, &fingerprint, NULL, NULL, NULL);
-                remove(generated_wav);
-                free(generated_wav);
-                switch (res) {
-                case MEMORY_ERROR: fprintf(stderr, "Memory allocation error\n"); return 1;
-                case FILE_TOO_SMALL: fprintf(stderr, "'%s' is too small to generate a fingerprint\n", input); return 1;
-                }
-                break;
-            }
-        }
+    if (SUCCESS != fingerprint_file(input, &fingerprint, &artist, &track_title, &album_title, NULL)) {
+        return 1;
     }
 
     int ret_value = 0;
 
     if (!strcmp(argv[1], "index")) {
+        if (bucket_layout_given) {
+            unsigned int n_buckets;
+            unsigned int bytes_per_bucket;
+            get_bucket_layout(&n_buckets, &bytes_per_bucket);
+            save_bucket_layout(stdout, n_buckets, bytes_per_bucket);
+        }
         save(stdout, fingerprint, input, artist, track_title, album_title);
+        fprintf(stderr, "(peak RSS %ld KB)\n", get_peak_rss_in_kb());
     } else {
         const char* index = argv[3];
         struct index* database_index;
-        printf("Loading database %s...\n", index);
-        long before_loading_db = time_in_milliseconds();
-        int res = read_index(index, &database_index);
-        if (res != SUCCESS) {
-            switch (res) {
-                case CANNOT_READ_FILE: fprintf(stderr, "Cannot read file '%s'\n", index); return 1;
-                case MEMORY_ERROR: fprintf(stderr, "Memory allocation error\n"); return 1;
-            }
+        struct lsh* lsh;
+        if (SUCCESS != load_database(index, &database_index, &lsh, stdout)) {
+            return 1;
         }
-        long after_loading_db = time_in_milliseconds();
-        printf("(raw database loading took %ld ms)\n", after_loading_db - before_loading_db);
-
-        struct lsh* lsh = create_hash_tables(database_index);
-        long after_lsh = time_in_milliseconds();
-        printf("(lsh index building took %ld ms)\n", after_lsh - after_loading_db);
 
         printf("Searching...\n");
 
-        int best_match = search(fingerprint, database_index, lsh, 0);
+        long before_search = time_in_milliseconds();
+        struct search_result results[MAX_RESULTS];
+        int n_results = search_top_matches(fingerprint, database_index, lsh, results, MAX_RESULTS, explain);
         long after_search = time_in_milliseconds();
-        printf("(Search took %ld ms)\n", after_search - after_lsh);
+        printf("(Search took %ld ms)\n", after_search - before_search);
+        if (n_results == MEMORY_ERROR) {
+            fprintf(stderr, "Memory allocation error\n");
+            return 1;
+        }
 
-        if (best_match == NO_MATCH_FOUND) {
+        // When the best candidate is not a match, it is listed with the others
+        int first_candidate = 0;
+        if (n_results == 0 || !results[0].is_match) {
             printf("\nNo match found\n\n");
             ret_value  = 1;
         } else {
+            first_candidate = 1;
+            int best_match = results[0].entry_index;
             printf("\nFound match: '%s'\n", database_index->entries[best_match]->filename);
             if (database_index->entries[best_match]->artist[0]) {
                 printf("Artist: %s\n", database_index->entries[best_match]->artist);
@@ -125,6 +665,17 @@ int main(int argc, char* argv[]) {
             if (database_index->entries[best_match]->album_title[0]) {
                 printf("Album title: %s\n", database_index->entries[best_match]->album_title);
             }
+            printf("Score: %.1f with %d matching signatures, sample starting at %.1f s\n",
+                    results[0].average_score, results[0].n_matches, results[0].offset_in_seconds);
+            printf("\n");
+        }
+
+        if (n_results > first_candidate) {
+            printf(first_candidate == 0 ? "Candidates:\n" : "Other candidates:\n");
+            for (int i = first_candidate ; i < n_results ; i++) {
+                printf("  %.1f with %d matching signatures at %.1f s: '%s'\n", results[i].average_score, results[i].n_matches,
+                        results[i].offset_in_seconds, database_index->entries[results[i].entry_index]->filename);
+            }
             printf("\n");
         }
 
@@ -134,3 +685,85 @@ int main(int argc, char* argv[]) {
 
     return ret_value;
 }
+
+
+int main(int argc, char* argv[]) {
+    int profile = 0;
+    const char* trace = NULL;
+    while (argc >= 2 && (!strcmp(argv[1], "--threads") || !strcmp(argv[1], "--max-memory") || !strcmp(argv[1], "--max-list-length")
+                            || !strcmp(argv[1], "--probes") || !strcmp(argv[1], "--buckets") || !strcmp(argv[1], "--profile") || !strcmp(argv[1], "--trace"))) {
+        if (!strcmp(argv[1], "--profile")) {
+            profile = 1;
+            argv[1] = argv[0];
+            argv++;
+            argc--;
+            continue;
+        }
+        if (argc < 3) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (!strcmp(argv[1], "--threads")) {
+            int n_threads = atoi(argv[2]);
+            if (n_threads <= 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            set_thread_pool_size(n_threads);
+        } else if (!strcmp(argv[1], "--max-memory")) {
+            size_t max_memory = parse_memory_size(argv[2]);
+            if (max_memory == 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            set_max_memory(max_memory);
+        } else if (!strcmp(argv[1], "--max-list-length")) {
+            char* end;
+            long max_length = strtol(argv[2], &end, 10);
+            if (end == argv[2] || *end != '\0' || max_length < 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            set_max_list_length((unsigned int)max_length);
+        } else if (!strcmp(argv[1], "--probes")) {
+            char* end;
+            long n_probes = strtol(argv[2], &end, 10);
+            if (end == argv[2] || *end != '\0' || n_probes < 0 || n_probes > MAX_PROBES_PER_BUCKET) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            set_probes_per_bucket((unsigned int)n_probes);
+        } else if (!strcmp(argv[1], "--buckets")) {
+            unsigned int n_buckets;
+            unsigned int bytes_per_bucket;
+            char end;
+            if (2 != sscanf(argv[2], "%ux%u%c", &n_buckets, &bytes_per_bucket, &end)
+                || SUCCESS != set_bucket_layout(n_buckets, bytes_per_bucket)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            bucket_layout_given = 1;
+        } else {
+            trace = argv[2];
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
+    if ((profile || trace != NULL) && SUCCESS != enable_profiling(trace != NULL)) {
+        fprintf(stderr, "Memory allocation error\n");
+        return 1;
+    }
+
+    int ret_value = run_mode(argc, argv);
+
+    if (profile || trace != NULL) {
+        print_profile(stderr);
+    }
+    if (trace != NULL && SUCCESS != save_profile_trace(trace)) {
+        fprintf(stderr, "Cannot write file '%s'\n", trace);
+        return 1;
+    }
+    return ret_value;
+}
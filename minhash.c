@@ -3,14 +3,7 @@
 #include "permutations.h"
 
 
-/**
- * Given a fingerprint, calculates the corresponding signature.
- *
- * @param fp The raw fingerprint
- * @param signature The signature object to populate
- * @return 1 in case of success or 0 if the all the values of the signature are equal to 255
- */
-static int calculate_signature(struct rawfingerprint* fp, struct signature* signature) {
+int calculate_signature(struct rawfingerprint* fp, struct signature* signature) {
     int meaningful_signature = 0;
     for (unsigned int i = 0 ; i < SIGNATURE_LENGTH ; i++) {
         uint16_t* permutation = get_permutation(i);
@@ -46,6 +39,7 @@ struct signatures* build_signatures(struct rawfingerprints* rawfingerprints) {
     for (unsigned int i = 0 ; i < rawfingerprints->size ; i++) {
         if (!rawfingerprints->fingerprints[i].is_silence && calculate_signature(&(rawfingerprints->fingerprints[i]), &(signatures->signatures[signatures->n_signatures]))) {
             // Let's increase the counter if we have actually calculated a signature
+            signatures->signatures[signatures->n_signatures].position = i;
             (signatures->n_signatures)++;
         }
     }
@@ -17,6 +17,13 @@ struct signature {
     // 255 values, we have good probability to find a bit set to 1, so
     // this should not reduce much the precision of the results
     uint8_t minhash[SIGNATURE_LENGTH];
+
+    // The index of the spectral image this signature was computed from,
+    // i.e. its position in the audio input in steps of
+    // DISTANCE_BETWEEN_SPECTRAL_IMAGE_START * INTERVAL_BETWEEN_FRAMES samples.
+    // Since the signatures of silent or degenerate images are skipped, this
+    // is not always the same as the index of the signature in its array
+    unsigned int position;
 };
 
 
@@ -88,6 +95,16 @@ struct signatures {
 struct signatures* build_signatures(struct rawfingerprints* rawfingerprints);
 
 
+/**
+ * Given a fingerprint, calculates the corresponding signature.
+ *
+ * @param fp The raw fingerprint
+ * @param signature The signature object to populate
+ * @return 1 in case of success or 0 if the all the values of the signature are equal to 255
+ */
+int calculate_signature(struct rawfingerprint* fp, struct signature* signature);
+
+
 /**
  * Frees all the memory associated to the given signatures.
  */
@@ -0,0 +1,361 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "monitor.h"
+#include "search.h"
+#include "stream.h"
+#include "toolutils.h"
+
+// The maximum number of PCM bytes a worker processes for a stream
+// before giving the others a chance (about 93ms of audio)
+#define MONITOR_CHUNK_SIZE (4096 * 4)
+
+// The duration of the audio window in which we look for matches
+#define MONITOR_WINDOW_IN_SECONDS 10.0
+
+struct monitored_stream {
+    const char* name;
+    int fd;
+
+    struct stream_fingerprinter* fingerprinter;
+    struct stream_search* search;
+    int last_match;
+
+    // 1 while the stream is queued or processed by a worker, so
+    // that a stream is never processed by two workers at once
+    int busy;
+
+    // 1 when the input has been read entirely
+    int eof;
+    int error;
+
+    // Statistics
+    unsigned long n_bytes;
+    unsigned long n_signatures;
+    unsigned int n_detections;
+    double cpu_ms;
+
+    struct monitored_stream* next;
+};
+
+
+struct monitor {
+    struct index* database;
+
+    struct monitored_stream* streams;
+    unsigned int n_streams;
+
+    // The queue of streams that have data waiting for a worker
+    struct monitored_stream* first_stream;
+    struct monitored_stream* last_stream;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t stream_available;
+
+    // A pipe used by the workers to wake up the
+    // dispatcher when they are done with a stream
+    int wake_up[2];
+};
+
+
+static double thread_cpu_time_in_milliseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+
+static void print_detection(struct monitor* monitor, struct monitored_stream* stream, struct search_result* result) {
+    char now[16];
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(now, sizeof(now), "%H:%M:%S", &tm);
+
+    // A single printf call per line, so that the lines of
+    // different streams are not mixed up
+    printf("%s\t%s\t%.1f\t%s\t%.1f\n", now, stream->name, stream->n_bytes / (44100.0 * 4),
+           monitor->database->entries[result->entry_index]->filename, result->average_score);
+    fflush(stdout);
+}
+
+
+/**
+ * Fingerprints the given new PCM data of the given stream and
+ * looks for matches in the last MONITOR_WINDOW_IN_SECONDS seconds.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int process_pcm_data(struct monitor* monitor, struct monitored_stream* stream, uint8_t* pcm, unsigned int size) {
+    stream->n_bytes += size;
+    struct signatures* new_signatures;
+    int res = add_pcm_data(stream->fingerprinter, pcm, size, &new_signatures);
+    if (res <= 0) {
+        return res;
+    }
+    stream->n_signatures += new_signatures->n_signatures;
+
+    struct search_result result;
+    if (MEMORY_ERROR == add_stream_signatures(stream->search, new_signatures)
+        || MEMORY_ERROR == (res = get_stream_matches(stream->search, &result, 1, 0))) {
+        return MEMORY_ERROR;
+    }
+    if (res == 1 && result.is_match) {
+        if (result.entry_index != stream->last_match) {
+            stream->last_match = result.entry_index;
+            (stream->n_detections)++;
+            print_detection(monitor, stream, &result);
+        }
+
+        // Like in listen mode, we start from scratch after each match so that
+        // a track that has just been identified does not hide the next one
+        reset_stream_search(stream->search);
+    }
+    return SUCCESS;
+}
+
+
+static void* launch_worker(struct monitor* monitor) {
+    uint8_t buffer[MONITOR_CHUNK_SIZE];
+    while (1) {
+        pthread_mutex_lock(&(monitor->lock));
+        while (monitor->first_stream == NULL && !monitor->done) {
+            pthread_cond_wait(&(monitor->stream_available), &(monitor->lock));
+        }
+        if (monitor->first_stream == NULL) {
+            pthread_mutex_unlock(&(monitor->lock));
+            return NULL;
+        }
+        struct monitored_stream* stream = monitor->first_stream;
+        monitor->first_stream = stream->next;
+        if (monitor->first_stream == NULL) {
+            monitor->last_stream = NULL;
+        }
+        pthread_mutex_unlock(&(monitor->lock));
+
+        // The dispatcher only queues streams that have data available,
+        // so this read will not block. Since nobody else can touch the
+        // stream while it is busy, we don't need the lock to process it
+        double before = thread_cpu_time_in_milliseconds();
+        ssize_t n = read(stream->fd, buffer, MONITOR_CHUNK_SIZE);
+        int eof = 0;
+        if (n < 0 && errno != EINTR && errno != EAGAIN) {
+            stream->error = CANNOT_READ_FILE;
+            eof = 1;
+        } else if (n == 0) {
+            eof = 1;
+        } else if (n > 0 && SUCCESS != process_pcm_data(monitor, stream, buffer, n)) {
+            stream->error = MEMORY_ERROR;
+            eof = 1;
+        }
+        stream->cpu_ms += thread_cpu_time_in_milliseconds() - before;
+
+        pthread_mutex_lock(&(monitor->lock));
+        stream->eof = eof;
+        stream->busy = 0;
+        pthread_mutex_unlock(&(monitor->lock));
+
+        char c = 0;
+        while (write(monitor->wake_up[1], &c, 1) < 0 && errno == EINTR);
+    }
+}
+
+
+/**
+ * Waits for data on all the inputs that are not being processed
+ * and queues the streams that have some, until all the inputs have
+ * been read entirely.
+ */
+static int dispatch(struct monitor* monitor) {
+    struct pollfd* fds = (struct pollfd*)malloc((monitor->n_streams + 1) * sizeof(struct pollfd));
+    unsigned int* stream_index = (unsigned int*)malloc((monitor->n_streams + 1) * sizeof(unsigned int));
+    if (fds == NULL || stream_index == NULL) {
+        free(fds);
+        free(stream_index);
+        return MEMORY_ERROR;
+    }
+
+    while (1) {
+        unsigned int n_fds = 0;
+        unsigned int n_active = 0;
+        fds[n_fds].fd = monitor->wake_up[0];
+        fds[n_fds++].events = POLLIN;
+
+        pthread_mutex_lock(&(monitor->lock));
+        for (unsigned int i = 0 ; i < monitor->n_streams ; i++) {
+            struct monitored_stream* stream = &(monitor->streams[i]);
+            if (stream->eof) {
+                continue;
+            }
+            n_active++;
+            if (!stream->busy) {
+                fds[n_fds].fd = stream->fd;
+                fds[n_fds].events = POLLIN;
+                stream_index[n_fds++] = i;
+            }
+        }
+        pthread_mutex_unlock(&(monitor->lock));
+
+        if (n_active == 0) {
+            break;
+        }
+
+        if (poll(fds, n_fds, -1) < 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            char buffer[64];
+            read(monitor->wake_up[0], buffer, sizeof(buffer));
+        }
+
+        pthread_mutex_lock(&(monitor->lock));
+        for (unsigned int k = 1 ; k < n_fds ; k++) {
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            // An input that has been closed can still have data to read, so
+            // we let the worker find out whether it has reached the end
+            struct monitored_stream* stream = &(monitor->streams[stream_index[k]]);
+            stream->busy = 1;
+            stream->next = NULL;
+            if (monitor->last_stream == NULL) {
+                monitor->first_stream = stream;
+            } else {
+                monitor->last_stream->next = stream;
+            }
+            monitor->last_stream = stream;
+            pthread_cond_signal(&(monitor->stream_available));
+        }
+        pthread_mutex_unlock(&(monitor->lock));
+    }
+
+    free(fds);
+    free(stream_index);
+    return SUCCESS;
+}
+
+
+static void print_summary(struct monitor* monitor, double wall_ms) {
+    double total_cpu_ms = 0;
+    double total_audio = 0;
+    fprintf(stderr, "\ninput\taudio_s\tsignatures\tdetections\tcpu_ms\tcpu_ms_per_audio_s\n");
+    for (unsigned int i = 0 ; i < monitor->n_streams ; i++) {
+        struct monitored_stream* stream = &(monitor->streams[i]);
+        double audio = stream->n_bytes / (44100.0 * 4);
+        fprintf(stderr, "%s\t%.1f\t%lu\t%u\t%.1f\t%.2f%s\n", stream->name, audio, stream->n_signatures,
+                stream->n_detections, stream->cpu_ms, audio > 0 ? stream->cpu_ms / audio : 0,
+                stream->error == CANNOT_READ_FILE ? "\t(read error)" : (stream->error == MEMORY_ERROR ? "\t(memory error)" : ""));
+        total_cpu_ms += stream->cpu_ms;
+        total_audio += audio;
+    }
+    fprintf(stderr, "%u streams, %.1f s of audio, %.1f ms of CPU, %.1f ms of wall clock time\n",
+            monitor->n_streams, total_audio, total_cpu_ms, wall_ms);
+}
+
+
+/**
+ * Closes the first n streams of the given monitor, which may
+ * have been only partially opened, and frees the monitor.
+ */
+static void free_monitor(struct monitor* monitor, unsigned int n, pthread_t* thread) {
+    for (unsigned int i = 0 ; i < n ; i++) {
+        struct monitored_stream* stream = &(monitor->streams[i]);
+        if (stream->fd >= 0) {
+            close(stream->fd);
+        }
+        if (stream->fingerprinter != NULL) {
+            free_stream_fingerprinter(stream->fingerprinter);
+        }
+        if (stream->search != NULL) {
+            free_stream_search(stream->search);
+        }
+    }
+    close(monitor->wake_up[0]);
+    close(monitor->wake_up[1]);
+    free(monitor->streams);
+    free(thread);
+}
+
+
+int monitor(char** inputs, unsigned int n_inputs, struct index* database, struct lsh* lsh, unsigned int n_workers) {
+    struct monitor monitor;
+    memset(&monitor, 0, sizeof(monitor));
+    monitor.database = database;
+    monitor.n_streams = n_inputs;
+    monitor.streams = (struct monitored_stream*)calloc(n_inputs, sizeof(struct monitored_stream));
+    pthread_t* thread = (pthread_t*)malloc(n_workers * sizeof(pthread_t));
+    if (monitor.streams == NULL || thread == NULL) {
+        free(monitor.streams);
+        free(thread);
+        return MEMORY_ERROR;
+    }
+    if (pipe(monitor.wake_up) < 0) {
+        free(monitor.streams);
+        free(thread);
+        return MEMORY_ERROR;
+    }
+
+    for (unsigned int i = 0 ; i < n_inputs ; i++) {
+        struct monitored_stream* stream = &(monitor.streams[i]);
+        stream->name = inputs[i];
+        stream->last_match = NO_MATCH_FOUND;
+        // Opening a FIFO blocks until a writer opens it, which is what we want
+        stream->fd = open(inputs[i], O_RDONLY);
+        if (stream->fd < 0) {
+            fprintf(stderr, "Cannot read file '%s'\n", inputs[i]);
+            free_monitor(&monitor, i + 1, thread);
+            return CANNOT_READ_FILE;
+        }
+        stream->fingerprinter = new_stream_fingerprinter();
+        stream->search = new_stream_search(database, lsh, MONITOR_WINDOW_IN_SECONDS);
+        if (stream->fingerprinter == NULL || stream->search == NULL) {
+            free_monitor(&monitor, i + 1, thread);
+            return MEMORY_ERROR;
+        }
+    }
+
+    pthread_mutex_init(&(monitor.lock), NULL);
+    pthread_cond_init(&(monitor.stream_available), NULL);
+    double before = time_in_milliseconds();
+    unsigned int n_started = 0;
+    while (n_started < n_workers
+            && 0 == pthread_create(&(thread[n_started]), NULL, (void* (*)(void*))launch_worker, &monitor)) {
+        n_started++;
+    }
+    if (n_started == 0) {
+        pthread_cond_destroy(&(monitor.stream_available));
+        pthread_mutex_destroy(&(monitor.lock));
+        free_monitor(&monitor, n_inputs, thread);
+        return MEMORY_ERROR;
+    }
+    // If some workers could not be started, the others handle all the streams
+    n_workers = n_started;
+
+    int res = dispatch(&monitor);
+
+    pthread_mutex_lock(&(monitor.lock));
+    monitor.done = 1;
+    pthread_cond_broadcast(&(monitor.stream_available));
+    pthread_mutex_unlock(&(monitor.lock));
+    for (unsigned int k = 0 ; k < n_workers ; k++) {
+        pthread_join(thread[k], NULL);
+    }
+    print_summary(&monitor, time_in_milliseconds() - before);
+
+    for (unsigned int i = 0 ; i < n_inputs ; i++) {
+        if (res == SUCCESS && monitor.streams[i].error == MEMORY_ERROR) {
+            res = MEMORY_ERROR;
+        }
+    }
+    pthread_cond_destroy(&(monitor.stream_available));
+    pthread_mutex_destroy(&(monitor.lock));
+    free_monitor(&monitor, n_inputs, thread);
+    return res;
+}
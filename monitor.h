@@ -0,0 +1,32 @@
+#ifndef _MONITOR_H
+#define _MONITOR_H
+
+#include "fingerprintio.h"
+#include "lsh.h"
+
+/**
+ * Monitors several audio streams at once, like radio feeds, and reports the
+ * database entries identified in each of them. Each input is a file or a FIFO
+ * providing raw 44100Hz 16-bit stereo PCM data. All the streams share the same
+ * database and hash tables, and their audio is fingerprinted incrementally and
+ * searched by a fixed pool of worker threads, so that the number of streams
+ * does not change the number of threads competing for the CPU.
+ *
+ * Each detection is printed on stdout as a tab-separated line with the wall
+ * clock time, the input name, the position in the stream in seconds, the
+ * matching entry name and the score. When all the inputs have been read
+ * entirely, a summary with the CPU time spent on each stream is printed
+ * on stderr.
+ *
+ * @param inputs The paths of the inputs to monitor
+ * @param n_inputs The number of inputs
+ * @param database The database to search into
+ * @param lsh The hash tables to use for efficiency
+ * @param n_workers The number of worker threads
+ * @return SUCCESS on success
+ *         CANNOT_READ_FILE if an input cannot be opened
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int monitor(char** inputs, unsigned int n_inputs, struct index* database, struct lsh* lsh, unsigned int n_workers);
+
+#endif
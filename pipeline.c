@@ -0,0 +1,291 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fft.h"
+#include "haar.h"
+#include "hannwindow.h"
+#include "pipeline.h"
+#include "profiler.h"
+#include "threadpool.h"
+
+// The number of frames processed by a frame task. Since a new spectral
+// image starts every 8 frames, each chunk can make 4 new images ready
+#define FRAMES_PER_CHUNK 32
+
+
+struct pipeline_worker {
+    // Scratch memory
+    float frame[SAMPLES_PER_FRAME];
+    float real[SAMPLES_PER_FRAME];
+    float imaginary[SAMPLES_PER_FRAME];
+    struct spectral_image image;
+    struct rawfingerprint rawfingerprint;
+
+    double stage_ms[N_PIPELINE_STAGES];
+    unsigned int n_tasks[N_PIPELINE_STAGES];
+    double idle_ms;
+};
+
+
+struct pipeline {
+    float* samples;
+    float* hann_window;
+    unsigned int n_frames;
+    unsigned int n_images;
+    unsigned int n_chunks;
+
+    // The bins of all the frames, like in build_spectral_images()
+    float* bins;
+
+    // The signature of image #i goes into signatures[i]
+    // and has_signature[i] tells whether there is one
+    struct signature* signatures;
+    uint8_t* has_signature;
+
+    struct pipeline_worker* workers;
+
+    // The scheduling state, protected by the lock
+    pthread_mutex_t lock;
+    pthread_cond_t frames_ready;
+    unsigned int next_chunk;
+    unsigned int next_image;
+    // chunk_done[c] is 1 when chunk #c is done, and all the
+    // chunks before first_pending_chunk are done
+    uint8_t* chunk_done;
+    unsigned int first_pending_chunk;
+    int return_code;
+};
+
+
+static double now_in_milliseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+
+static int process_frames(struct pipeline* p, struct pipeline_worker* w, unsigned int chunk) {
+    unsigned int first = chunk * FRAMES_PER_CHUNK;
+    unsigned int end = first + FRAMES_PER_CHUNK < p->n_frames ? first + FRAMES_PER_CHUNK : p->n_frames;
+    struct profile_span span;
+    begin_span(&span, PROFILE_FFT);
+    for (unsigned int i = first ; i < end ; i++) {
+        for (unsigned int j = 0 ; j < SAMPLES_PER_FRAME ; j++) {
+            w->frame[j] = p->samples[i * INTERVAL_BETWEEN_FRAMES + j] * p->hann_window[j];
+        }
+        if (SUCCESS != fft(w->frame, w->real, w->imaginary)) {
+            end_span(&span, i - first);
+            return MEMORY_ERROR;
+        }
+        calculate_bins(w->real, w->imaginary, &(p->bins[i * NUMBER_OF_BINS]));
+    }
+    end_span(&span, end - first);
+    return SUCCESS;
+}
+
+
+/**
+ * Takes spectral image #i through all the stages after the frames.
+ */
+static void process_image(struct pipeline* p, struct pipeline_worker* w, unsigned int i) {
+    struct profile_span span;
+    begin_span(&span, PROFILE_IMAGES);
+    double t0 = now_in_milliseconds();
+    memcpy(w->image.image, &(p->bins[i * DISTANCE_BETWEEN_SPECTRAL_IMAGE_START * NUMBER_OF_BINS]),
+           SPECTRAL_IMAGE_WIDTH * NUMBER_OF_BINS * sizeof(float));
+    scale_to_full_spectrum(w->image.image);
+    double t1 = now_in_milliseconds();
+    end_span(&span, 1);
+    begin_span(&span, PROFILE_HAAR);
+    transform_image(&(w->image));
+    double t2 = now_in_milliseconds();
+    end_span(&span, 1);
+    begin_span(&span, PROFILE_TOP_WAVELETS);
+    memset(&(w->rawfingerprint), 0, sizeof(struct rawfingerprint));
+    build_raw_fingerprint(&(w->image), &(w->rawfingerprint));
+    double t3 = now_in_milliseconds();
+    end_span(&span, 1);
+    begin_span(&span, PROFILE_MINHASH);
+    p->has_signature[i] = !w->rawfingerprint.is_silence
+                            && calculate_signature(&(w->rawfingerprint), &(p->signatures[i]));
+    double t4 = now_in_milliseconds();
+    end_span(&span, 1);
+
+    w->stage_ms[STAGE_IMAGES] += t1 - t0;
+    w->stage_ms[STAGE_HAAR] += t2 - t1;
+    w->stage_ms[STAGE_RAW_FINGERPRINTS] += t3 - t2;
+    w->stage_ms[STAGE_SIGNATURES] += t4 - t3;
+    for (unsigned int s = STAGE_IMAGES ; s <= STAGE_SIGNATURES ; s++) {
+        (w->n_tasks[s])++;
+    }
+}
+
+
+/**
+ * Returns 1 if all the frames needed by the given image have been processed.
+ * The lock must be held when calling this function.
+ */
+static int is_image_ready(struct pipeline* p, unsigned int i) {
+    unsigned long frames_ready = (unsigned long)p->first_pending_chunk * FRAMES_PER_CHUNK;
+    return i * DISTANCE_BETWEEN_SPECTRAL_IMAGE_START + SPECTRAL_IMAGE_WIDTH <= frames_ready
+        || p->first_pending_chunk == p->n_chunks;
+}
+
+
+static int run_pipeline_workers(struct pipeline* p, unsigned int first_worker, unsigned int end) {
+    for (unsigned int k = first_worker ; k < end ; k++) {
+        struct pipeline_worker* w = &(p->workers[k]);
+        pthread_mutex_lock(&(p->lock));
+        while (1) {
+            // Downstream tasks come first, so that the images
+            // never lag too much behind the frames
+            if (p->next_image < p->n_images && is_image_ready(p, p->next_image)) {
+                unsigned int i = (p->next_image)++;
+                pthread_mutex_unlock(&(p->lock));
+                process_image(p, w, i);
+                pthread_mutex_lock(&(p->lock));
+                continue;
+            }
+
+            if (p->next_chunk < p->n_chunks) {
+                unsigned int chunk = (p->next_chunk)++;
+                pthread_mutex_unlock(&(p->lock));
+                double before = now_in_milliseconds();
+                int res = process_frames(p, w, chunk);
+                w->stage_ms[STAGE_FRAMES] += now_in_milliseconds() - before;
+                (w->n_tasks[STAGE_FRAMES])++;
+                pthread_mutex_lock(&(p->lock));
+                if (res != SUCCESS) {
+                    p->return_code = res;
+                }
+                p->chunk_done[chunk] = 1;
+                if (chunk == p->first_pending_chunk) {
+                    while (p->first_pending_chunk < p->n_chunks && p->chunk_done[p->first_pending_chunk]) {
+                        (p->first_pending_chunk)++;
+                    }
+                    pthread_cond_broadcast(&(p->frames_ready));
+                }
+                continue;
+            }
+
+            if (p->next_image == p->n_images) {
+                break;
+            }
+
+            // The next image needs frames that other threads are processing
+            double before = now_in_milliseconds();
+            pthread_cond_wait(&(p->frames_ready), &(p->lock));
+            w->idle_ms += now_in_milliseconds() - before;
+        }
+        pthread_mutex_unlock(&(p->lock));
+    }
+    return SUCCESS;
+}
+
+
+int build_fingerprint(float* samples, unsigned int n_samples, struct signatures* *fingerprint,
+                      struct pipeline_stats* stats, struct arena* arena) {
+    if (n_samples < SAMPLES_PER_FRAME) {
+        return FILE_TOO_SMALL;
+    }
+    unsigned int n_frames = 1 + ((n_samples - SAMPLES_PER_FRAME) / INTERVAL_BETWEEN_FRAMES);
+    if (n_frames < SPECTRAL_IMAGE_WIDTH) {
+        return FILE_TOO_SMALL;
+    }
+
+    struct pipeline p;
+    memset(&p, 0, sizeof(p));
+    p.samples = samples;
+    p.hann_window = get_Hann_window();
+    p.n_frames = n_frames;
+    p.n_images = 1 + ((n_frames - SPECTRAL_IMAGE_WIDTH) / DISTANCE_BETWEEN_SPECTRAL_IMAGE_START);
+    p.n_chunks = (n_frames + FRAMES_PER_CHUNK - 1) / FRAMES_PER_CHUNK;
+    p.return_code = SUCCESS;
+
+    // There is no point in having more threads than chunks of frames
+    unsigned int n_workers = get_thread_pool_size();
+    if (n_workers > p.n_chunks) {
+        n_workers = p.n_chunks;
+    }
+
+    struct signatures* signatures = (struct signatures*)malloc(sizeof(struct signatures));
+    p.signatures = (struct signature*)malloc(p.n_images * sizeof(struct signature));
+    p.bins = (float*)arena_alloc(arena, n_frames * NUMBER_OF_BINS * sizeof(float));
+    p.has_signature = (uint8_t*)arena_alloc(arena, p.n_images * sizeof(uint8_t));
+    p.chunk_done = (uint8_t*)arena_alloc(arena, p.n_chunks * sizeof(uint8_t));
+    p.workers = (struct pipeline_worker*)arena_alloc(arena, n_workers * sizeof(struct pipeline_worker));
+    if (signatures == NULL || p.bins == NULL || p.signatures == NULL || p.has_signature == NULL
+        || p.chunk_done == NULL || p.workers == NULL) {
+        free(signatures);
+        free(p.signatures);
+        arena_free(arena, p.bins);
+        arena_free(arena, p.has_signature);
+        arena_free(arena, p.chunk_done);
+        arena_free(arena, p.workers);
+        return MEMORY_ERROR;
+    }
+    count_profile_bytes(PROFILE_FFT, n_frames * NUMBER_OF_BINS * sizeof(float));
+    count_profile_bytes(PROFILE_MINHASH, p.n_images * sizeof(struct signature));
+    memset(p.chunk_done, 0, p.n_chunks * sizeof(uint8_t));
+    memset(p.workers, 0, n_workers * sizeof(struct pipeline_worker));
+
+    pthread_mutex_init(&(p.lock), NULL);
+    pthread_cond_init(&(p.frames_ready), NULL);
+    double before = now_in_milliseconds();
+    parallel_for(n_workers, 1, (parallel_function)run_pipeline_workers, &p);
+    double wall_ms = now_in_milliseconds() - before;
+    pthread_cond_destroy(&(p.frames_ready));
+    pthread_mutex_destroy(&(p.lock));
+
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(struct pipeline_stats));
+        stats->n_workers = n_workers;
+        stats->wall_ms = wall_ms;
+        for (unsigned int k = 0 ; k < n_workers ; k++) {
+            for (unsigned int s = 0 ; s < N_PIPELINE_STAGES ; s++) {
+                stats->stage_ms[s] += p.workers[k].stage_ms[s];
+                stats->n_tasks[s] += p.workers[k].n_tasks[s];
+            }
+            stats->idle_ms += p.workers[k].idle_ms;
+        }
+    }
+
+    // Now let's keep the signatures of the images that have one, in order,
+    // exactly like build_signatures() does
+    signatures->signatures = p.signatures;
+    signatures->n_signatures = 0;
+    for (unsigned int i = 0 ; i < p.n_images ; i++) {
+        if (p.has_signature[i]) {
+            signatures->signatures[signatures->n_signatures] = p.signatures[i];
+            signatures->signatures[signatures->n_signatures].position = i;
+            (signatures->n_signatures)++;
+        }
+    }
+
+    arena_free(arena, p.bins);
+    arena_free(arena, p.has_signature);
+    arena_free(arena, p.chunk_done);
+    arena_free(arena, p.workers);
+    if (p.return_code != SUCCESS) {
+        free_signatures(signatures);
+        return p.return_code;
+    }
+    *fingerprint = signatures;
+    return SUCCESS;
+}
+
+
+void print_pipeline_stats(FILE* f, struct pipeline_stats* stats) {
+    static const char* names[N_PIPELINE_STAGES] = { "frames", "images", "haar", "raw fingerprints", "signatures" };
+    double available_ms = stats->wall_ms * stats->n_workers;
+    if (available_ms <= 0) {
+        available_ms = 1;
+    }
+    fprintf(f, "Pipeline: %.1f ms with %u threads\n", stats->wall_ms, stats->n_workers);
+    for (unsigned int s = 0 ; s < N_PIPELINE_STAGES ; s++) {
+        fprintf(f, "  %-16s %6u tasks %9.1f ms %5.1f%%\n", names[s], stats->n_tasks[s],
+                stats->stage_ms[s], 100.0 * stats->stage_ms[s] / available_ms);
+    }
+    fprintf(f, "  %-16s %6s       %9.1f ms %5.1f%%\n", "waiting", "", stats->idle_ms, 100.0 * stats->idle_ms / available_ms);
+}
@@ -0,0 +1,76 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include <stdio.h>
+#include "arena.h"
+#include "minhash.h"
+
+// The stages of the fingerprinting pipeline
+#define STAGE_FRAMES 0
+#define STAGE_IMAGES 1
+#define STAGE_HAAR 2
+#define STAGE_RAW_FINGERPRINTS 3
+#define STAGE_SIGNATURES 4
+#define N_PIPELINE_STAGES 5
+
+
+/**
+ * This describes how the threads spent their time while
+ * building a fingerprint with build_fingerprint().
+ */
+struct pipeline_stats {
+    // The number of threads that worked on the fingerprint
+    unsigned int n_workers;
+
+    // The time between the start and the end of the pipeline
+    double wall_ms;
+
+    // The time spent by all the threads in each stage, and the
+    // number of tasks of each stage. The frames are processed by
+    // chunks, while there is one task per spectral image for the
+    // other stages
+    double stage_ms[N_PIPELINE_STAGES];
+    unsigned int n_tasks[N_PIPELINE_STAGES];
+
+    // The time spent by threads waiting for frames to be ready
+    double idle_ms;
+};
+
+
+/**
+ * Calculates the fingerprint of the given 5512Hz normalized samples, like
+ * build_spectral_images(), apply_Haar_transform(), build_raw_fingerprints()
+ * and build_signatures() would do one after the other, but without waiting
+ * for a stage to be complete before starting the next one.
+ *
+ * Spectral image #i only needs the bins of the frames 8i to 8i+127, so it can
+ * be processed as soon as these frames are ready, while other threads are still
+ * working on the next frames. The threads of the pool take the next image that
+ * is ready, or the next chunk of frames if there is none, so that no thread has
+ * to wait for the slowest thread of a stage before moving on to the next stage.
+ * Each image goes through all the remaining stages in one go, so that it never
+ * has to leave the cache of the thread that works on it, and so that there
+ * is no need to keep all the spectral images in memory at the same time.
+ *
+ * @param samples The samples
+ * @param n_samples The number of samples
+ * @param fingerprint Where to store the signatures
+ * @param stats If not NULL, where to store the utilization of the stages
+ * @param arena If not NULL, the arena to allocate the intermediate buffers from.
+ *              The signatures are always allocated with malloc(), since they
+ *              are meant to outlive the arena
+ * @return SUCCESS on success
+ *         FILE_TOO_SMALL if there are not enough samples to build a spectral image
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int build_fingerprint(float* samples, unsigned int n_samples, struct signatures* *fingerprint,
+                      struct pipeline_stats* stats, struct arena* arena);
+
+
+/**
+ * Prints the given stats as a table giving for each stage the number of tasks,
+ * the time spent and the percentage of the available thread time it represents.
+ */
+void print_pipeline_stats(FILE* f, struct pipeline_stats* stats);
+
+#endif
@@ -0,0 +1,230 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "profiler.h"
+
+// The maximum number of threads that get their own line in the trace.
+// The spans of any other thread go into the last line
+#define MAX_PROFILED_THREADS 512
+
+// Recording all the spans of a long run would take too much memory,
+// so we stop recording them after that many
+#define MAX_TRACE_EVENTS 4000000
+
+
+static const char* phase_names[N_PROFILE_PHASES] = {
+    "decode", "resample", "normalize", "fft", "images", "haar",
+    "top_wavelets", "minhash", "db_parse", "lsh_build", "search"
+};
+
+
+struct phase_totals {
+    unsigned long n_spans;
+    unsigned long n_items;
+    size_t bytes;
+
+    // The time during which at least one span of the phase was in progress
+    double wall_us;
+    // The time and the CPU time of all the spans
+    double thread_us;
+    double cpu_us;
+
+    // The number of spans in progress, and when the
+    // first one of them started
+    unsigned int n_active;
+    double active_since_us;
+};
+
+
+struct trace_event {
+    int phase;
+    unsigned int thread;
+    double start_us;
+    double duration_us;
+    unsigned long n_items;
+};
+
+
+static int enabled = 0;
+static int record_trace_events = 0;
+static double origin_us;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct phase_totals totals[N_PROFILE_PHASES];
+
+// The threads that have run spans so far. The position of
+// a thread in this array is its number in the trace
+static pthread_t threads[MAX_PROFILED_THREADS];
+static unsigned int n_threads = 0;
+
+static struct trace_event* events = NULL;
+static unsigned int n_events = 0;
+static unsigned int events_capacity = 0;
+static unsigned long n_dropped_events = 0;
+
+
+static double get_time_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+
+int enable_profiling(int record_trace) {
+    if (record_trace) {
+        events_capacity = 4096;
+        events = (struct trace_event*)malloc(events_capacity * sizeof(struct trace_event));
+        if (events == NULL) {
+            return MEMORY_ERROR;
+        }
+    }
+    record_trace_events = record_trace;
+    origin_us = get_time_us(CLOCK_MONOTONIC);
+    enabled = 1;
+    return SUCCESS;
+}
+
+
+int is_profiling_enabled() {
+    return enabled;
+}
+
+
+/**
+ * Returns the number of the calling thread. The lock
+ * must be held when calling this function.
+ */
+static unsigned int get_thread_number() {
+    pthread_t self = pthread_self();
+    for (unsigned int i = 0 ; i < n_threads ; i++) {
+        if (pthread_equal(threads[i], self)) {
+            return i;
+        }
+    }
+    if (n_threads == MAX_PROFILED_THREADS) {
+        return MAX_PROFILED_THREADS - 1;
+    }
+    threads[n_threads] = self;
+    return n_threads++;
+}
+
+
+/**
+ * Keeps the given span as a trace event. The lock
+ * must be held when calling this function.
+ */
+static void record_event(struct profile_span* span, double end_us, unsigned long n_items) {
+    if (n_events == events_capacity) {
+        unsigned int new_capacity = 2 * events_capacity;
+        struct trace_event* new_events = NULL;
+        if (new_capacity <= MAX_TRACE_EVENTS) {
+            new_events = (struct trace_event*)realloc(events, new_capacity * sizeof(struct trace_event));
+        }
+        if (new_events == NULL) {
+            n_dropped_events++;
+            return;
+        }
+        events = new_events;
+        events_capacity = new_capacity;
+    }
+    struct trace_event* e = &(events[n_events++]);
+    e->phase = span->phase;
+    e->thread = get_thread_number();
+    e->start_us = span->start_us;
+    e->duration_us = end_us - span->start_us;
+    e->n_items = n_items;
+}
+
+
+void begin_span(struct profile_span* span, int phase) {
+    if (!enabled) {
+        return;
+    }
+    span->phase = phase;
+    span->start_us = get_time_us(CLOCK_MONOTONIC) - origin_us;
+    pthread_mutex_lock(&lock);
+    if ((totals[phase].n_active)++ == 0) {
+        totals[phase].active_since_us = span->start_us;
+    }
+    pthread_mutex_unlock(&lock);
+    span->start_cpu_us = get_time_us(CLOCK_THREAD_CPUTIME_ID);
+}
+
+
+void end_span(struct profile_span* span, unsigned long n_items) {
+    if (!enabled) {
+        return;
+    }
+    double cpu_us = get_time_us(CLOCK_THREAD_CPUTIME_ID) - span->start_cpu_us;
+    double end_us = get_time_us(CLOCK_MONOTONIC) - origin_us;
+
+    pthread_mutex_lock(&lock);
+    struct phase_totals* t = &(totals[span->phase]);
+    (t->n_spans)++;
+    t->n_items += n_items;
+    t->thread_us += end_us - span->start_us;
+    t->cpu_us += cpu_us;
+    if (--(t->n_active) == 0) {
+        t->wall_us += end_us - t->active_since_us;
+    }
+    if (record_trace_events) {
+        record_event(span, end_us, n_items);
+    } else {
+        // Even without a trace, we want to know how many threads were used
+        get_thread_number();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+
+void count_profile_bytes(int phase, size_t bytes) {
+    if (!enabled) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    totals[phase].bytes += bytes;
+    pthread_mutex_unlock(&lock);
+}
+
+
+void print_profile(FILE* f) {
+    pthread_mutex_lock(&lock);
+    double wall_us = get_time_us(CLOCK_MONOTONIC) - origin_us;
+    fprintf(f, "{\"wall_ms\":%.3f,\"threads\":%u,\"phases\":{", wall_us / 1000.0, n_threads);
+    for (unsigned int i = 0 ; i < N_PROFILE_PHASES ; i++) {
+        struct phase_totals* t = &(totals[i]);
+        fprintf(f, "%s\n  \"%s\":{\"spans\":%lu,\"items\":%lu,\"bytes\":%zu,\"wall_ms\":%.3f,\"thread_ms\":%.3f,\"cpu_ms\":%.3f,\"items_per_s\":%.1f}",
+                i == 0 ? "" : ",", phase_names[i], t->n_spans, t->n_items, t->bytes, t->wall_us / 1000.0,
+                t->thread_us / 1000.0, t->cpu_us / 1000.0, t->wall_us > 0 ? t->n_items * 1000000.0 / t->wall_us : 0);
+    }
+    fprintf(f, "\n}}\n");
+    pthread_mutex_unlock(&lock);
+}
+
+
+int save_profile_trace(const char* filename) {
+    FILE* f = fopen(filename, "w");
+    if (f == NULL) {
+        return CANNOT_WRITE_FILE;
+    }
+
+    pthread_mutex_lock(&lock);
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%lu},\"traceEvents\":[\n", n_dropped_events);
+    // The thread names come first, and then the spans
+    for (unsigned int i = 0 ; i < n_threads ; i++) {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                i == 0 ? "" : ",\n", i, i);
+    }
+    for (unsigned int i = 0 ; i < n_events ; i++) {
+        struct trace_event* e = &(events[i]);
+        fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"mnemophonix\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"items\":%lu}}",
+                i + n_threads == 0 ? "" : ",\n", phase_names[e->phase], e->thread, e->start_us, e->duration_us, e->n_items);
+    }
+    fprintf(f, "\n]}\n");
+    pthread_mutex_unlock(&lock);
+
+    int res = ferror(f) ? CANNOT_WRITE_FILE : SUCCESS;
+    if (fclose(f) != 0) {
+        res = CANNOT_WRITE_FILE;
+    }
+    return res;
+}
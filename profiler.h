@@ -0,0 +1,93 @@
+#ifndef _PROFILER_H
+#define _PROFILER_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "errors.h"
+
+// The phases that can be profiled
+#define PROFILE_DECODE 0
+#define PROFILE_RESAMPLE 1
+#define PROFILE_NORMALIZE 2
+#define PROFILE_FFT 3
+#define PROFILE_IMAGES 4
+#define PROFILE_HAAR 5
+#define PROFILE_TOP_WAVELETS 6
+#define PROFILE_MINHASH 7
+#define PROFILE_DB_PARSE 8
+#define PROFILE_LSH_BUILD 9
+#define PROFILE_SEARCH 10
+#define N_PROFILE_PHASES 11
+
+
+/**
+ * A span is a piece of work done by one thread for one phase. When profiling
+ * is enabled, the time and CPU time of each span are added to the totals of
+ * its phase, and the span can be recorded as a trace event so that the work
+ * of all the threads can be visualized on a timeline.
+ *
+ * When profiling is disabled, which is the default, starting and ending a span
+ * costs nothing but a test, so that the spans can stay in the code all the time.
+ */
+struct profile_span {
+    int phase;
+    double start_us;
+    double start_cpu_us;
+};
+
+
+/**
+ * Enables profiling. This must be called before any work is done.
+ *
+ * @param record_trace If non zero, all the spans are kept so that they
+ *                     can be saved with save_profile_trace()
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int enable_profiling(int record_trace);
+
+
+/**
+ * Returns a non zero value if profiling is enabled.
+ */
+int is_profiling_enabled();
+
+
+/**
+ * Starts a span of the given phase on the calling thread.
+ */
+void begin_span(struct profile_span* span, int phase);
+
+
+/**
+ * Ends the given span, saying how many items were processed in it
+ * (samples, frames, images, signatures, depending on the phase).
+ */
+void end_span(struct profile_span* span, unsigned long n_items);
+
+
+/**
+ * Adds the given number of bytes to the memory allocated by the given phase.
+ */
+void count_profile_bytes(int phase, size_t bytes);
+
+
+/**
+ * Prints the totals of each phase as a JSON object: number of spans, items
+ * processed, bytes allocated, wall time during which at least one thread was
+ * working on the phase, time and CPU time summed over all the threads, and
+ * number of items processed per second of wall time.
+ */
+void print_profile(FILE* f);
+
+
+/**
+ * Saves all the recorded spans to the given file in the Chrome trace event format,
+ * that can be opened with chrome://tracing or https://ui.perfetto.dev
+ *
+ * @return SUCCESS on success
+ *         CANNOT_WRITE_FILE if the file cannot be written
+ */
+int save_profile_trace(const char* filename);
+
+#endif
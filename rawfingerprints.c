@@ -1,11 +1,12 @@
 #include <math.h>
-#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "rawfingerprints.h"
+#include "threadpool.h"
 
-
-#define N_THREADS 8
+// The minimum number of images that a thread
+// processes at once when working in parallel
+#define MIN_IMAGES_PER_CHUNK 4
 
 #define TOP_WAVELET_THRESHOLD 1.0
 
@@ -19,8 +20,6 @@
 struct build_rawfingerprints_job {
     struct spectral_image* images;
     struct rawfingerprint* fingerprints;
-    unsigned int first_image;
-    unsigned int last_image;
 };
 
 
@@ -74,29 +73,32 @@ static int convert_top_wavelets(struct coeff_and_index* sorted_data, struct rawf
 }
 
 
-static void* launch_build_rawfingerprints(struct build_rawfingerprints_job* job) {
-     unsigned int N = NUMBER_OF_BINS * SPECTRAL_IMAGE_WIDTH;
+void build_raw_fingerprint(struct spectral_image* image, struct rawfingerprint* fp) {
+    unsigned int N = NUMBER_OF_BINS * SPECTRAL_IMAGE_WIDTH;
     struct coeff_and_index temp[N];
 
-    for (unsigned int i = job->first_image ; i <= job->last_image ; i++) {
-        // For each spectral image, let's copy the coefficients
-        // and their positions into the temp array
-        for (unsigned int j = 0 ; j < N ; j++) {
-            temp[j].coeff = job->images[i].image[j];
-            temp[j].index = j;
-        }
+    // Let's copy the coefficients and their positions into the temp array
+    for (unsigned int j = 0 ; j < N ; j++) {
+        temp[j].coeff = image->image[j];
+        temp[j].index = j;
+    }
 
-        // Let's sort this array
-        qsort(temp, N, sizeof(struct coeff_and_index), (int (*)(const void *, const void *)) compare_by_absolute_values);
+    // Let's sort this array
+    qsort(temp, N, sizeof(struct coeff_and_index), (int (*)(const void *, const void *)) compare_by_absolute_values);
 
-        // Let's retain the 200 highest wavelet coefficients and convert them
-        // to 01, 10 or 00 whether they are negative, positive or null
-        int n = convert_top_wavelets(temp, &(job->fingerprints[i]));
+    // Let's retain the 200 highest wavelet coefficients and convert them
+    // to 01, 10 or 00 whether they are negative, positive or null
+    int n = convert_top_wavelets(temp, fp);
+
+    fp->is_silence = (n < MIN_WAVELETS);
+}
 
-        job->fingerprints[i].is_silence = (n < MIN_WAVELETS);
-    }
 
-    return NULL;
+static int launch_build_rawfingerprints(struct build_rawfingerprints_job* job, unsigned int first_image, unsigned int end) {
+    for (unsigned int i = first_image ; i < end ; i++) {
+        build_raw_fingerprint(&(job->images[i]), &(job->fingerprints[i]));
+    }
+    return SUCCESS;
 }
 
 
@@ -115,30 +117,10 @@ struct rawfingerprints* build_raw_fingerprints(struct spectral_images* haar_tran
         return NULL;
     }
 
-    unsigned int n_threads = N_THREADS;
-    if (haar_transformed_images->n_images < 2 * N_THREADS) {
-        n_threads = 1;
-    }
-
-    pthread_t thread[N_THREADS];
-    struct build_rawfingerprints_job jobs[N_THREADS];
-    unsigned int images_per_thread = haar_transformed_images->n_images / n_threads;
-    for (unsigned int k = 0 ; k < n_threads ; k++) {
-        unsigned int start = k * images_per_thread;
-        unsigned int end = (k == n_threads - 1)
-                        ? haar_transformed_images->n_images - 1
-                        : (k + 1) * images_per_thread - 1;
-        jobs[k].images = haar_transformed_images->images;
-        jobs[k].fingerprints = rfp->fingerprints;
-        jobs[k].first_image = start;
-        jobs[k].last_image = end;
-
-        pthread_create(&(thread[k]), NULL, (void* (*)(void*))launch_build_rawfingerprints, &(jobs[k]));
-    }
-
-    for (unsigned int k = 0 ; k < n_threads ; k++) {
-	    pthread_join(thread[k], NULL);
-    }
+    struct build_rawfingerprints_job job;
+    job.images = haar_transformed_images->images;
+    job.fingerprints = rfp->fingerprints;
+    parallel_for(n_images, MIN_IMAGES_PER_CHUNK, (parallel_function)launch_build_rawfingerprints, &job);
 
     return rfp;
 }
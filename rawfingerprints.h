@@ -63,6 +63,14 @@ struct rawfingerprints {
 struct rawfingerprints* build_raw_fingerprints(struct spectral_images* haar_transformed_images);
 
 
+/**
+ * Calculates the raw fingerprint of a single spectral image that has already
+ * been transformed into Haar wavelets. The bit array of the given fingerprint
+ * must be filled with zeros.
+ */
+void build_raw_fingerprint(struct spectral_image* haar_transformed_image, struct rawfingerprint* fp);
+
+
 /**
  * Frees all the memory associated to the given raw fingerprints.
  */
@@ -1,12 +1,15 @@
 #include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "profiler.h"
 #include "resample.h"
 
 
 #define FILTER_SIZE 31
 
-static float low_pass_filter[FILTER_SIZE] = { 666 };
+static float low_pass_filter[FILTER_SIZE];
+static pthread_once_t low_pass_filter_once = PTHREAD_ONCE_INIT;
 
 
 static float sinc(float x) {
@@ -44,19 +47,37 @@ static float get_5512Hz_sample(float* samples_44100Hz, unsigned int start, unsig
 }
 
 
-float* resample(float* samples_44100Hz, unsigned int n_samples) {
-    if (low_pass_filter[0] > 600) {
-        initialize_low_pass_filter();
-    }
+float* resample(float* samples_44100Hz, unsigned int n_samples, struct arena* arena) {
+    pthread_once(&low_pass_filter_once, initialize_low_pass_filter);
 
-    float* samples_5512Hz = (float*)malloc((n_samples / 8) * sizeof(float));
+    float* samples_5512Hz = (float*)arena_alloc(arena, (n_samples / 8) * sizeof(float));
     if (samples_5512Hz == NULL) {
         return NULL;
     }
+    count_profile_bytes(PROFILE_RESAMPLE, (n_samples / 8) * sizeof(float));
 
+    struct profile_span span;
+    begin_span(&span, PROFILE_RESAMPLE);
     for (unsigned int i = 0 ; i < (n_samples / 8) ; i++) {
         samples_5512Hz[i] = get_5512Hz_sample(samples_44100Hz, i * 8, n_samples);
     }
+    end_span(&span, n_samples / 8);
 
     return samples_5512Hz;
 }
+
+
+unsigned int resample_available(float* samples_44100Hz, unsigned int n_samples, float* samples_5512Hz) {
+    pthread_once(&low_pass_filter_once, initialize_low_pass_filter);
+    if (n_samples < FILTER_SIZE) {
+        return 0;
+    }
+    unsigned int n = 1 + (n_samples - FILTER_SIZE) / 8;
+    struct profile_span span;
+    begin_span(&span, PROFILE_RESAMPLE);
+    for (unsigned int i = 0 ; i < n ; i++) {
+        samples_5512Hz[i] = get_5512Hz_sample(samples_44100Hz, i * 8, n_samples);
+    }
+    end_span(&span, n);
+    return n;
+}
@@ -1,6 +1,7 @@
 #ifndef _RESAMPLE_H
 #define _RESAMPLE_H
 
+#include "arena.h"
 
 /**
  * When resampling audio, a problem known as aliasing may occur.
@@ -29,9 +30,27 @@
  *
  * @param samples_44100Hz Mono float samples between -1.0 and 1.0
  * @param n_samples The size of the input array
+ * @param arena The arena to allocate the results from, or NULL to use malloc()
  * @return An array of n_samples/8 5512Hz samples or NULL in case
  *         of memory error
  */
-float* resample(float* samples_44100Hz, unsigned int n_samples);
+float* resample(float* samples_44100Hz, unsigned int n_samples, struct arena* arena);
+
+
+/**
+ * Resamples to 5512Hz as many samples as possible from the given samples,
+ * using only complete filter windows so that the results are the same as
+ * the ones resample() would produce if more samples were available. This
+ * is meant for streams where samples arrive a few at a time: the input
+ * samples from index 8 * n, where n is the value returned, must be kept
+ * and passed again along with the next samples.
+ *
+ * @param samples_44100Hz Mono float samples between -1.0 and 1.0
+ * @param n_samples The size of the input array
+ * @param samples_5512Hz Where to store the results. Must be able to hold
+ *                       n_samples / 8 values
+ * @return The number of 5512Hz samples produced
+ */
+unsigned int resample_available(float* samples_44100Hz, unsigned int n_samples, float* samples_5512Hz);
 
 #endif
@@ -1,10 +1,15 @@
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "hashcompare.h"
 #include "lsh.h"
+#include "profiler.h"
 #include "search.h"
+#include "spectralimages.h"
+#include "threadpool.h"
 
 
-// Checking hashes by buckets of 4 bytes is meant to
+// Checking hashes by buckets of a few bytes is meant to
 // fail fast. This value is the minimum number of bucket
 // matches that we require before giving a closer look
 // at a potential match
@@ -28,37 +33,246 @@
 // sample may be a good match
 #define GOOD_SCORE 35
 
+// The images of a sample are not aligned with the ones of the database entry
+// it comes from, so the offset between matching signatures may vary by one.
+// When looking for the offset with the most matches, we therefore count the
+// matches in a window of offsets [offset - PEAK_RADIUS, offset + PEAK_RADIUS]
+#define PEAK_RADIUS 1
+
+// We can stop searching before having looked at all the signatures of the
+// sample when the best entry has at least EARLY_TERMINATION_MATCHES matches
+// at its best offset and EARLY_TERMINATION_RATIO times more than any other entry
+#define EARLY_TERMINATION_MATCHES (3 * MIN_SIGNATURE_MATCHES)
+#define EARLY_TERMINATION_RATIO 4
+
+// The maximum number of jobs a search is split into
+#define MAX_SEARCH_JOBS 64
+
+// The signatures of the sample are processed in rounds of
+// SIGNATURES_PER_THREAD signatures per thread, so that we can stop
+// early without having wasted too much work
+#define SIGNATURES_PER_THREAD 8
+
+// The number of best entries that we look at
+// when choosing the best match
+#define TOP_K 10
+
+// The duration in seconds between the starts of 2 consecutive
+// spectral images, knowing that samples are at 44100/8 Hz
+#define SECONDS_PER_IMAGE (DISTANCE_BETWEEN_SPECTRAL_IMAGE_START * INTERVAL_BETWEEN_FRAMES / (44100.0f / 8))
+
+
 /**
- * Returns the number of bytes that are identical between
- * the given hashes.
+ * The score of a database entry, computed from the matches
+ * found at the offset where the entry has the most matches.
  */
-static unsigned int compare_hashes(uint8_t* hash1, uint8_t* hash2) {
-    unsigned int n = 0;
-    for (unsigned int i = 0 ; i < SIGNATURE_LENGTH ; i++) {
-        if (hash1[i] == hash2[i]) {
-            n++;
+struct entry_score {
+    int entry_index;
+    float score;
+    int n_matches;
+    // Position in the entry minus position in the sample
+    // around which the matches were found
+    int offset;
+};
+
+
+/**
+ * For a given entry and a given offset between the position of
+ * a signature in the entry and its position in the sample, the number
+ * of matches found and the sum of their scores.
+ */
+struct offset_votes {
+    unsigned int entry_index;
+    int offset;
+    // 0 means that this cell of the histogram is empty
+    unsigned int n_votes;
+    unsigned int score;
+};
+
+
+/**
+ * When a sample comes from a database entry, its signatures match the
+ * entry's signatures with a constant offset, while noise produces matches
+ * spread over random offsets. In order to tell them apart, we count the
+ * matches per (entry, offset) pair in a hash table that only contains the
+ * pairs that got votes.
+ */
+struct offset_histograms {
+    // The number of cells, always a power of 2
+    unsigned int capacity;
+
+    // The number of non empty cells
+    unsigned int size;
+
+    struct offset_votes* cells;
+};
+
+
+static int init_histograms(struct offset_histograms* h, unsigned int capacity) {
+    h->capacity = capacity;
+    h->size = 0;
+    h->cells = (struct offset_votes*)calloc(capacity, sizeof(struct offset_votes));
+    return h->cells == NULL ? MEMORY_ERROR : SUCCESS;
+}
+
+
+/**
+ * Returns the position of the given key in a table
+ * of the given capacity, which must be a power of 2.
+ */
+static unsigned int get_slot(uint64_t key, unsigned int capacity) {
+    return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+
+static unsigned int get_cell_index(struct offset_histograms* h, unsigned int entry_index, int offset) {
+    return get_slot(((uint64_t)entry_index << 32) | (uint32_t)offset, h->capacity);
+}
+
+
+/**
+ * Returns the cell for the given entry and offset, or NULL if there
+ * is none. If create is not 0, an empty cell is created if needed.
+ */
+static struct offset_votes* get_cell(struct offset_histograms* h, unsigned int entry_index, int offset, int create) {
+    unsigned int index = get_cell_index(h, entry_index, offset);
+    while (h->cells[index].n_votes != 0) {
+        if (h->cells[index].entry_index == entry_index && h->cells[index].offset == offset) {
+            return &(h->cells[index]);
         }
+        index = (index + 1) & (h->capacity - 1);
     }
-    return n;
+    if (!create) {
+        return NULL;
+    }
+    h->cells[index].entry_index = entry_index;
+    h->cells[index].offset = offset;
+    (h->size)++;
+    return &(h->cells[index]);
 }
 
 
-static int compare(struct signature_list* a, struct signature_list* b) {
-    int diff = a->entry_index - b->entry_index;
-    if (diff != 0) {
-        return diff;
+/**
+ * Adds a match with the given score to the histogram of the given entry.
+ *
+ * @return The cell that was updated or NULL in case of memory allocation error
+ */
+static struct offset_votes* vote(struct offset_histograms* h, unsigned int entry_index, int offset, unsigned int score) {
+    if (2 * (h->size + 1) > h->capacity) {
+        // Let's keep the table at most half full so that probing stays short
+        struct offset_histograms bigger;
+        if (MEMORY_ERROR == init_histograms(&bigger, 2 * h->capacity)) {
+            return NULL;
+        }
+        for (unsigned int i = 0 ; i < h->capacity ; i++) {
+            if (h->cells[i].n_votes != 0) {
+                *get_cell(&bigger, h->cells[i].entry_index, h->cells[i].offset, 1) = h->cells[i];
+            }
+        }
+        free(h->cells);
+        *h = bigger;
     }
-    return a->signature_index - b->signature_index;
+    struct offset_votes* cell = get_cell(h, entry_index, offset, 1);
+    (cell->n_votes)++;
+    cell->score += score;
+    return cell;
 }
 
 
-struct entry_score {
-    int entry_index;
-    float score;
-    int n_matches;
+/**
+ * Only the entries that got votes have a score, so there is no need to
+ * allocate and sort a score for each entry of the database. The scores are
+ * kept in a hash table indexed by entry, where empty cells have no matches.
+ */
+struct entry_scores {
+    // The number of cells, always a power of 2
+    unsigned int capacity;
+
+    // The number of non empty cells
+    unsigned int size;
+
+    struct entry_score* cells;
 };
 
 
+static int init_entry_scores(struct entry_scores* t, unsigned int capacity) {
+    t->capacity = capacity;
+    t->size = 0;
+    t->cells = (struct entry_score*)calloc(capacity, sizeof(struct entry_score));
+    return t->cells == NULL ? MEMORY_ERROR : SUCCESS;
+}
+
+
+/**
+ * Returns the score of the given entry, or NULL if there is none. If create
+ * is not 0, an empty score is created if needed, in which case the caller
+ * must give it at least one match before looking for another entry.
+ */
+static struct entry_score* get_entry_score(struct entry_scores* t, int entry_index, int create) {
+    unsigned int index = get_slot(entry_index, t->capacity);
+    while (t->cells[index].n_matches != 0) {
+        if (t->cells[index].entry_index == entry_index) {
+            return &(t->cells[index]);
+        }
+        index = (index + 1) & (t->capacity - 1);
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (2 * (t->size + 1) > t->capacity) {
+        // Let's keep the table at most half full so that probing stays short
+        struct entry_scores bigger;
+        if (MEMORY_ERROR == init_entry_scores(&bigger, 2 * t->capacity)) {
+            return NULL;
+        }
+        for (unsigned int i = 0 ; i < t->capacity ; i++) {
+            if (t->cells[i].n_matches != 0) {
+                *get_entry_score(&bigger, t->cells[i].entry_index, 1) = t->cells[i];
+            }
+        }
+        free(t->cells);
+        *t = bigger;
+        index = get_slot(entry_index, t->capacity);
+        while (t->cells[index].n_matches != 0) {
+            index = (index + 1) & (t->capacity - 1);
+        }
+    }
+    t->cells[index].entry_index = entry_index;
+    t->cells[index].score = 0;
+    t->cells[index].offset = 0;
+    (t->size)++;
+    return &(t->cells[index]);
+}
+
+
+/**
+ * Updates the score of the given entry if the window of offsets
+ * centered on the given offset contains more matches than its
+ * current best window.
+ *
+ * @return 1 if the entry score was updated; 0 otherwise
+ */
+static int update_peak(struct offset_histograms* h, struct entry_score* entry_score, int offset) {
+    unsigned int n_votes = 0;
+    unsigned int score = 0;
+    for (int o = offset - PEAK_RADIUS ; o <= offset + PEAK_RADIUS ; o++) {
+        struct offset_votes* cell = get_cell(h, entry_score->entry_index, o, 0);
+        if (cell != NULL) {
+            n_votes += cell->n_votes;
+            score += cell->score;
+        }
+    }
+    if ((int)n_votes > entry_score->n_matches
+        || ((int)n_votes == entry_score->n_matches && score > entry_score->score)) {
+        entry_score->n_matches = n_votes;
+        entry_score->score = score;
+        entry_score->offset = offset;
+        return 1;
+    }
+    return 0;
+}
+
+
 /**
  * a < b if a is considered a better match than b.
  */
@@ -107,88 +321,619 @@ static int compare_entry_scores(struct entry_score* a, struct entry_score* b) {
 }
 
 
-int search(struct signatures* sample, struct index* database, struct lsh* lsh, int verbose) {
-    struct entry_score* scores = (struct entry_score*)calloc(database->n_entries, sizeof(struct entry_score));
-    if (scores == NULL) {
-        return MEMORY_ERROR;
-    }
+/**
+ * A match found for a signature of the sample, that will be used
+ * to vote for the corresponding (entry, offset) pair.
+ */
+struct search_vote {
+    // The index of the signature in the sample
+    unsigned int signature_index;
+    unsigned int entry_index;
+    int offset;
+    unsigned int score;
+};
+
+
+/**
+ * Finding the matches of the sample's signatures is the expensive part
+ * of the search and does not depend on the votes already cast, so this is
+ * done in parallel by search jobs. Each job owns its scratch memory and
+ * produces a list of votes for a range of signatures. These lists are
+ * then applied in the order of the signatures, so that the results are
+ * the same no matter how many threads are used.
+ */
+struct search_job {
+    struct signatures* sample;
+    struct index* database;
+    struct lsh* lsh;
+    unsigned int first_signature;
+    unsigned int last_signature;
+
+    struct match_buffer buffer;
+
+    // For the deep check, we need the candidate hashes and a place to store
+    // their scores. These arrays grow along with the buffer
+    uint8_t** candidate_hashes;
+    unsigned int* candidate_scores;
+    unsigned int deep_check_capacity;
+
+    // The votes for the signatures in [first_signature;last_signature[
+    struct search_vote* votes;
+    unsigned int n_votes;
+    unsigned int votes_capacity;
+
+    unsigned int n_candidates;
+    int return_code;
+
+    // When explaining a search, the number of deep checks that reached
+    // MIN_SCORE and the time spent in the lookups and the deep checks
+    int explain;
+    unsigned long n_good_scores;
+    double lookup_ms;
+    double deep_check_ms;
+};
+
+
+/**
+ * The state of a search, updated sequentially with the votes of the jobs.
+ */
+struct search_state {
+    struct entry_scores scores;
+    struct offset_histograms histograms;
+
+    // To decide when we can stop early, we keep track of the best entry and
+    // of the best number of matches among all the other entries
+    int best_entry;
+    int best_matches;
+    int second_best_matches;
+};
 
-    for (unsigned int i = 0 ; i < database->n_entries ; i++) {
-        scores[i].entry_index = i;
-        scores[i].score = 0;
-        scores[i].n_matches = 0;
+
+static void free_search_job(struct search_job* job) {
+    free(job->candidate_hashes);
+    free(job->candidate_scores);
+    free(job->votes);
+    clear_match_buffer(&(job->buffer));
+}
+
+
+static double time_in_milliseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+
+static int add_vote(struct search_job* job, unsigned int signature_index, unsigned int entry_index, int offset, unsigned int score) {
+    if (job->n_votes == job->votes_capacity) {
+        unsigned int capacity = job->votes_capacity == 0 ? 256 : 2 * job->votes_capacity;
+        struct search_vote* new_array = (struct search_vote*)realloc(job->votes, capacity * sizeof(struct search_vote));
+        if (new_array == NULL) {
+            return MEMORY_ERROR;
+        }
+        job->votes = new_array;
+        job->votes_capacity = capacity;
     }
+    job->votes[job->n_votes].signature_index = signature_index;
+    job->votes[job->n_votes].entry_index = entry_index;
+    job->votes[job->n_votes].offset = offset;
+    job->votes[job->n_votes].score = score;
+    (job->n_votes)++;
+    return SUCCESS;
+}
 
-    for (unsigned int i = 0 ; i < sample->n_signatures ; i++) {
-        struct signature_list* list;
-        int res = get_matches(lsh, sample->signatures[i].minhash, &list);
+
+/**
+ * Finds the matches of the job's signatures and turns them into votes,
+ * using the given collision counter.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int collect_votes_with(struct search_job* job, struct collision_counter* counter) {
+    for (unsigned int i = job->first_signature ; i < job->last_signature ; i++) {
+        struct signature* signature = &(job->sample->signatures[i]);
+
+        // Checking hashes by buckets is meant to fail fast, so we only give
+        // a closer look at signatures that have enough bucket matches
+        double before = job->explain ? time_in_milliseconds() : 0;
+        int res = get_candidates(job->lsh, signature->minhash, MIN_BUCKET_MATCH_FOR_DEEP_CHECK, counter, &(job->buffer));
         if (res == MEMORY_ERROR) {
-            free(scores);
             return MEMORY_ERROR;
         }
+        double after_lookup = job->explain ? time_in_milliseconds() : 0;
+        if ((unsigned int)res > job->deep_check_capacity) {
+            // The capacity is only updated once both arrays have it, so that a
+            // failure cannot leave one of them smaller than what it records
+            unsigned int capacity = job->buffer.capacity;
+            uint8_t** new_hashes = (uint8_t**)realloc(job->candidate_hashes, capacity * sizeof(uint8_t*));
+            if (new_hashes == NULL) {
+                return MEMORY_ERROR;
+            }
+            job->candidate_hashes = new_hashes;
+            unsigned int* new_scores = (unsigned int*)realloc(job->candidate_scores, capacity * sizeof(unsigned int));
+            if (new_scores == NULL) {
+                return MEMORY_ERROR;
+            }
+            job->candidate_scores = new_scores;
+            job->deep_check_capacity = capacity;
+        }
+        job->n_candidates += res;
 
-        // Now that we have partial matches, we will put those matches in a sorted array
-        // to be able to count how many bucket matches we have per signature
-        struct signature_list* array = (struct signature_list*)malloc(res * sizeof(struct signature_list));
-        if (array == NULL) {
-            free_signature_list(list);
-            free(scores);
-            return MEMORY_ERROR;
+        for (int j = 0 ; j < res ; j++) {
+            struct partial_match* m = &(job->buffer.matches[j]);
+            job->candidate_hashes[j] = job->database->entries[m->entry_index]->signatures->signatures[m->signature_index].minhash;
+        }
+        compare_hashes_batch(signature->minhash, job->candidate_hashes, res, job->candidate_scores);
+
+        for (int j = 0 ; j < res ; j++) {
+            if (job->candidate_scores[j] < MIN_SCORE) {
+                continue;
+            }
+            struct partial_match* m = &(job->buffer.matches[j]);
+            int offset = (int)job->database->entries[m->entry_index]->signatures->signatures[m->signature_index].position
+                            - (int)signature->position;
+            if (MEMORY_ERROR == add_vote(job, i, m->entry_index, offset, job->candidate_scores[j])) {
+                return MEMORY_ERROR;
+            }
+            (job->n_good_scores)++;
+        }
+        if (job->explain) {
+            job->lookup_ms += after_lookup - before;
+            job->deep_check_ms += time_in_milliseconds() - after_lookup;
+        }
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * Finds the matches of the job's signatures and turns them into votes.
+ * The collision counter is only held while doing so, so that the number
+ * of counters follows the number of threads doing lookups rather than
+ * the number of searches and streams.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int collect_votes(struct search_job* job) {
+    job->n_votes = 0;
+    struct collision_counter* counter = get_collision_counter(job->lsh);
+    if (counter == NULL) {
+        return MEMORY_ERROR;
+    }
+    int res = collect_votes_with(job, counter);
+    release_collision_counter(job->lsh, counter);
+    return res;
+}
+
+
+static int launch_search_jobs(struct search_job* jobs, unsigned int first_job, unsigned int end) {
+    for (unsigned int k = first_job ; k < end ; k++) {
+        struct profile_span span;
+        begin_span(&span, PROFILE_SEARCH);
+        jobs[k].return_code = collect_votes(&(jobs[k]));
+        end_span(&span, jobs[k].last_signature - jobs[k].first_signature);
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * Applies the given vote to the search state.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int apply_vote(struct search_state* state, struct search_vote* v) {
+    if (NULL == vote(&(state->histograms), v->entry_index, v->offset, v->score)) {
+        return MEMORY_ERROR;
+    }
+
+    // The new vote can only improve the windows that contain its offset
+    struct entry_score* entry_score = get_entry_score(&(state->scores), v->entry_index, 1);
+    if (entry_score == NULL) {
+        return MEMORY_ERROR;
+    }
+    int updated = 0;
+    for (int o = v->offset - PEAK_RADIUS ; o <= v->offset + PEAK_RADIUS ; o++) {
+        updated |= update_peak(&(state->histograms), entry_score, o);
+    }
+    if (!updated) {
+        return SUCCESS;
+    }
+    if (state->best_entry == (int)v->entry_index) {
+        state->best_matches = entry_score->n_matches;
+        return SUCCESS;
+    }
+    if (state->best_entry == -1 || entry_score->n_matches > state->best_matches) {
+        if (state->best_entry != -1) {
+            state->second_best_matches = state->best_matches;
         }
+        state->best_entry = v->entry_index;
+        state->best_matches = entry_score->n_matches;
+    } else if (entry_score->n_matches > state->second_best_matches) {
+        state->second_best_matches = entry_score->n_matches;
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * Returns 1 if one offset peak clearly dominates, which means
+ * that there is no need to look further; 0 otherwise.
+ */
+static int can_stop_early(struct search_state* state) {
+    return state->best_entry != -1
+            && state->best_matches >= EARLY_TERMINATION_MATCHES
+            && state->best_matches >= EARLY_TERMINATION_RATIO * state->second_best_matches;
+}
+
+
+/**
+ * Like compare_entry_scores(), but breaks ties by entry index
+ * so that the selection does not depend on the table layout.
+ */
+static int compare_ranked_entries(struct entry_score* a, struct entry_score* b) {
+    int res = compare_entry_scores(a, b);
+    if (res != 0) {
+        return res;
+    }
+    return (a->entry_index > b->entry_index) - (a->entry_index < b->entry_index);
+}
 
-        for (int j = 0 ; j < res ; j++, list = list->next) {
-            array[j].entry_index = list->entry_index;
-            array[j].signature_index = list->signature_index;
-        }
-        free_signature_list(list);
-
-        qsort(array, res, sizeof(struct signature_list), (int (*)(const void *, const void *)) compare);
-
-        unsigned int n_identical_matches = 1;
-        for (int j = 1 ; j < res ; j++) {
-            if (array[j].entry_index == array[j - 1].entry_index
-                && array[j].signature_index == array[j - 1].signature_index) {
-                    n_identical_matches++;
-            } else {
-                if (n_identical_matches >= MIN_BUCKET_MATCH_FOR_DEEP_CHECK) {
-                    int entry_index = array[j - 1].entry_index;
-                    int signature_index = array[j - 1].signature_index;
-                    unsigned int score = compare_hashes(database->entries[entry_index]->signatures->signatures[signature_index].minhash,
-                                                        sample->signatures[i].minhash);
-                    if (score >= MIN_SCORE) {
-                        scores[entry_index].score += score;
-                        scores[entry_index].n_matches++;
-                    }
+
+/**
+ * Selects the k best entries of the given table and stores them,
+ * best first, in the given array.
+ *
+ * @return The number of entries stored in top
+ */
+static unsigned int select_top_entries(struct entry_scores* t, struct entry_score* top, unsigned int k) {
+    unsigned int n = 0;
+    for (unsigned int i = 0 ; i < t->capacity ; i++) {
+        struct entry_score* e = &(t->cells[i]);
+        if (e->n_matches == 0) {
+            continue;
+        }
+        if (n == k && (k == 0 || compare_ranked_entries(e, &(top[k - 1])) >= 0)) {
+            continue;
+        }
+        // Insertion into the sorted array, dropping the last entry if it is full
+        unsigned int j = (n == k) ? k - 1 : n++;
+        while (j > 0 && compare_ranked_entries(e, &(top[j - 1])) < 0) {
+            top[j] = top[j - 1];
+            j--;
+        }
+        top[j] = *e;
+    }
+    return n;
+}
+
+
+/**
+ * Turns the given ranked entries into results, with the matches first.
+ * Only the TOP_K first entries are considered as potential matches, and the
+ * matches are sorted by decreasing average score, the first one in the ranking
+ * winning ties.
+ */
+static void build_results(struct entry_score* ranked, unsigned int n, struct search_result* results) {
+    unsigned int n_matches = 0;
+    for (unsigned int i = 0 ; i < n ; i++) {
+        struct search_result r;
+        r.entry_index = ranked[i].entry_index;
+        r.average_score = ranked[i].score / (float)ranked[i].n_matches;
+        r.n_matches = ranked[i].n_matches;
+        r.offset = ranked[i].offset;
+        r.offset_in_seconds = ranked[i].offset * SECONDS_PER_IMAGE;
+        r.is_match = i < TOP_K
+                        && (r.n_matches >= MIN_SIGNATURE_MATCHES || (r.average_score >= GOOD_SCORE && r.n_matches >= MIN_SIGNATURE_MATCHES / 2))
+                        && r.average_score >= MIN_AVERAGE_SCORE;
+        if (!r.is_match) {
+            results[i] = r;
+            continue;
+        }
+        // Stable insertion of the match after the matches with a
+        // better or equal score, shifting the non matches
+        unsigned int j = i;
+        while (j > n_matches) {
+            results[j] = results[j - 1];
+            j--;
+        }
+        while (j > 0 && results[j - 1].average_score < r.average_score) {
+            results[j] = results[j - 1];
+            j--;
+        }
+        results[j] = r;
+        n_matches++;
+    }
+}
+
+
+static int init_search_state(struct search_state* state) {
+    state->best_entry = -1;
+    state->best_matches = 0;
+    state->second_best_matches = 0;
+    if (MEMORY_ERROR == init_entry_scores(&(state->scores), 256)) {
+        return MEMORY_ERROR;
+    }
+    if (MEMORY_ERROR == init_histograms(&(state->histograms), 1024)) {
+        free(state->scores.cells);
+        return MEMORY_ERROR;
+    }
+    return SUCCESS;
+}
+
+
+static void free_search_state(struct search_state* state) {
+    free(state->scores.cells);
+    free(state->histograms.cells);
+}
+
+
+/**
+ * Stores in the given array the best candidates of the given search state.
+ *
+ * @return The number of results stored on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int get_results(struct search_state* state, struct index* database,
+                        struct search_result* results, unsigned int max_results, int verbose) {
+    // We need at least the TOP_K first entries to decide which ones are matches
+    unsigned int k = max_results > TOP_K ? max_results : TOP_K;
+    struct entry_score top[TOP_K];
+    struct entry_score* ranked = (k == TOP_K) ? top : (struct entry_score*)malloc(k * sizeof(struct entry_score));
+    struct search_result top_results[TOP_K];
+    struct search_result* all_results = (k == TOP_K) ? top_results : (struct search_result*)malloc(k * sizeof(struct search_result));
+    if (ranked == NULL || all_results == NULL) {
+        if (ranked != top) free(ranked);
+        if (all_results != top_results) free(all_results);
+        return MEMORY_ERROR;
+    }
+    unsigned int n = select_top_entries(&(state->scores), ranked, k);
+    build_results(ranked, n, all_results);
+
+    if (verbose) {
+        for (unsigned int i = 0 ; i < n ; i++) {
+            struct search_result* r = &(all_results[i]);
+            printf("average_score = %f, n_matches = %d, offset = %d (%s)%s\n", r->average_score, r->n_matches, r->offset,
+                    database->entries[r->entry_index]->filename, r->is_match ? " *" : "");
+        }
+        if (n > 0 && all_results[0].is_match) {
+            printf("\n*** match = %f %s ***\n", all_results[0].average_score, database->entries[all_results[0].entry_index]->filename);
+        }
+        printf("-----------------------------\n");
+    }
+
+    if (n > max_results) {
+        n = max_results;
+    }
+    memcpy(results, all_results, n * sizeof(struct search_result));
+    if (ranked != top) free(ranked);
+    if (all_results != top_results) free(all_results);
+    return n;
+}
+
+
+int search_top_matches(struct signatures* sample, struct index* database, struct lsh* lsh,
+                        struct search_result* results, unsigned int max_results, int verbose) {
+    struct search_state state;
+    if (MEMORY_ERROR == init_search_state(&state)) {
+        return MEMORY_ERROR;
+    }
+
+    // Each job collects the votes of a part of the signatures of each round,
+    // so that the votes can be applied in order after the round
+    unsigned int n_threads = get_thread_pool_size();
+    if (n_threads > MAX_SEARCH_JOBS) {
+        n_threads = MAX_SEARCH_JOBS;
+    }
+    if (sample->n_signatures < 2 * n_threads) {
+        n_threads = 1;
+    }
+
+    // The jobs and their scratch memory are reused for all the rounds
+    struct search_job jobs[MAX_SEARCH_JOBS];
+    int res = SUCCESS;
+    for (unsigned int k = 0 ; k < n_threads ; k++) {
+        memset(&(jobs[k]), 0, sizeof(struct search_job));
+        jobs[k].sample = sample;
+        jobs[k].database = database;
+        jobs[k].lsh = lsh;
+        jobs[k].explain = verbose;
+        init_match_buffer(&(jobs[k].buffer));
+    }
+
+    unsigned int round_size = n_threads * SIGNATURES_PER_THREAD;
+    unsigned int n_processed = 0;
+    double voting_ms = 0;
+    int stop = 0;
+    while (res == SUCCESS && !stop && n_processed < sample->n_signatures) {
+        unsigned int round_end = n_processed + round_size;
+        if (round_end > sample->n_signatures) {
+            round_end = sample->n_signatures;
+        }
+        unsigned int signatures_per_thread = (round_end - n_processed) / n_threads;
+        for (unsigned int k = 0 ; k < n_threads ; k++) {
+            jobs[k].first_signature = n_processed + k * signatures_per_thread;
+            jobs[k].last_signature = (k == n_threads - 1) ? round_end : n_processed + (k + 1) * signatures_per_thread;
+        }
+        parallel_for(n_threads, 1, (parallel_function)launch_search_jobs, jobs);
+
+        // Now let's apply the votes in the order of the signatures. We check if we can stop
+        // after each signature, exactly as if we had processed them one by one
+        double before_voting = verbose ? time_in_milliseconds() : 0;
+        for (unsigned int k = 0 ; k < n_threads && res == SUCCESS && !stop ; k++) {
+            res = jobs[k].return_code;
+            for (unsigned int j = 0 ; j < jobs[k].n_votes && res == SUCCESS ; j++) {
+                struct search_vote* v = &(jobs[k].votes[j]);
+                if (v->signature_index >= n_processed && can_stop_early(&state)) {
+                    stop = 1;
+                    break;
                 }
-                n_identical_matches = 1;
+                n_processed = v->signature_index + 1;
+                res = apply_vote(&state, v);
+            }
+        }
+        if (!stop) {
+            n_processed = round_end;
+            if (can_stop_early(&state)) {
+                stop = 1;
             }
         }
+        if (verbose) {
+            voting_ms += time_in_milliseconds() - before_voting;
+        }
+    }
+
+    unsigned int n_candidates = 0;
+    unsigned int n_allocations = 0;
+    unsigned long n_band_hits = 0;
+    unsigned long n_good_scores = 0;
+    double lookup_ms = 0;
+    double deep_check_ms = 0;
+    for (unsigned int k = 0 ; k < n_threads ; k++) {
+        n_candidates += jobs[k].n_candidates;
+        n_allocations += jobs[k].buffer.n_allocations;
+        n_band_hits += jobs[k].buffer.n_band_hits;
+        n_good_scores += jobs[k].n_good_scores;
+        lookup_ms += jobs[k].lookup_ms;
+        deep_check_ms += jobs[k].deep_check_ms;
+        free_search_job(&(jobs[k]));
+    }
+    free(state.histograms.cells);
+    if (res != SUCCESS) {
+        free(state.scores.cells);
+        return res;
+    }
+    if (verbose) {
+        printf("%u/%u signatures processed, %u candidates, %u entries with votes, %u buffer allocations\n",
+                n_processed, sample->n_signatures, n_candidates, state.scores.size, n_allocations);
+        printf("%lu bucket hits, %u candidates with at least %d bucket matches, %lu deep checks with a score of at least %d\n",
+                n_band_hits, n_candidates, MIN_BUCKET_MATCH_FOR_DEEP_CHECK, n_good_scores, MIN_SCORE);
+        printf("lookups %.3f ms, deep checks %.3f ms (summed over %u threads), voting %.3f ms\n",
+                lookup_ms, deep_check_ms, n_threads, voting_ms);
+    }
+
+    int n = get_results(&state, database, results, max_results, verbose);
+    free(state.scores.cells);
+    return n;
+}
+
+
+int search(struct signatures* sample, struct index* database, struct lsh* lsh, int verbose) {
+    struct search_result result;
+    int n = search_top_matches(sample, database, lsh, &result, 1, verbose);
+    if (n < 0) {
+        return n;
+    }
+    return (n == 1 && result.is_match) ? result.entry_index : NO_MATCH_FOUND;
+}
+
+
+/**
+ * The votes collected for the last signatures of a stream, so that
+ * we can look for matches in a sliding window without having to look
+ * up the signatures of the window again and again.
+ */
+struct stream_search {
+    struct index* database;
+    struct lsh* lsh;
+
+    // The job used to collect the votes of new signatures
+    struct search_job job;
+
+    // The votes of the signatures of the last window_size images of the stream,
+    // sorted by position. The signature_index field of the votes is the
+    // position of the signature in the stream
+    struct search_vote* votes;
+    unsigned int n_votes;
+    unsigned int votes_capacity;
 
-        free(array);
+    unsigned int window_size;
+};
+
+
+struct stream_search* new_stream_search(struct index* database, struct lsh* lsh, float window_in_seconds) {
+    struct stream_search* s = (struct stream_search*)calloc(1, sizeof(struct stream_search));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->database = database;
+    s->lsh = lsh;
+    s->window_size = 1 + (unsigned int)(window_in_seconds / SECONDS_PER_IMAGE);
+    s->job.database = database;
+    s->job.lsh = lsh;
+    init_match_buffer(&(s->job.buffer));
+    return s;
+}
+
+
+int add_stream_signatures(struct stream_search* s, struct signatures* signatures) {
+    if (signatures->n_signatures == 0) {
+        return SUCCESS;
     }
 
-    qsort(scores, database->n_entries, sizeof(struct entry_score), (int (*)(const void *, const void *)) compare_entry_scores);
+    s->job.sample = signatures;
+    s->job.first_signature = 0;
+    s->job.last_signature = signatures->n_signatures;
+    if (MEMORY_ERROR == collect_votes(&(s->job))) {
+        return MEMORY_ERROR;
+    }
 
+    // Let's forget about the votes that are now out of the window
+    unsigned int latest = signatures->signatures[signatures->n_signatures - 1].position;
+    unsigned int first_kept = 0;
+    while (first_kept < s->n_votes && s->votes[first_kept].signature_index + s->window_size <= latest) {
+        first_kept++;
+    }
+    s->n_votes -= first_kept;
+    memmove(s->votes, s->votes + first_kept, s->n_votes * sizeof(struct search_vote));
 
-    int best_match = NO_MATCH_FOUND;
-    float best_score = 0;
-    for (unsigned int i = 0 ; i < database->n_entries && i < 10; i++) {
-        int index = scores[i].entry_index;
-        float average_score = scores[i].n_matches == 0 ? 0 : (scores[i].score / (float)scores[i].n_matches);
-        if (verbose) printf("average_score = %f, n_matches = %d (%s)\n", average_score, scores[i].n_matches, database->entries[index]->filename);
-        if ((scores[i].n_matches >= MIN_SIGNATURE_MATCHES || (average_score >= GOOD_SCORE && scores[i].n_matches >= MIN_SIGNATURE_MATCHES / 2))
-            && average_score >= MIN_AVERAGE_SCORE)
-        if (average_score > best_score) {
-            best_score = average_score;
-            best_match = index;
+    if (s->n_votes + s->job.n_votes > s->votes_capacity) {
+        unsigned int capacity = 2 * (s->n_votes + s->job.n_votes);
+        struct search_vote* tmp = (struct search_vote*)realloc(s->votes, capacity * sizeof(struct search_vote));
+        if (tmp == NULL) {
+            return MEMORY_ERROR;
         }
+        s->votes = tmp;
+        s->votes_capacity = capacity;
+    }
+    for (unsigned int i = 0 ; i < s->job.n_votes ; i++) {
+        struct search_vote v = s->job.votes[i];
+        v.signature_index = signatures->signatures[v.signature_index].position;
+        s->votes[(s->n_votes)++] = v;
+    }
+    return SUCCESS;
+}
+
+
+int get_stream_matches(struct stream_search* s, struct search_result* results, unsigned int max_results, int verbose) {
+    // Applying the votes is cheap compared to collecting them,
+    // so we just replay the votes of the window
+    struct search_state state;
+    if (MEMORY_ERROR == init_search_state(&state)) {
+        return MEMORY_ERROR;
     }
-    if (best_match != NO_MATCH_FOUND) {
-        if (verbose) printf("\n*** match = %f %s ***\n", best_score, database->entries[best_match]->filename);
+    for (unsigned int i = 0 ; i < s->n_votes ; i++) {
+        if (MEMORY_ERROR == apply_vote(&state, &(s->votes[i]))) {
+            free_search_state(&state);
+            return MEMORY_ERROR;
+        }
     }
-    if (verbose) printf("-----------------------------\n");
+    int n = get_results(&state, s->database, results, max_results, verbose);
+    free_search_state(&state);
+    return n;
+}
+
+
+void reset_stream_search(struct stream_search* s) {
+    s->n_votes = 0;
+}
 
-    free(scores);
 
-    return best_match;
+void free_stream_search(struct stream_search* s) {
+    free_search_job(&(s->job));
+    free(s->votes);
+    free(s);
 }
@@ -22,5 +22,105 @@
 int search(struct signatures* sample, struct index* database, struct lsh* lsh, int verbose);
 
 
+/**
+ * A database entry that is a candidate match for an audio sample.
+ */
+struct search_result {
+    // The index of the database entry
+    int entry_index;
+
+    // The average score of the signature matches found
+    // at the best offset, between 0 and 100
+    float average_score;
+
+    // The number of signature matches found at the best offset
+    int n_matches;
+
+    // The position in the entry where the sample seems to start, both
+    // as a number of spectral images and in seconds
+    int offset;
+    float offset_in_seconds;
+
+    // 1 if this entry is good enough to be considered a match; 0 otherwise
+    int is_match;
+};
+
+
+/**
+ * Given the fingerprint of an audio sample, this function looks for the
+ * best candidates in the given database. The candidates are sorted so
+ * that the matches come first, best first, followed by the other candidates
+ * sorted by decreasing likelihood. If there is a match, the first result is
+ * therefore the one that search() would return.
+ *
+ * @param sample The fingerprint of the sample to identify
+ * @param database The database to search into
+ * @param lsh The hash tables to use for efficiency
+ * @param results Where to store the results
+ * @param max_results The maximum number of results to store
+ * @param verbose If not 0, will print information about the top matches
+ * @return The number of results stored on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int search_top_matches(struct signatures* sample, struct index* database, struct lsh* lsh,
+                        struct search_result* results, unsigned int max_results, int verbose);
+
+
+
+/**
+ * When identifying continuous audio, the signatures arrive a few at a time
+ * and we want to find matches among the signatures of the last few seconds.
+ * A stream search keeps the votes of these signatures so that each signature
+ * is only looked up once.
+ */
+struct stream_search;
+
+
+/**
+ * Creates a stream search.
+ *
+ * @param database The database to search into
+ * @param lsh The hash tables to use for efficiency
+ * @param window_in_seconds The duration of the audio window to consider
+ * @return The stream search or NULL in case of memory allocation error
+ */
+struct stream_search* new_stream_search(struct index* database, struct lsh* lsh, float window_in_seconds);
+
+
+/**
+ * Adds the given signatures to the given stream search. Their positions
+ * must count the spectral images since the beginning of the stream, like
+ * the ones produced by a stream_fingerprinter, and must be greater than
+ * the positions of the signatures already added.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int add_stream_signatures(struct stream_search* s, struct signatures* signatures);
+
+
+/**
+ * Looks for the best candidates among the signatures of the current
+ * window, like search_top_matches() does. Since positions count from the
+ * beginning of the stream, the offsets of the results are the positions in
+ * the entries minus the positions in the stream.
+ *
+ * @return The number of results stored on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int get_stream_matches(struct stream_search* s, struct search_result* results, unsigned int max_results, int verbose);
+
+
+/**
+ * Forgets about all the signatures added so far, for instance
+ * after a match has been reported.
+ */
+void reset_stream_search(struct stream_search* s);
+
+
+/**
+ * Frees all the memory associated to the given stream search.
+ */
+void free_stream_search(struct stream_search* s);
 
 #endif
@@ -0,0 +1,404 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "ffmpeg.h"
+#include "fingerprinting.h"
+#include "search.h"
+#include "server.h"
+#include "toolutils.h"
+#include "wav.h"
+
+// The maximum length of a request line
+#define MAX_REQUEST_LINE 4096
+
+struct job {
+    // The file to identify, or NULL for a PCM request
+    char* filename;
+
+    // The raw samples of a PCM request
+    uint8_t* pcm;
+    unsigned int pcm_size;
+
+    // The results
+    int error;
+    int best_match;
+    double fingerprint_ms;
+    double search_ms;
+
+    // Set to 1 by the worker when the results are available
+    int done;
+    pthread_cond_t done_cond;
+
+    struct job* next;
+};
+
+
+struct server {
+    // The listening socket
+    int socket;
+
+    struct index* database;
+    struct lsh* lsh;
+
+    // The queue of jobs waiting for a worker
+    struct job* first_job;
+    struct job* last_job;
+    pthread_mutex_t lock;
+    pthread_cond_t job_available;
+};
+
+
+struct connection {
+    struct server* server;
+    int fd;
+};
+
+
+static const char* get_error_message(int error) {
+    switch (error) {
+        case MEMORY_ERROR: return "memory allocation error";
+        case CANNOT_READ_FILE: return "cannot read file";
+        case DECODING_ERROR: return "cannot decode input";
+        case UNSUPPORTED_WAVE_FORMAT: return "unsupported wave format";
+        case FILE_TOO_SMALL: return "input too small to generate a fingerprint";
+        case NOT_A_WAVE_FILE: return "not a wave file and could not convert it with ffmpeg";
+        default: return "invalid request";
+    }
+}
+
+
+static void print_json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for ( ; *s ; s++) {
+        unsigned char c = (unsigned char)*s;
+        switch (c) {
+            case '"': fputs("\\\"", out); break;
+            case '\\': fputs("\\\\", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\r': fputs("\\r", out); break;
+            case '\t': fputs("\\t", out); break;
+            default: {
+                if (c < 0x20) {
+                    fprintf(out, "\\u%04x", c);
+                } else {
+                    fputc(c, out);
+                }
+            }
+        }
+    }
+    fputc('"', out);
+}
+
+
+static void send_response(FILE* out, struct server* server, struct job* job) {
+    if (job->error != SUCCESS) {
+        fprintf(out, "{\"status\":\"error\",\"error\":");
+        print_json_string(out, get_error_message(job->error));
+        fprintf(out, "}\n");
+    } else if (job->best_match < 0) {
+        fprintf(out, "{\"status\":\"no_match\",\"fingerprint_ms\":%.3f,\"search_ms\":%.3f}\n",
+                job->fingerprint_ms, job->search_ms);
+    } else {
+        struct index_entry* entry = server->database->entries[job->best_match];
+        fprintf(out, "{\"status\":\"ok\",\"match\":");
+        print_json_string(out, entry->filename);
+        fprintf(out, ",\"artist\":");
+        print_json_string(out, entry->artist);
+        fprintf(out, ",\"track_title\":");
+        print_json_string(out, entry->track_title);
+        fprintf(out, ",\"album_title\":");
+        print_json_string(out, entry->album_title);
+        fprintf(out, ",\"fingerprint_ms\":%.3f,\"search_ms\":%.3f}\n", job->fingerprint_ms, job->search_ms);
+    }
+    fflush(out);
+}
+
+
+/**
+ * Calculates the fingerprint of the given raw PCM samples.
+ *
+ * @return SUCCESS on success
+ *         any error code returned by convert_samples() or
+ *                    generate_fingerprint_from_samples() otherwise
+ */
+static int fingerprint_pcm(uint8_t* pcm, unsigned int size, struct signatures* *fingerprint, struct arena* arena) {
+    float* samples;
+    int n = convert_samples(pcm, size, &samples, arena);
+    if (n < 0) {
+        return n;
+    }
+    int res = generate_fingerprint_from_samples(samples, n, fingerprint, arena);
+    arena_free(arena, samples);
+    return res;
+}
+
+
+/**
+ * Fingerprints the input of the given job and looks it up in the database.
+ */
+static void run_job(struct server* server, struct job* job, struct arena* arena) {
+    struct signatures* fingerprint;
+    double before = time_in_milliseconds();
+    if (job->filename != NULL) {
+        char* artist;
+        char* track_title;
+        char* album_title;
+        job->error = generate_fingerprint_from_any_file(job->filename, &fingerprint, &artist, &track_title, &album_title, arena);
+        free(artist);
+        free(track_title);
+        free(album_title);
+    } else {
+        job->error = fingerprint_pcm(job->pcm, job->pcm_size, &fingerprint, arena);
+    }
+    double after_fingerprint = time_in_milliseconds();
+    job->fingerprint_ms = after_fingerprint - before;
+
+    if (job->error == SUCCESS) {
+        job->best_match = search(fingerprint, server->database, server->lsh, 0);
+        job->search_ms = time_in_milliseconds() - after_fingerprint;
+        free_signatures(fingerprint);
+        if (job->best_match == MEMORY_ERROR) {
+            job->error = MEMORY_ERROR;
+        }
+    }
+}
+
+
+static void* launch_worker(struct server* server) {
+    // Each worker recycles the same buffers for all its jobs.
+    // If we cannot get an arena, we just use malloc()
+    struct arena* arena = new_arena();
+    while (1) {
+        pthread_mutex_lock(&(server->lock));
+        while (server->first_job == NULL) {
+            pthread_cond_wait(&(server->job_available), &(server->lock));
+        }
+        struct job* job = server->first_job;
+        server->first_job = job->next;
+        if (server->first_job == NULL) {
+            server->last_job = NULL;
+        }
+        pthread_mutex_unlock(&(server->lock));
+
+        if (arena != NULL) {
+            reset_arena(arena);
+        }
+        run_job(server, job, arena);
+
+        pthread_mutex_lock(&(server->lock));
+        job->done = 1;
+        pthread_cond_signal(&(job->done_cond));
+        pthread_mutex_unlock(&(server->lock));
+    }
+    return NULL;
+}
+
+
+/**
+ * Queues the given job and waits for a worker to process it.
+ */
+static void submit_job(struct server* server, struct job* job) {
+    job->done = 0;
+    job->next = NULL;
+    pthread_mutex_lock(&(server->lock));
+    if (server->last_job == NULL) {
+        server->first_job = job;
+    } else {
+        server->last_job->next = job;
+    }
+    server->last_job = job;
+    pthread_cond_signal(&(server->job_available));
+    while (!job->done) {
+        pthread_cond_wait(&(job->done_cond), &(server->lock));
+    }
+    pthread_mutex_unlock(&(server->lock));
+}
+
+
+/**
+ * Reads the requests of the given connection until the client closes
+ * it or sends an invalid request. The requests are passed to the worker
+ * pool one at a time, so that the number of fingerprinting and search
+ * operations running in parallel does not depend on the number of clients.
+ */
+static void* handle_connection(struct connection* connection) {
+    struct server* server = connection->server;
+    int fd = connection->fd;
+    free(connection);
+
+    FILE* in = fdopen(fd, "r");
+    if (in == NULL) {
+        close(fd);
+        return NULL;
+    }
+    int fd2 = dup(fd);
+    FILE* out = fd2 < 0 ? NULL : fdopen(fd2, "w");
+    if (out == NULL) {
+        if (fd2 >= 0) close(fd2);
+        fclose(in);
+        return NULL;
+    }
+
+    struct job job;
+    pthread_cond_init(&(job.done_cond), NULL);
+
+    char line[MAX_REQUEST_LINE];
+    while (NULL != fgets(line, MAX_REQUEST_LINE, in)) {
+        int len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len > 0 && line[len - 1] == '\r') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+
+        job.filename = NULL;
+        job.pcm = NULL;
+        job.pcm_size = 0;
+        job.error = SUCCESS;
+        job.best_match = NO_MATCH_FOUND;
+        job.fingerprint_ms = 0;
+        job.search_ms = 0;
+
+        if (!strncmp(line, "FILE ", 5)) {
+            job.filename = line + 5;
+        } else if (!strncmp(line, "PCM ", 4)) {
+            char* end;
+            unsigned long size = strtoul(line + 4, &end, 10);
+            if (end == line + 4 || *end != '\0' || size > MAX_PCM_BYTES) {
+                job.error = DECODING_ERROR;
+            } else {
+                job.pcm_size = size;
+                job.pcm = (uint8_t*)malloc(size > 0 ? size : 1);
+                if (job.pcm == NULL) {
+                    job.error = MEMORY_ERROR;
+                } else if (size != fread(job.pcm, sizeof(uint8_t), size, in)) {
+                    job.error = DECODING_ERROR;
+                }
+            }
+        } else {
+            job.error = DECODING_ERROR;
+        }
+
+        // If we could not read a request entirely, we cannot know where
+        // the next one starts, so we will have to drop the connection
+        int keep_going = (job.error == SUCCESS);
+        if (job.error == SUCCESS) {
+            submit_job(server, &job);
+        }
+        free(job.pcm);
+        send_response(out, server, &job);
+        if (!keep_going || ferror(out)) {
+            break;
+        }
+    }
+
+    pthread_cond_destroy(&(job.done_cond));
+    fclose(out);
+    fclose(in);
+    return NULL;
+}
+
+
+/**
+ * Removes the socket left at the given address by a server that is no
+ * longer running, if any. Anything else is left alone, so that we never
+ * delete a regular file or take over the socket of a running server.
+ *
+ * @return SUCCESS if there is nothing at the address anymore
+ *         SOCKET_IN_USE otherwise
+ */
+static int remove_stale_socket(struct sockaddr_un* address) {
+    struct stat info;
+    if (lstat(address->sun_path, &info) != 0) {
+        return SUCCESS;
+    }
+    if (!S_ISSOCK(info.st_mode)) {
+        return SOCKET_IN_USE;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return SOCKET_IN_USE;
+    }
+    int running = connect(fd, (struct sockaddr*)address, sizeof(*address)) == 0;
+    close(fd);
+    if (running) {
+        return SOCKET_IN_USE;
+    }
+    unlink(address->sun_path);
+    return SUCCESS;
+}
+
+
+int serve(const char* socket_path, struct index* database, struct lsh* lsh, unsigned int n_workers) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        return CANNOT_READ_FILE;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    struct server server;
+    server.database = database;
+    server.lsh = lsh;
+    server.first_job = NULL;
+    server.last_job = NULL;
+    if (SUCCESS != remove_stale_socket(&address)) {
+        return SOCKET_IN_USE;
+    }
+    server.socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.socket < 0) {
+        return CANNOT_READ_FILE;
+    }
+    if (bind(server.socket, (struct sockaddr*)&address, sizeof(address)) < 0
+        || listen(server.socket, SOMAXCONN) < 0) {
+        close(server.socket);
+        return CANNOT_READ_FILE;
+    }
+
+    // We don't want to be killed because a client went
+    // away before reading its response
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_mutex_init(&(server.lock), NULL);
+    pthread_cond_init(&(server.job_available), NULL);
+    for (unsigned int k = 0 ; k < n_workers ; k++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, (void* (*)(void*))launch_worker, &server);
+        pthread_detach(thread);
+    }
+
+    // Each connection gets its own lightweight thread that only
+    // reads requests and writes responses
+    while (1) {
+        int fd = accept(server.socket, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        struct connection* connection = (struct connection*)malloc(sizeof(struct connection));
+        if (connection == NULL) {
+            close(fd);
+            continue;
+        }
+        connection->server = &server;
+        connection->fd = fd;
+        pthread_t thread;
+        if (0 != pthread_create(&thread, NULL, (void* (*)(void*))handle_connection, connection)) {
+            free(connection);
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return SUCCESS;
+}
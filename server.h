@@ -0,0 +1,49 @@
+#ifndef _SERVER_H
+#define _SERVER_H
+
+#include "fingerprintio.h"
+#include "lsh.h"
+
+// The maximum size of a raw PCM payload that a client can send
+// in a single request (about 10 minutes of 44100Hz 16-bit stereo)
+#define MAX_PCM_BYTES (10 * 60 * 44100 * 4)
+
+/**
+ * Listens on the given Unix socket path and answers identification requests
+ * using the given database and hash tables that stay loaded in memory for the
+ * whole life of the server. Each connection is read by its own thread, but the
+ * fingerprinting and search work is done by a fixed pool of worker threads, in
+ * the order the requests arrive. A client can send as many requests as it wants
+ * on a connection, each request being one of:
+ *
+ * FILE <path>\n
+ *   Identifies the given file, converting it with ffmpeg if needed
+ *
+ * PCM <n>\n<n bytes>
+ *   Identifies the given raw 44100Hz 16-bit little-endian stereo samples
+ *
+ * For each request, the server sends back a single line containing a JSON
+ * object like this:
+ *
+ * {"status":"ok","match":"song.wav","artist":"","track_title":"","album_title":"",
+ *  "fingerprint_ms":12.345,"search_ms":1.234}
+ *
+ * where status is one of "ok", "no_match" or "error". In case of error, the object
+ * contains an "error" field describing the problem.
+ *
+ * This function only returns if the server cannot be started.
+ *
+ * @param socket_path The path of the Unix socket to create. If a stale socket
+ *                    left by a server that is no longer running exists at this
+ *                    path, it is removed
+ * @param database The database to search into
+ * @param lsh The hash tables to use for efficiency
+ * @param n_workers The number of worker threads
+ * @return CANNOT_READ_FILE if the socket cannot be created
+ *         SOCKET_IN_USE if the path is a file that is not a socket or the
+ *                       socket of a server that is still running
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int serve(const char* socket_path, struct index* database, struct lsh* lsh, unsigned int n_workers);
+
+#endif
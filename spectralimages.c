@@ -1,31 +1,29 @@
 #include <math.h>
-#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "fft.h"
 #include "hannwindow.h"
 #include "spectralimages.h"
+#include "threadpool.h"
 
 
-#define N_THREADS 8
+// The minimum numbers of frames and images that a
+// thread processes at once when working in parallel
+#define MIN_FRAMES_PER_CHUNK 16
+#define MIN_IMAGES_PER_CHUNK 4
 
 
 struct frames_to_bins_job {
     float* samples;
     float* bins;
     float* hann_window;
-    unsigned int first_frame;
-    unsigned int last_frame;
-    int return_code;
 };
 
 
 struct build_spectral_images_job {
     float* bins;
     struct spectral_image* images;
-    unsigned int first_image;
-    unsigned int last_image;
 };
 
 
@@ -58,11 +56,7 @@ static float scale(float value, float max) {
 }
 
 
-/**
- * This normalizes the values contained in the given spectral image
- * to distribute them between 0.0 and 1.0.
- */
-static void scale_to_full_spectrum(float* spectral_image) {
+void scale_to_full_spectrum(float* spectral_image) {
     float max = spectral_image[0];
     for (unsigned int i = 1 ; i < SPECTRAL_IMAGE_WIDTH * NUMBER_OF_BINS ; i++) {
         float f = spectral_image[i];
@@ -107,19 +101,18 @@ static int frames_to_bins(float* samples, float* bins, float* hann_window, unsig
 }
 
 
-static void* launch_frames_to_bins_job(struct frames_to_bins_job* job) {
-    job->return_code = frames_to_bins(job->samples, job->bins, job->hann_window, job->first_frame, job->last_frame);
-    return NULL;
+static int launch_frames_to_bins_job(struct frames_to_bins_job* job, unsigned int first_frame, unsigned int end) {
+    return frames_to_bins(job->samples, job->bins, job->hann_window, first_frame, end - 1);
 }
 
 
-static void* launch_build_spectral_images_job(struct build_spectral_images_job* job) {
+static int launch_build_spectral_images_job(struct build_spectral_images_job* job, unsigned int first_image, unsigned int end) {
     unsigned int size = SPECTRAL_IMAGE_WIDTH * NUMBER_OF_BINS * sizeof(float);
-    for (unsigned int i = job->first_image ; i <= job->last_image ; i++) {
+    for (unsigned int i = first_image ; i < end ; i++) {
         memcpy(job->images[i].image, &(job->bins[i * DISTANCE_BETWEEN_SPECTRAL_IMAGE_START * NUMBER_OF_BINS]), size);
         scale_to_full_spectrum(job->images[i].image);
     }
-    return NULL;
+    return SUCCESS;
 }
 
 
@@ -157,65 +150,23 @@ int build_spectral_images(float* samples, unsigned int n_samples, struct spectra
         return MEMORY_ERROR;
     }
 
-    pthread_t thread[N_THREADS];
-    struct frames_to_bins_job jobs[N_THREADS];
-    float* hann_window = get_Hann_window();
-
-    unsigned int frames_per_thread = n_frames / N_THREADS;
-    for (unsigned int k = 0 ; k < N_THREADS ; k++) {
-        unsigned int start = k * frames_per_thread;
-        unsigned int end = (k == N_THREADS - 1)
-                        ? n_frames - 1
-                        : (k + 1) * frames_per_thread - 1;
-        jobs[k].samples = samples;
-        jobs[k].bins = bins;
-        jobs[k].hann_window = hann_window;
-        jobs[k].first_frame = start;
-        jobs[k].last_frame = end;
-        jobs[k].return_code = SUCCESS;
-
-        pthread_create(&(thread[k]), NULL, (void* (*)(void*))launch_frames_to_bins_job, &(jobs[k]));
-    }
-
-    int res = SUCCESS;
-    for (unsigned int k = 0 ; k < N_THREADS ; k++) {
-	    pthread_join(thread[k], NULL);
-        if (jobs[k].return_code == MEMORY_ERROR) {
-            res = MEMORY_ERROR;
-        }
-    }
-
-    if (res == MEMORY_ERROR) {
+    struct frames_to_bins_job job;
+    job.samples = samples;
+    job.bins = bins;
+    job.hann_window = get_Hann_window();
+    if (MEMORY_ERROR == parallel_for(n_frames, MIN_FRAMES_PER_CHUNK, (parallel_function)launch_frames_to_bins_job, &job)) {
+        free(bins);
         free_spectral_images((*images));
         return MEMORY_ERROR;
     }
 
-    struct build_spectral_images_job spectral_image_jobs[N_THREADS];
-
-    unsigned int n_spectral_image_threads = N_THREADS;
-    if ((*images)->n_images < 2 * N_THREADS) {
-        n_spectral_image_threads = 1;
-    }
-
     // Now that we have calculated all the bins for all the frames,
     // it is time to build spectral images by grouping these bins
-
-    unsigned int images_per_thread = (*images)->n_images / n_spectral_image_threads;
-    for (unsigned int k = 0 ; k < n_spectral_image_threads ; k++) {
-        unsigned int start = k * images_per_thread;
-        unsigned int end = (k == n_spectral_image_threads - 1)
-                        ? (*images)->n_images - 1
-                        : (k + 1) * images_per_thread - 1;
-        spectral_image_jobs[k].images = (*images)->images;
-        spectral_image_jobs[k].bins = bins;
-        spectral_image_jobs[k].first_image = start;
-        spectral_image_jobs[k].last_image = end;
-        pthread_create(&(thread[k]), NULL, (void* (*)(void*))launch_build_spectral_images_job, &(spectral_image_jobs[k]));
-    }
-
-    for (unsigned int k = 0 ; k < n_spectral_image_threads ; k++) {
-	    pthread_join(thread[k], NULL);
-    }
+    struct build_spectral_images_job spectral_image_job;
+    spectral_image_job.images = (*images)->images;
+    spectral_image_job.bins = bins;
+    parallel_for((*images)->n_images, MIN_IMAGES_PER_CHUNK, (parallel_function)launch_build_spectral_images_job, &spectral_image_job);
+    free(bins);
 
     return SUCCESS;
 }
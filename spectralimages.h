@@ -73,6 +73,13 @@ struct spectral_images {
 int build_spectral_images(float* samples, unsigned int n_samples, struct spectral_images* *images);
 
 
+/**
+ * This normalizes the values contained in the given spectral image
+ * to distribute them between 0.0 and 1.0.
+ */
+void scale_to_full_spectrum(float* spectral_image);
+
+
 /**
  * Frees all the memory associated to the given spectral images.
  */
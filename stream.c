@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+#include "audionormalizer.h"
+#include "fft.h"
+#include "haar.h"
+#include "hannwindow.h"
+#include "rawfingerprints.h"
+#include "resample.h"
+#include "stream.h"
+
+
+struct stream_fingerprinter* new_stream_fingerprinter() {
+    struct stream_fingerprinter* f = (struct stream_fingerprinter*)calloc(1, sizeof(struct stream_fingerprinter));
+    if (f == NULL) {
+        return NULL;
+    }
+    f->squares = (float*)calloc(NORMALIZATION_WINDOW, sizeof(float));
+    if (f->squares == NULL) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+
+void free_stream_fingerprinter(struct stream_fingerprinter* f) {
+    free(f->pending_samples);
+    free(f->resampled);
+    free(f->squares);
+    free(f->new_signatures.signatures);
+    free(f);
+}
+
+
+/**
+ * Builds the spectral image that ends with the last frame, and
+ * its signature if it is neither silent nor degenerate.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int process_image(struct stream_fingerprinter* f) {
+    // The frames of the image may wrap around the end of the ring buffer
+    unsigned long first_frame = (unsigned long)f->n_images * DISTANCE_BETWEEN_SPECTRAL_IMAGE_START;
+    for (unsigned int i = 0 ; i < SPECTRAL_IMAGE_WIDTH ; i++) {
+        unsigned int frame = (first_frame + i) % FRAME_RING_SIZE;
+        memcpy(&(f->image.image[i * NUMBER_OF_BINS]), &(f->bins[frame * NUMBER_OF_BINS]), NUMBER_OF_BINS * sizeof(float));
+    }
+    scale_to_full_spectrum(f->image.image);
+    transform_image(&(f->image));
+    memset(&(f->rawfingerprint), 0, sizeof(struct rawfingerprint));
+    build_raw_fingerprint(&(f->image), &(f->rawfingerprint));
+
+    unsigned int position = (f->n_images)++;
+    if (f->rawfingerprint.is_silence) {
+        return SUCCESS;
+    }
+
+    if (f->new_signatures.n_signatures == f->signatures_capacity) {
+        unsigned int capacity = f->signatures_capacity == 0 ? 16 : 2 * f->signatures_capacity;
+        struct signature* tmp = (struct signature*)realloc(f->new_signatures.signatures, capacity * sizeof(struct signature));
+        if (tmp == NULL) {
+            return MEMORY_ERROR;
+        }
+        f->new_signatures.signatures = tmp;
+        f->signatures_capacity = capacity;
+    }
+    struct signature* signature = &(f->new_signatures.signatures[f->new_signatures.n_signatures]);
+    if (calculate_signature(&(f->rawfingerprint), signature)) {
+        signature->position = position;
+        (f->new_signatures.n_signatures)++;
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * Calculates the bins of the frame that ends with the last
+ * sample, and the spectral image that this frame completes, if any.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int process_frame(struct stream_fingerprinter* f) {
+    float* hann_window = get_Hann_window();
+    unsigned long first_sample = f->n_frames * INTERVAL_BETWEEN_FRAMES;
+    for (unsigned int j = 0 ; j < SAMPLES_PER_FRAME ; j++) {
+        f->frame[j] = f->samples[(first_sample + j) % SAMPLE_RING_SIZE] * hann_window[j];
+    }
+    if (SUCCESS != fft(f->frame, f->real, f->imaginary)) {
+        return MEMORY_ERROR;
+    }
+    calculate_bins(f->real, f->imaginary, &(f->bins[(f->n_frames % FRAME_RING_SIZE) * NUMBER_OF_BINS]));
+    (f->n_frames)++;
+
+    if (f->n_frames == (unsigned long)f->n_images * DISTANCE_BETWEEN_SPECTRAL_IMAGE_START + SPECTRAL_IMAGE_WIDTH) {
+        return process_image(f);
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * Normalizes the given 5512Hz sample, adds it to the ring buffer
+ * and processes the frame that it completes, if any.
+ *
+ * @return SUCCESS on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+static int add_sample(struct stream_fingerprinter* f, float sample) {
+    unsigned int square_index = f->n_samples % NORMALIZATION_WINDOW;
+    f->square_sum += sample * sample - f->squares[square_index];
+    f->squares[square_index] = sample * sample;
+    if (f->square_sum < 0) {
+        // Rounding errors could make it slightly negative
+        f->square_sum = 0;
+    }
+    unsigned int n = f->n_samples < NORMALIZATION_WINDOW ? f->n_samples + 1 : NORMALIZATION_WINDOW;
+    float rms = get_rms(f->square_sum, n);
+
+    f->samples[f->n_samples % SAMPLE_RING_SIZE] = normalize_sample(sample, rms);
+    (f->n_samples)++;
+
+    if (f->n_samples == f->n_frames * INTERVAL_BETWEEN_FRAMES + SAMPLES_PER_FRAME) {
+        return process_frame(f);
+    }
+    return SUCCESS;
+}
+
+
+int add_pcm_data(struct stream_fingerprinter* f, uint8_t* pcm, unsigned int size, struct signatures* *new_signatures) {
+    f->new_signatures.n_signatures = 0;
+    *new_signatures = &(f->new_signatures);
+
+    // Let's make sure we have room for all the new 44100Hz samples
+    unsigned int n_new_samples = (f->n_partial_bytes + size) / 4;
+    if (f->n_pending_samples + n_new_samples > f->pending_capacity) {
+        unsigned int capacity = f->n_pending_samples + n_new_samples;
+        float* tmp = (float*)realloc(f->pending_samples, capacity * sizeof(float));
+        if (tmp == NULL) {
+            return MEMORY_ERROR;
+        }
+        f->pending_samples = tmp;
+        tmp = (float*)realloc(f->resampled, (capacity / 8 + 1) * sizeof(float));
+        if (tmp == NULL) {
+            return MEMORY_ERROR;
+        }
+        f->resampled = tmp;
+        f->pending_capacity = capacity;
+    }
+
+    // Let's convert the new data to mono float samples, like read_samples() does
+    for (unsigned int i = 0 ; i < size ; i++) {
+        f->partial_sample[(f->n_partial_bytes)++] = pcm[i];
+        if (f->n_partial_bytes == 4) {
+            int16_t left = (int16_t)(f->partial_sample[0] + (f->partial_sample[1] << 8));
+            int16_t right = (int16_t)(f->partial_sample[2] + (f->partial_sample[3] << 8));
+            f->pending_samples[(f->n_pending_samples)++] = ((left + right) / 2.0f) / 32767.0;
+            f->n_partial_bytes = 0;
+        }
+    }
+
+    // Now we can resample what we can and keep the rest for later
+    unsigned int n = resample_available(f->pending_samples, f->n_pending_samples, f->resampled);
+    f->n_pending_samples -= 8 * n;
+    memmove(f->pending_samples, f->pending_samples + 8 * n, f->n_pending_samples * sizeof(float));
+
+    for (unsigned int i = 0 ; i < n ; i++) {
+        if (MEMORY_ERROR == add_sample(f, f->resampled[i])) {
+            return MEMORY_ERROR;
+        }
+    }
+    return f->new_signatures.n_signatures;
+}
@@ -0,0 +1,105 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <stdint.h>
+#include "errors.h"
+#include "minhash.h"
+
+// The number of 5512Hz samples used to compute the loudness of the
+// stream when normalizing it, i.e. the last 10 seconds
+#define NORMALIZATION_WINDOW (10 * 5512)
+
+// The sizes of the ring buffers holding the most recent 5512Hz samples and
+// the bins of the most recent frames. They are powers of 2 big enough to
+// hold a whole frame and a whole spectral image
+#define SAMPLE_RING_SIZE (2 * SAMPLES_PER_FRAME)
+#define FRAME_RING_SIZE (2 * SPECTRAL_IMAGE_WIDTH)
+
+
+/**
+ * When listening to continuous audio, recomputing the fingerprint of the
+ * last few seconds every time new audio arrives means redoing most of the
+ * work again and again, since consecutive windows overlap almost entirely.
+ * A stream fingerprinter works like generate_fingerprint_from_samples(), but
+ * incrementally: it keeps the most recent samples and frames in ring buffers,
+ * and only computes the frames, spectral images and signatures that the
+ * newly arrived audio makes complete.
+ *
+ * The only difference with the fingerprint of a whole file is the audio
+ * normalization, which uses the loudness of the last NORMALIZATION_WINDOW
+ * samples instead of the loudness of the whole file.
+ */
+struct stream_fingerprinter {
+    // The bytes of an incomplete 16-bit stereo sample,
+    // waiting for the next data to arrive
+    uint8_t partial_sample[4];
+    unsigned int n_partial_bytes;
+
+    // The 44100Hz mono samples that cannot be resampled yet, and
+    // room for the 5512Hz samples that they will produce
+    float* pending_samples;
+    float* resampled;
+    unsigned int n_pending_samples;
+    unsigned int pending_capacity;
+
+    // The squares of the last NORMALIZATION_WINDOW 5512Hz samples
+    // before normalization, and their sum
+    float* squares;
+    double square_sum;
+
+    // The normalized 5512Hz samples. Sample n is at n % SAMPLE_RING_SIZE
+    float samples[SAMPLE_RING_SIZE];
+    unsigned long n_samples;
+
+    // The bins of the frames. Frame n is at n % FRAME_RING_SIZE
+    float bins[FRAME_RING_SIZE * NUMBER_OF_BINS];
+    unsigned long n_frames;
+
+    // The number of spectral images processed so far
+    unsigned int n_images;
+
+    // Scratch memory
+    float frame[SAMPLES_PER_FRAME];
+    float real[SAMPLES_PER_FRAME];
+    float imaginary[SAMPLES_PER_FRAME];
+    struct spectral_image image;
+    struct rawfingerprint rawfingerprint;
+
+    // The signatures produced by the last call to add_pcm_data()
+    struct signatures new_signatures;
+    unsigned int signatures_capacity;
+};
+
+
+/**
+ * Creates a new stream fingerprinter.
+ *
+ * @return The fingerprinter or NULL in case of memory allocation error
+ */
+struct stream_fingerprinter* new_stream_fingerprinter();
+
+
+/**
+ * Feeds the given 44100Hz 16-bit little-endian stereo PCM data to the given
+ * fingerprinter. The data can be cut anywhere, even in the middle of a sample.
+ *
+ * @param f The fingerprinter
+ * @param pcm The PCM data
+ * @param size The number of bytes of PCM data
+ * @param new_signatures Where to store a pointer to the signatures that
+ *                       the new data made it possible to compute. Their
+ *                       positions count spectral images from the beginning
+ *                       of the stream. They belong to the fingerprinter and
+ *                       are only valid until the next call
+ * @return The number of new signatures on success
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int add_pcm_data(struct stream_fingerprinter* f, uint8_t* pcm, unsigned int size, struct signatures* *new_signatures);
+
+
+/**
+ * Frees all the memory associated to the given fingerprinter.
+ */
+void free_stream_fingerprinter(struct stream_fingerprinter* f);
+
+#endif
@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+// Each parallel loop is cut into about CHUNKS_PER_THREAD chunks per thread,
+// which is enough to balance the load without too much synchronization
+#define CHUNKS_PER_THREAD 4
+
+
+struct parallel_job {
+    parallel_function f;
+    void* data;
+    unsigned int n_items;
+    unsigned int chunk_size;
+
+    // The first item that has not been given to a thread yet
+    unsigned int next_item;
+    // The number of items that have been processed
+    unsigned int n_done;
+    int return_code;
+    pthread_cond_t done_cond;
+
+    struct parallel_job* next;
+};
+
+
+struct thread_pool {
+    // The number of threads, including the one calling parallel_for()
+    unsigned int size;
+
+    // The jobs that still have items to give away
+    struct parallel_job* first_job;
+    struct parallel_job* last_job;
+    pthread_mutex_t lock;
+    pthread_cond_t job_available;
+};
+
+
+static unsigned int requested_size = 0;
+static struct thread_pool pool;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+
+void set_thread_pool_size(unsigned int n_threads) {
+    requested_size = n_threads;
+}
+
+
+static unsigned int get_default_size() {
+    char* env = getenv(THREADS_ENV_VARIABLE);
+    if (env != NULL) {
+        int n = atoi(env);
+        if (n > 0) {
+            return n;
+        }
+    }
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return n_cpus < 1 ? 1 : (unsigned int)n_cpus;
+}
+
+
+/**
+ * Takes the next chunk of the given job and processes it. The lock
+ * must be held when calling this function, and is held again on return.
+ */
+static void run_chunk(struct parallel_job* job) {
+    unsigned int first = job->next_item;
+    unsigned int end = first + job->chunk_size;
+    if (end >= job->n_items) {
+        end = job->n_items;
+        // No more items to give away, so the job can leave the queue. It is
+        // not necessarily the first one, since the thread that submitted
+        // a job also works on it
+        struct parallel_job* previous = NULL;
+        for (struct parallel_job* j = pool.first_job ; j != job ; j = j->next) {
+            previous = j;
+        }
+        if (previous == NULL) {
+            pool.first_job = job->next;
+        } else {
+            previous->next = job->next;
+        }
+        if (pool.last_job == job) {
+            pool.last_job = previous;
+        }
+    }
+    job->next_item = end;
+    pthread_mutex_unlock(&(pool.lock));
+
+    int res = job->f(job->data, first, end);
+
+    pthread_mutex_lock(&(pool.lock));
+    if (res != SUCCESS) {
+        job->return_code = res;
+    }
+    job->n_done += end - first;
+    if (job->n_done == job->n_items) {
+        pthread_cond_signal(&(job->done_cond));
+    }
+}
+
+
+static void* launch_pool_thread(void* unused) {
+    (void)unused;
+    pthread_mutex_lock(&(pool.lock));
+    while (1) {
+        while (pool.first_job == NULL) {
+            pthread_cond_wait(&(pool.job_available), &(pool.lock));
+        }
+        run_chunk(pool.first_job);
+    }
+    return NULL;
+}
+
+
+static void create_thread_pool() {
+    pool.size = requested_size > 0 ? requested_size : get_default_size();
+    if (pool.size > MAX_POOL_THREADS) {
+        pool.size = MAX_POOL_THREADS;
+    }
+    pool.first_job = NULL;
+    pool.last_job = NULL;
+    pthread_mutex_init(&(pool.lock), NULL);
+    pthread_cond_init(&(pool.job_available), NULL);
+
+    // The thread calling parallel_for() does its share of the work,
+    // so we need one thread less than the pool size
+    unsigned int n_created = 1;
+    for (unsigned int k = 1 ; k < pool.size ; k++) {
+        pthread_t thread;
+        if (0 == pthread_create(&thread, NULL, launch_pool_thread, NULL)) {
+            pthread_detach(thread);
+            n_created++;
+        }
+    }
+    pool.size = n_created;
+}
+
+
+unsigned int get_thread_pool_size() {
+    pthread_once(&pool_once, create_thread_pool);
+    return pool.size;
+}
+
+
+int parallel_for(unsigned int n_items, unsigned int min_chunk_size, parallel_function f, void* data) {
+    if (n_items == 0) {
+        return SUCCESS;
+    }
+    unsigned int n_threads = get_thread_pool_size();
+    unsigned int chunk_size = n_items / (n_threads * CHUNKS_PER_THREAD);
+    if (chunk_size < min_chunk_size) {
+        chunk_size = min_chunk_size;
+    }
+    if (chunk_size == 0) {
+        chunk_size = 1;
+    }
+    if (n_threads == 1 || chunk_size >= n_items) {
+        // Not worth waking anybody up
+        return f(data, 0, n_items);
+    }
+
+    struct parallel_job job;
+    job.f = f;
+    job.data = data;
+    job.n_items = n_items;
+    job.chunk_size = chunk_size;
+    job.next_item = 0;
+    job.n_done = 0;
+    job.return_code = SUCCESS;
+    job.next = NULL;
+    pthread_cond_init(&(job.done_cond), NULL);
+
+    pthread_mutex_lock(&(pool.lock));
+    if (pool.last_job == NULL) {
+        pool.first_job = &job;
+    } else {
+        pool.last_job->next = &job;
+    }
+    pool.last_job = &job;
+    pthread_cond_broadcast(&(pool.job_available));
+
+    // Let's work on our own job until all its items have been given away,
+    // and then wait for the other threads to finish their chunks
+    while (job.next_item < job.n_items) {
+        run_chunk(&job);
+    }
+    while (job.n_done < job.n_items) {
+        pthread_cond_wait(&(job.done_cond), &(pool.lock));
+    }
+    pthread_mutex_unlock(&(pool.lock));
+
+    pthread_cond_destroy(&(job.done_cond));
+    return job.return_code;
+}
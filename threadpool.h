@@ -0,0 +1,65 @@
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#include "errors.h"
+
+// The maximum number of threads in the pool
+#define MAX_POOL_THREADS 256
+
+// The environment variable that can be used to set the
+// number of threads instead of using one per online CPU
+#define THREADS_ENV_VARIABLE "MNEMOPHONIX_THREADS"
+
+
+/**
+ * The function that processes the items [first;end[ of a parallel loop.
+ *
+ * @param data The data passed to parallel_for()
+ * @param first The first item to process
+ * @param end The item after the last one to process
+ * @return SUCCESS on success or an error code
+ */
+typedef int (*parallel_function)(void* data, unsigned int first, unsigned int end);
+
+
+/**
+ * Sets the number of threads that will be used by parallel loops. This has
+ * no effect once a parallel loop has been run, since the pool threads are
+ * created on first use and then kept for the whole life of the process.
+ * By default, the number of threads is read from the MNEMOPHONIX_THREADS
+ * environment variable or, if it is not set, the number of online CPUs.
+ *
+ * @param n_threads The number of threads, including the calling one
+ */
+void set_thread_pool_size(unsigned int n_threads);
+
+
+/**
+ * Returns the number of threads that parallel loops use, including the calling one.
+ */
+unsigned int get_thread_pool_size();
+
+
+/**
+ * Runs the given function on all the items in [0;n_items[, in parallel.
+ * Creating threads for every parallel step would waste time on short
+ * inputs, so the work is done by a shared pool of threads created once,
+ * and by the calling thread itself. Several threads can run parallel loops
+ * at the same time, since their chunks are all served by the same pool.
+ *
+ * Instead of splitting the items into one range per thread in advance,
+ * the threads take chunks of items one after the other as they become free,
+ * so that a slow chunk does not leave the other threads with nothing to do.
+ *
+ * @param n_items The number of items to process
+ * @param min_chunk_size The minimum number of items per chunk, so that chunks are
+ *                       not so small that distributing them costs more than
+ *                       processing them
+ * @param f The function to run on each chunk
+ * @param data The data to pass to the function
+ * @return SUCCESS if all the chunks were successfully processed
+ *         the error code returned by one of the failing chunks otherwise
+ */
+int parallel_for(unsigned int n_items, unsigned int min_chunk_size, parallel_function f, void* data);
+
+#endif
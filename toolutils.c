@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "toolutils.h"
+
+
+static uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+
+void set_random_state(uint64_t state) {
+    random_state = state;
+}
+
+
+uint64_t next_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+
+float random_float() {
+    return (next_random() >> 40) / (float)(1 << 24);
+}
+
+
+double random_double() {
+    return (next_random() >> 11) / (double)(1ULL << 53);
+}
+
+
+double time_in_milliseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+
+long get_peak_rss_in_kb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    // MacOS gives it in bytes
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+
+static int compare_doubles(const double* a, const double* b) {
+    return (*a > *b) - (*a < *b);
+}
+
+
+double get_percentile(double* values, unsigned int n, unsigned int percentile) {
+    if (n == 0) {
+        return 0;
+    }
+    qsort(values, n, sizeof(double), (int (*)(const void*, const void*))compare_doubles);
+    unsigned int index = (n * percentile + 99) / 100;
+    return values[index > 0 ? index - 1 : 0];
+}
@@ -0,0 +1,55 @@
+#ifndef _TOOLUTILS_H
+#define _TOOLUTILS_H
+
+#include <stdint.h>
+
+/**
+ * Helpers shared by the command line program and the benchmark and
+ * test data generation programs. They are not part of the library.
+ */
+
+
+/**
+ * Sets the state of the random generator, which must not be 0, so
+ * that programs can generate reproducible data from their seed.
+ */
+void set_random_state(uint64_t state);
+
+
+/**
+ * Returns the next value of a xorshift generator, so that the generated
+ * data is the same on all platforms.
+ */
+uint64_t next_random();
+
+
+/**
+ * Returns a random float in [0;1[.
+ */
+float random_float();
+
+
+/**
+ * Returns a random double in [0;1[.
+ */
+double random_double();
+
+
+/**
+ * Returns the value of a monotonic clock in milliseconds.
+ */
+double time_in_milliseconds();
+
+
+/**
+ * Returns the maximum resident set size of the process so far, in kilobytes.
+ */
+long get_peak_rss_in_kb();
+
+
+/**
+ * Returns the given percentile of the given values, that are sorted by this function.
+ */
+double get_percentile(double* values, unsigned int n, unsigned int percentile);
+
+#endif
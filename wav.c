@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "audionormalizer.h"
+#include "profiler.h"
 #include "resample.h"
 #include "wav.h"
 
@@ -300,24 +301,30 @@ int new_wav_reader(const char* wav, struct wav_reader* *reader) {
 
 
 void free_wav_reader(struct wav_reader* reader) {
-    fclose(reader->f);
+    if (reader->f != NULL) {
+        fclose(reader->f);
+    }
     free(reader->artist);
     free(reader->track_title);
     free(reader->album_title);
     free(reader);
 }
 
-int convert_samples(uint8_t* src_samples, unsigned int src_size, float* *dst_samples) {
+int convert_samples(uint8_t* src_samples, unsigned int src_size, float* *dst_samples, struct arena* arena) {
     unsigned int n_samples = src_size / 4;
-    float* samples_44100Hz = (float*)malloc(n_samples * sizeof(float));
+    float* samples_44100Hz = (float*)arena_alloc(arena, n_samples * sizeof(float));
     if (samples_44100Hz == NULL) {
         return MEMORY_ERROR;
     }
+    count_profile_bytes(PROFILE_DECODE, n_samples * sizeof(float));
 
+    struct profile_span span;
+    begin_span(&span, PROFILE_DECODE);
     for (unsigned int i = 0 ; i < n_samples ; i++) {
         unsigned int base = 4 * i;
-        uint16_t sample1 = src_samples[base] + (src_samples[base + 1] << 8);
-        uint16_t sample2 = src_samples[base + 2] + (src_samples[base + 3] << 8);
+        // Each 16-bit sample must be converted to a signed int
+        int16_t sample1 = (int16_t)(src_samples[base] + (src_samples[base + 1] << 8));
+        int16_t sample2 = (int16_t)(src_samples[base + 2] + (src_samples[base + 3] << 8));
 
         // To get a mono float sample, we need to take the average by
         // dividing by the number of channels and then to normalize
@@ -325,11 +332,12 @@ int convert_samples(uint8_t* src_samples, unsigned int src_size, float* *dst_sam
         float res = ((sample1 + sample2) / 2.0) / 32767.0;
         samples_44100Hz[i] = res;
     }
+    end_span(&span, n_samples);
 
     // Now we have mono 44100Hz samples between 0 and 1. It is
     // time to resample to 5512Hz
-    (*dst_samples) = resample(samples_44100Hz, n_samples);
-    free(samples_44100Hz);
+    (*dst_samples) = resample(samples_44100Hz, n_samples, arena);
+    arena_free(arena, samples_44100Hz);
     if ((*dst_samples) == NULL) {
         return MEMORY_ERROR;
     }
@@ -342,46 +350,62 @@ int convert_samples(uint8_t* src_samples, unsigned int src_size, float* *dst_sam
 }
 
 
-int read_samples(struct wav_reader* reader, float* *samples) {
+/**
+ * Converts the given block of 16-bit samples, one per channel, into
+ * a mono float sample between -1.0 and 1.0.
+ */
+static float to_mono_sample(struct wav_reader* reader, uint8_t* block) {
+    int sum = 0;
+    for (unsigned int j = 0 ; j < reader->wChannels ; j++) {
+        // Each 16-bit sample must be converted to a signed int
+        uint16_t sample = block[2 * j] + (block[2 * j + 1] << 8);
+        sum +=  (int16_t)sample;
+    }
+    // To get a mono float sample, we need to take the average by
+    // dividing by the number of channels and then to normalize
+    // the value between -32767.0 and 32767.0 into a value between -1.0 and 1.0
+    float res = ((sum / (float)reader->wChannels)) / 32767.0;
+    return res;
+}
+
+
+int read_samples(struct wav_reader* reader, float* *samples, struct arena* arena) {
     fprintf(stderr, "Reading 44100Hz samples...\n");
     unsigned int n_samples = reader->data_chunk_size / reader->wBlockAlign;
-    float* samples_44100Hz = (float*)malloc(n_samples * sizeof(float));
+    float* samples_44100Hz = (float*)arena_alloc(arena, n_samples * sizeof(float));
     if (samples_44100Hz == NULL) {
         return MEMORY_ERROR;
     }
 
     int n_src_bytes_for_one_dest_sample = reader->wBlockAlign;
-    uint8_t* src_samples = (uint8_t*)malloc(n_src_bytes_for_one_dest_sample);
+    uint8_t* src_samples = (uint8_t*)arena_alloc(arena, n_src_bytes_for_one_dest_sample);
     if (src_samples == NULL) {
-        return DECODING_ERROR;
+        arena_free(arena, samples_44100Hz);
+        return MEMORY_ERROR;
     }
+    count_profile_bytes(PROFILE_DECODE, n_samples * sizeof(float) + n_src_bytes_for_one_dest_sample);
+
+    struct profile_span span;
+    begin_span(&span, PROFILE_DECODE);
     for (unsigned int i = 0 ; i < n_samples ; i++) {
         if (!read_bytes(reader->f, n_src_bytes_for_one_dest_sample, src_samples)) {
-            free(src_samples);
-            free(samples_44100Hz);
+            end_span(&span, i);
+            arena_free(arena, src_samples);
+            arena_free(arena, samples_44100Hz);
             return DECODING_ERROR;
         }
-        int sum = 0;
-        for (unsigned int j = 0 ; j < reader->wChannels ; j++) {
-            // Each 16-bit sample must be converted to a signed int
-            uint16_t sample = src_samples[2 * j] + (src_samples[2 * j + 1] << 8);
-            sum +=  (int16_t)sample;
-        }
-        // To get a mono float sample, we need to take the average by
-        // dividing by the number of channels and then to normalize
-        // the value between -32767.0 and 32767.0 into a value between -1.0 and 1.0
-        float res = ((sum / (float)reader->wChannels)) / 32767.0;
-        samples_44100Hz[i] = res;
+        samples_44100Hz[i] = to_mono_sample(reader, src_samples);
     }
+    end_span(&span, n_samples);
 
-    free(src_samples);
+    arena_free(arena, src_samples);
 
     fprintf(stderr, "Resampling to 5512Hz...\n");
 
     // Now we have mono 44100Hz samples between 0 and 1. It is
     // time to resample to 5512Hz
-    (*samples) = resample(samples_44100Hz, n_samples);
-    free(samples_44100Hz);
+    (*samples) = resample(samples_44100Hz, n_samples, arena);
+    arena_free(arena, samples_44100Hz);
     if ((*samples) == NULL) {
         return MEMORY_ERROR;
     }
@@ -392,3 +416,38 @@ int read_samples(struct wav_reader* reader, float* *samples) {
 
     return n_samples / 8;
 }
+
+
+void rewind_wav_reader(struct wav_reader* reader) {
+    fseek(reader->f, reader->data_chunk_position, SEEK_SET);
+}
+
+
+int read_next_samples(struct wav_reader* reader, float* samples, unsigned int max) {
+    long position = ftell(reader->f) - reader->data_chunk_position;
+    if (position < 0) {
+        return DECODING_ERROR;
+    }
+    unsigned int n_samples = (reader->data_chunk_size - position) / reader->wBlockAlign;
+    if (n_samples > max) {
+        n_samples = max;
+    }
+
+    uint8_t* block = (uint8_t*)malloc(reader->wBlockAlign);
+    if (block == NULL) {
+        return MEMORY_ERROR;
+    }
+    struct profile_span span;
+    begin_span(&span, PROFILE_DECODE);
+    for (unsigned int i = 0 ; i < n_samples ; i++) {
+        if (!read_bytes(reader->f, reader->wBlockAlign, block)) {
+            end_span(&span, i);
+            free(block);
+            return DECODING_ERROR;
+        }
+        samples[i] = to_mono_sample(reader, block);
+    }
+    end_span(&span, n_samples);
+    free(block);
+    return n_samples;
+}
@@ -1,7 +1,9 @@
 #ifndef _WAV_H
 #define _WAV_H
 
+#include <stdint.h>
 #include <stdio.h>
+#include "arena.h"
 #include "errors.h"
 
 struct wav_reader {
@@ -67,11 +69,35 @@ void free_wav_reader(struct wav_reader* reader);
  * @param reader The reader to read from
  * @param samples Where to allocate space for the results.
  *                The caller is responsible for freeing this array
+ *                with arena_free()
+ * @param arena The arena to allocate memory from, or NULL to use malloc()
  * @return the number of samples that were read on success
  *         DECODING_ERROR in case of I/O error when reading the file
  *         MEMORY_ERROR in case of memory allocation error
  */
-int read_samples(struct wav_reader* reader, float* *samples);
+int read_samples(struct wav_reader* reader, float* *samples, struct arena* arena);
+
+
+/**
+ * Moves back to the first sample of the file.
+ */
+void rewind_wav_reader(struct wav_reader* reader);
+
+
+/**
+ * Reads the next samples of the file as mono 44100Hz float samples between
+ * -1.0 and 1.0, exactly like read_samples() does before resampling, so that
+ * files too big to be held in memory can be processed bit by bit.
+ *
+ * @param reader The reader to read from
+ * @param samples Where to store the samples
+ * @param max The maximum number of samples to read
+ * @return the number of samples that were read on success, which is only
+ *         lower than max at the end of the file
+ *         DECODING_ERROR in case of I/O error when reading the file
+ *         MEMORY_ERROR in case of memory allocation error
+ */
+int read_next_samples(struct wav_reader* reader, float* samples, unsigned int max);
 
 
 /**
@@ -83,10 +109,12 @@ int read_samples(struct wav_reader* reader, float* *samples);
  * @param src_size The number of bytes in the source sample array
  * @param dst_samples Where to allocate space for the results.
  *                The caller is responsible for freeing this array
+ *                with arena_free()
+ * @param arena The arena to allocate memory from, or NULL to use malloc()
  * @return the number of samples that were read on success
  *         DECODING_ERROR in case of I/O error when reading the file
  *         MEMORY_ERROR in case of memory allocation error
  */
-int convert_samples(uint8_t* src_samples, unsigned int src_size, float* *dst_samples);
+int convert_samples(uint8_t* src_samples, unsigned int src_size, float* *dst_samples, struct arena* arena);
 
 #endif